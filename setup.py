@@ -109,12 +109,22 @@ setup(
     ext_modules=[
         Extension("_smbc", [
             "smbc/smbcmodule.c",
+            "smbc/bulkstat.c",
             "smbc/context.c",
+            "smbc/digest.c",
             "smbc/dir.c",
+            "smbc/dircache.c",
             "smbc/file.c",
-            "smbc/smbcdirent.c"
+            "smbc/pool.c",
+            "smbc/readahead.c",
+            "smbc/smbcdirent.c",
+            "smbc/snapshot.c",
+            "smbc/transfer.c",
+            "smbc/tree.c",
+            "smbc/watch.c",
+            "smbc/writebehind.c"
         ],
-        libraries=["smbclient"],
+        libraries=["smbclient", "pthread"],
         library_dirs=pkgconfig_L("smbclient"),
         include_dirs=pkgconfig_I("smbclient"),
         define_macros=pkgconfig_Dversion("smbclient"),
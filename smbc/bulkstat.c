@@ -0,0 +1,140 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "bulkstat.h"
+#include "pool.h"
+
+//////////////
+// Bulkstat //
+//////////////
+
+/*
+  Workers take the URIs in blocks of up to BULKSTAT_BLOCK, stat a
+  whole block without the GIL, then take it once to store the results.
+  So the GIL is not fought over for every URI, and only a block's
+  worth of struct stat is held per worker however many URIs there are.
+  Short lists are split into smaller blocks to keep every worker busy.
+*/
+
+#define BULKSTAT_BLOCK 64
+
+struct bulkstat_job
+{
+  struct pool_uris uris;
+  Py_ssize_t block;
+  bool return_exceptions;
+};
+
+static void
+bulkstat_worker (void *arg)
+{
+  struct bulkstat_job *job = arg;
+  struct stat st[BULKSTAT_BLOCK];
+  int errs[BULKSTAT_BLOCK];
+  smbc_stat_fn fn = NULL;
+  Py_ssize_t start, k, count;
+  SMBCCTX *c;
+  int err;
+
+  c = pool_uris_connect (&job->uris, &err);
+  if (c)
+    fn = smbc_getFunctionStat (c);
+
+  while ((count = pool_uris_next (&job->uris, job->block, &start)) > 0)
+    {
+      PyGILState_STATE gstate;
+
+      for (k = 0; k < count; k++)
+	{
+	  errs[k] = 0;
+	  if (c == NULL)
+	    errs[k] = err;
+	  else
+	    {
+	      errno = 0;
+	      if ((*fn) (c, job->uris.uris[start + k], &st[k]) < 0)
+		errs[k] = errno ? errno : EIO;
+	    }
+
+	  if (errs[k] && !job->return_exceptions)
+	    {
+	      pool_uris_fail (&job->uris, errs[k]);
+	      break;
+	    }
+	}
+
+      /* The results are thrown away once an error is to be raised. */
+      if (k < count)
+	continue;
+
+      gstate = PyGILState_Ensure ();
+      for (k = 0; k < count; k++)
+	{
+	  PyObject *result;
+
+	  if (errs[k])
+	    result = pysmbc_ErrorFromErrno (errs[k]);
+	  else
+	    {
+	      result = pysmbc_StatTuple (&st[k]);
+	      if (result == NULL)
+		result = pysmbc_TakeError ();
+	    }
+
+	  PyList_SET_ITEM (job->uris.results, start + k, result);
+	}
+
+      PyGILState_Release (gstate);
+    }
+
+  context_clone_free (c);
+}
+
+PyObject *
+bulkstat_many (Context *ctx, PyObject *uris, unsigned workers,
+	       bool return_exceptions)
+{
+  struct bulkstat_job job;
+  Py_ssize_t n;
+
+  if (pool_uris_init (&job.uris, ctx, uris) < 0)
+    return NULL;
+
+  n = job.uris.n;
+  if ((Py_ssize_t) workers > n)
+    workers = n;
+
+  job.block = workers > 0 ? (n + workers - 1) / workers : 0;
+  if (job.block > BULKSTAT_BLOCK)
+    job.block = BULKSTAT_BLOCK;
+
+  job.return_exceptions = return_exceptions;
+  pool_uris_run (&job.uris, workers, bulkstat_worker, &job);
+  pool_uris_free (&job.uris);
+  if (job.uris.err)
+    {
+      Py_CLEAR (job.uris.results);
+      errno = job.uris.err;
+      pysmbc_SetFromErrno ();
+    }
+
+  return job.uris.results;
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_BULKSTAT_H
+#define HAVE_BULKSTAT_H
+
+#define BULKSTAT_DEFAULT_WORKERS 8
+
+/*
+  Stat each of a sequence of URIs, 'workers' at a time, each worker
+  over its own connection (see context_clone).  Returns a list holding,
+  for each URI, its stat tuple, or the exception statting it raised.
+  If not 'return_exceptions', the first error stops the rest and is
+  raised instead.
+*/
+extern PyObject *bulkstat_many (Context *ctx, PyObject *uris,
+				unsigned workers, bool return_exceptions);
+
+#endif /* HAVE_BULKSTAT_H */
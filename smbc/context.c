@@ -27,10 +27,18 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <fcntl.h>
 #include "smbcmodule.h"
 #include "context.h"
+#include "bulkstat.h"
 #include "dir.h"
+#include "dircache.h"
+#include "digest.h"
 #include "file.h"
+#include "snapshot.h"
+#include "watch.h"
+#include "transfer.h"
+#include "tree.h"
 
 static void
 auth_fn (SMBCCTX *ctx,
@@ -42,35 +50,46 @@ auth_fn (SMBCCTX *ctx,
   PyObject *args;
   PyObject *kwds;
   PyObject *result;
+  PyObject *callback;
   Context *self;
   const char *use_workgroup, *use_username, *use_password;
+  PyGILState_STATE gstate;
 
   debugprintf ("-> auth_fn (server=%s, share=%s)\n",
 	       server ? server : "",
 	       share ? share : "");
 
-  self = smbc_getOptionUserData (ctx);
-  if (self->auth_fn == NULL)
+  if (!server || !*server)
     {
-      debugprintf ("<- auth_fn (), no callback\n");
+      debugprintf ("<- auth_fn(), no server\n");
       return;
     }
 
-  if (!server || !*server)
+  /* libsmbclient calls are made without the GIL held. */
+  gstate = PyGILState_Ensure ();
+  self = smbc_getOptionUserData (ctx);
+  callback = self->auth_fn;
+  if (callback == NULL)
     {
-      debugprintf ("<- auth_fn(), no server\n");
+      PyGILState_Release (gstate);
+      debugprintf ("<- auth_fn (), no callback\n");
       return;
     }
 
+  /* A worker's clone calls this without the Context's lock, so the
+     callback may be replaced meanwhile. */
+  Py_INCREF (callback);
   args = Py_BuildValue ("(sssss)", server, share, workgroup,
 			username, password);
   kwds = PyDict_New ();
 
-  result = PyObject_Call (self->auth_fn, args, kwds);
+  result = PyObject_Call (callback, args, kwds);
+  Py_DECREF (callback);
   Py_DECREF (args);
   Py_DECREF (kwds);
   if (result == NULL)
     {
+      PyGILState_Release (gstate);
       debugprintf ("<- auth_fn(), failed callback\n");
       return;
     }
@@ -81,6 +100,7 @@ auth_fn (SMBCCTX *ctx,
 			 &use_password))
     {
       Py_DECREF (result);
+      PyGILState_Release (gstate);
       debugprintf ("<- auth_fn(), incorrect callback result\n");
       return;
     }
@@ -92,6 +112,7 @@ auth_fn (SMBCCTX *ctx,
   strncpy (password, use_password, pwmaxlen - 1);
   password[pwmaxlen - 1] = '\0';
   Py_DECREF (result);
+  PyGILState_Release (gstate);
   debugprintf ("<- auth_fn(), got callback result\n");
 }
 
@@ -99,13 +120,89 @@ auth_fn (SMBCCTX *ctx,
 // Context //
 /////////////
 
+SMBCCTX *
+context_clone (Context *self)
+{
+  SMBCCTX *src = self->context;
+  SMBCCTX *ctx;
+  int err;
+
+  errno = 0;
+  ctx = smbc_new_context ();
+  if (ctx == NULL)
+    return NULL;
+
+  PyThread_acquire_lock (self->lock, WAIT_LOCK);
+  smbc_setDebug (ctx, smbc_getDebug (src));
+  if (smbc_getNetbiosName (src))
+    smbc_setNetbiosName (ctx, smbc_getNetbiosName (src));
+  if (smbc_getWorkgroup (src))
+    smbc_setWorkgroup (ctx, smbc_getWorkgroup (src));
+  if (smbc_getUser (src))
+    smbc_setUser (ctx, smbc_getUser (src));
+  smbc_setTimeout (ctx, smbc_getTimeout (src));
+  smbc_setPort (ctx, smbc_getPort (src));
+  smbc_setOptionDebugToStderr (ctx, smbc_getOptionDebugToStderr (src));
+  smbc_setOptionFullTimeNames (ctx, smbc_getOptionFullTimeNames (src));
+  smbc_setOptionNoAutoAnonymousLogin (ctx,
+				      smbc_getOptionNoAutoAnonymousLogin (src));
+  smbc_setOptionUseKerberos (ctx, smbc_getOptionUseKerberos (src));
+  smbc_setOptionFallbackAfterKerberos (ctx,
+				       smbc_getOptionFallbackAfterKerberos (src));
+  smbc_setOptionUserData (ctx, self);
+  if (self->auth_fn)
+    smbc_setFunctionAuthDataWithContext (ctx, auth_fn);
+#if SMBCLIENT_VERSION >= 500 /* 0.5.0 or newer */
+  if (self->proto)
+    smbc_setOptionProtocols (ctx, self->proto, self->proto);
+#endif
+  PyThread_release_lock (self->lock);
+
+  if (smbc_init_context (ctx) == NULL)
+    {
+      err = errno;
+      smbc_free_context (ctx, 0);
+      errno = err;
+      return NULL;
+    }
+
+  PyThread_acquire_lock (self->lock, WAIT_LOCK);
+  if (self->cred_user)
+    smbc_set_credentials_with_fallback (ctx, self->cred_workgroup,
+					self->cred_user, self->cred_password);
+  PyThread_release_lock (self->lock);
+
+  debugprintf ("%p context_clone() = %p\n", src, ctx);
+  return ctx;
+}
+
+void
+context_clone_free (SMBCCTX *ctx)
+{
+  if (ctx)
+    smbc_free_context (ctx, 1);
+}
+
 static PyObject *
 Context_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
   Context *self;
   self = (Context *) type->tp_alloc (type, 0);
-  if (self != NULL)
-    self->context = NULL;
+  if (self == NULL)
+    return NULL;
+
+  self->context = NULL;
+  self->proto = NULL;
+  self->cred_workgroup = NULL;
+  self->cred_user = NULL;
+  self->cred_password = NULL;
+  self->lock = PyThread_allocate_lock ();
+  self->dircache = dircache_new ();
+  if (self->lock == NULL || self->dircache == NULL)
+    {
+      Py_DECREF (self);
+      return PyErr_NoMemory ();
+    }
 
   return (PyObject *) self;
 }
@@ -175,6 +272,8 @@ Context_init (Context *self, PyObject *args, PyObject *kwds)
     debugprintf("-> Setting client min/max protocol to %s by smbc_setOptionProtocols\n", proto);
     smbc_setOptionProtocols(ctx, proto, proto);
 #endif
+    free (self->proto);
+    self->proto = strdup (proto);
   }
 
   if (smbc_init_context (ctx) == NULL)
@@ -195,9 +294,21 @@ Context_dealloc (Context *self)
   if (self->context)
     {
       debugprintf ("%p smbc_free_context()\n", self->context);
+      Py_BEGIN_ALLOW_THREADS
       smbc_free_context (self->context, 1);
+      Py_END_ALLOW_THREADS
     }
 
+  if (self->lock)
+    PyThread_free_lock (self->lock);
+
+  if (self->dircache)
+    dircache_free (self->dircache);
+
+  free (self->proto);
+  free (self->cred_workgroup);
+  free (self->cred_user);
+  free (self->cred_password);
   Py_XDECREF (self->auth_fn);
   Py_TYPE(self)->tp_free ((PyObject *) self);
 }
@@ -216,10 +327,20 @@ Context_set_credentials_with_fallback (Context *self, PyObject *args)
       return NULL;
     }
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_set_credentials_with_fallback (self->context,
 				      workgroup,
 				      user,
 				      password);
+
+  /* Kept for context_clone (). */
+  free (self->cred_workgroup);
+  free (self->cred_user);
+  free (self->cred_password);
+  self->cred_workgroup = strdup (workgroup);
+  self->cred_user = strdup (user);
+  self->cred_password = strdup (password);
+  CONTEXT_END_CALL (self);
   debugprintf ("%p <- Context_set_credentials_with_fallback()\n",
 	       self->context);
   Py_RETURN_NONE;
@@ -267,13 +388,17 @@ Context_open (Context *self, PyObject *args)
             break;
           } /*if*/
         fn_open = smbc_getFunctionOpen(self->context);
+        CONTEXT_BEGIN_CALL (self);
         errno = 0;
         file->file = fn_open(self->context, uri, (int)flags, (mode_t)mode);
+        CONTEXT_END_CALL (self);
         if (file->file == NULL)
           {
             pysmbc_SetFromErrno();
             break;
           } /*if*/
+        if (flags & O_CREAT)
+            dircache_invalidate (self->dircache, uri, false);
         debugprintf ("%p <- Context_open() = File\n", self->context);
       /* all done */
         result = (PyObject *)file;
@@ -323,13 +448,16 @@ Context_creat (Context *self, PyObject *args)
         if (smbc_FileType.tp_init((PyObject *)file, largs, lkwlist) < 0)
             break;
         fn_creat = smbc_getFunctionCreat (self->context);
+        CONTEXT_BEGIN_CALL (self);
         errno = 0;
         file->file = fn_creat(self->context, uri, mode);
+        CONTEXT_END_CALL (self);
         if (file->file == NULL)
           {
             pysmbc_SetFromErrno();
             break;
           } /*if*/
+        dircache_invalidate (self->dircache, uri, false);
       /* all done */
         result = (PyObject *)file;
         file = NULL; /* so I don't dispose of it yet */
@@ -358,14 +486,17 @@ Context_unlink (Context *self, PyObject *args)
     }
 
   fn = smbc_getFunctionUnlink (self->context);
+  CONTEXT_BEGIN_CALL (self);
   errno = 0;
   ret = (*fn) (self->context, uri);
+  CONTEXT_END_CALL (self);
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
+  dircache_invalidate (self->dircache, uri, false);
   return PyLong_FromLong (ret);
 }
 
@@ -376,6 +507,7 @@ Context_rename (Context *self, PyObject *args)
   char *ouri = NULL;
   char *nuri = NULL;
   Context *nctx = NULL;
+  Context *first, *second;
   smbc_rename_fn fn;
 
   if (!PyArg_ParseTuple (args, "ss|O", &ouri, &nuri, &nctx))
@@ -383,39 +515,65 @@ Context_rename (Context *self, PyObject *args)
       return NULL;
     }
 
-  fn = smbc_getFunctionRename(self->context);
-  errno = 0;
-  if (nctx && nctx->context)
-    {
-      ret = (*fn) (self->context, ouri, nctx->context, nuri);
-    }
-  else
+  if (nctx && !PyObject_TypeCheck (nctx, &smbc_ContextType))
     {
-      ret = (*fn) (self->context, ouri, self->context, nuri);
+      PyErr_SetString (PyExc_TypeError, "Expected smbc.Context");
+      return NULL;
     }
 
+  if (nctx == NULL || nctx->context == NULL)
+    nctx = self;
+
+  fn = smbc_getFunctionRename(self->context);
+  Py_BEGIN_ALLOW_THREADS
+  /* Always take both locks in the same order to avoid deadlock. */
+  first = self < nctx ? self : nctx;
+  second = self < nctx ? nctx : self;
+  PyThread_acquire_lock (first->lock, WAIT_LOCK);
+  if (second != first)
+    PyThread_acquire_lock (second->lock, WAIT_LOCK);
+  errno = 0;
+  ret = (*fn) (self->context, ouri, nctx->context, nuri);
+  if (second != first)
+    PyThread_release_lock (second->lock);
+  PyThread_release_lock (first->lock);
+  Py_END_ALLOW_THREADS
+
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
+  dircache_invalidate (self->dircache, ouri, true);
+  dircache_invalidate (nctx->dircache, nuri, true);
   return PyLong_FromLong (ret);
 }
 
+/* Context.opendir, and Context.scandir if 'plus'. */
 static PyObject *
-Context_opendir (Context *self, PyObject *args)
+context_opendir (Context *self, PyObject *args, PyObject *kwds, bool plus)
   {
     PyObject *result = NULL;
     PyObject *largs = NULL;
     PyObject *lkwlist = NULL;
     PyObject *uri;
+    PyObject *pattern = Py_None;
+    PyObject *types = Py_None;
     PyObject *dir = NULL;
+    static char *kwlist[] =
+      {
+        "uri",
+        "pattern",
+        "types",
+        NULL
+      };
 
     debugprintf ("%p -> Context_opendir()\n", self->context);
     do /*once*/
       {
-        if (!PyArg_ParseTuple(args, "O", &uri))
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist,
+                                         &uri, &pattern, &types))
           {
             debugprintf ("%p <- Context_opendir() EXCEPTION\n", self->context);
             break;
@@ -430,6 +588,12 @@ Context_opendir (Context *self, PyObject *args)
         if (PyErr_Occurred())
             break;
         PyDict_SetItemString(lkwlist, "uri", uri);
+        if (PyErr_Occurred())
+            break;
+        PyDict_SetItemString(lkwlist, "pattern", pattern);
+        if (PyErr_Occurred())
+            break;
+        PyDict_SetItemString(lkwlist, "types", types);
         if (PyErr_Occurred())
             break;
         dir = smbc_DirType.tp_new(&smbc_DirType, largs, lkwlist);
@@ -438,6 +602,8 @@ Context_opendir (Context *self, PyObject *args)
             PyErr_NoMemory();
             break;
           } /*if*/
+        if (plus)
+            dir_use_readdirplus(dir);
         if (smbc_DirType.tp_init(dir, largs, lkwlist) < 0)
           {
             debugprintf ("%p <- Context_opendir() EXCEPTION\n", self->context);
@@ -457,7 +623,219 @@ Context_opendir (Context *self, PyObject *args)
     Py_XDECREF(lkwlist);
     return
         result;
-  } /*Context_opendir*/
+  } /*context_opendir*/
+
+static PyObject *
+Context_opendir (Context *self, PyObject *args, PyObject *kwds)
+{
+  return context_opendir (self, args, kwds, false);
+}
+
+static PyObject *
+Context_scandir (Context *self, PyObject *args, PyObject *kwds)
+{
+  return context_opendir (self, args, kwds, true);
+}
+
+/*
+  PyArg_Parse converters for the 'workers' and 'streams' arguments: the
+  number of threads, and so of connections, a call may use.
+*/
+#define CONTEXT_MAX_THREADS 64
+
+static int
+context_thread_count (PyObject *obj, int *count, const char *what)
+{
+  long n = PyLong_AsLong (obj);
+
+  if (n == -1 && PyErr_Occurred ())
+    return 0;
+
+  if (n < 1 || n > CONTEXT_MAX_THREADS)
+    {
+      PyErr_Format (PyExc_ValueError, "%s must be between 1 and %d",
+		    what, CONTEXT_MAX_THREADS);
+      return 0;
+    }
+
+  *count = n;
+  return 1;
+}
+
+static int
+context_workers (PyObject *obj, void *count)
+{
+  return context_thread_count (obj, count, "workers");
+}
+
+static int
+context_streams (PyObject *obj, void *count)
+{
+  return context_thread_count (obj, count, "streams");
+}
+
+static PyObject *
+Context_walk (Context *self, PyObject *args, PyObject *kwds)
+{
+  const char *uri;
+  int workers = TREE_DEFAULT_WORKERS;
+  PyObject *follow = Py_False;
+  PyObject *onerror = Py_None;
+  static char *kwlist[] =
+    {
+      "uri",
+      "workers",
+      "follow",
+      "onerror",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|O&OO", kwlist,
+				    &uri, context_workers, &workers, &follow, &onerror))
+    return NULL;
+
+  return tree_walk (self, uri, workers, follow, onerror);
+}
+
+static PyObject *
+Context_rmtree (Context *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *result;
+  const char *uri;
+  int workers = TREE_DEFAULT_WORKERS;
+  PyObject *on_error = Py_None;
+  static char *kwlist[] =
+    {
+      "uri",
+      "workers",
+      "on_error",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|O&O", kwlist,
+				    &uri, context_workers, &workers, &on_error))
+    return NULL;
+
+  result = tree_rmtree (self, uri, workers, on_error);
+  dircache_invalidate (self->dircache, uri, true);
+  return result;
+}
+
+static PyObject *
+Context_copytree (Context *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *result;
+  const char *src;
+  const char *dst;
+  int workers = TREE_DEFAULT_WORKERS;
+  PyObject *on_error = Py_None;
+  static char *kwlist[] =
+    {
+      "src",
+      "dst",
+      "workers",
+      "on_error",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "ss|O&O", kwlist,
+				    &src, &dst, context_workers, &workers, &on_error))
+    return NULL;
+
+  result = tree_copytree (self, src, dst, workers, on_error);
+  dircache_invalidate (self->dircache, dst, true);
+  return result;
+}
+
+static PyObject *
+Context_snapshot (Context *self, PyObject *args, PyObject *kwds)
+{
+  const char *uri;
+  const char *path;
+  int workers = TREE_DEFAULT_WORKERS;
+  PyObject *on_error = Py_None;
+  static char *kwlist[] =
+    {
+      "uri",
+      "index_path",
+      "workers",
+      "on_error",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "ss|O&O", kwlist,
+				    &uri, &path, context_workers, &workers, &on_error))
+    return NULL;
+
+  return snapshot_create (self, uri, path, workers, on_error);
+}
+
+static PyObject *
+Context_diff (Context *self, PyObject *args, PyObject *kwds)
+{
+  const char *uri;
+  const char *path;
+  int workers = TREE_DEFAULT_WORKERS;
+  PyObject *trust = Py_False;
+  PyObject *update = Py_False;
+  PyObject *on_error = Py_None;
+  int trust_dir_mtime, do_update;
+  static char *kwlist[] =
+    {
+      "uri",
+      "index_path",
+      "workers",
+      "trust_dir_mtime",
+      "update",
+      "on_error",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "ss|O&OOO", kwlist,
+				    &uri, &path, context_workers, &workers, &trust, &update,
+				    &on_error))
+    return NULL;
+
+  trust_dir_mtime = PyObject_IsTrue (trust);
+  do_update = PyObject_IsTrue (update);
+  if (trust_dir_mtime < 0 || do_update < 0)
+    return NULL;
+
+  return snapshot_diff (self, uri, path, workers, trust_dir_mtime,
+			do_update, on_error);
+}
+
+static PyObject *
+Context_watch (Context *self, PyObject *args, PyObject *kwds)
+{
+  const char *uri;
+  PyObject *recursive = Py_True;
+  long filter = -1;
+  int do_recursive;
+  static char *kwlist[] =
+    {
+      "uri",
+      "recursive",
+      "filter",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|Ol", kwlist,
+				    &uri, &recursive, &filter))
+    return NULL;
+
+  do_recursive = PyObject_IsTrue (recursive);
+  if (do_recursive < 0)
+    return NULL;
+
+  if (filter < -1 || filter > 0xffffffffL)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid filter");
+      return NULL;
+    }
+
+  return watch_new (self, uri, do_recursive, filter);
+}
 
 static PyObject *
 Context_mkdir (Context *self, PyObject *args)
@@ -473,14 +851,17 @@ Context_mkdir (Context *self, PyObject *args)
     }
 
   fn = smbc_getFunctionMkdir (self->context);
+  CONTEXT_BEGIN_CALL (self);
   errno = 0;
   ret = (*fn) (self->context, uri, mode);
+  CONTEXT_END_CALL (self);
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
+  dircache_invalidate (self->dircache, uri, false);
   return PyLong_FromLong (ret);
 }
 
@@ -497,14 +878,17 @@ Context_rmdir (Context *self, PyObject *args)
     }
 
   fn = smbc_getFunctionRmdir (self->context);
+  CONTEXT_BEGIN_CALL (self);
   errno = 0;
   ret = (*fn) (self->context, uri);
+  CONTEXT_END_CALL (self);
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
+  dircache_invalidate (self->dircache, uri, true);
   return PyLong_FromLong (ret);
 }
 
@@ -522,25 +906,17 @@ Context_stat (Context *self, PyObject *args)
     }
 
   fn = smbc_getFunctionStat (self->context);
+  CONTEXT_BEGIN_CALL (self);
   errno = 0;
   ret = (*fn) (self->context, uri, &st);
+  CONTEXT_END_CALL (self);
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
-  return Py_BuildValue ("(IKKKIIKIII)",
-			st.st_mode,
-			(unsigned long long)st.st_ino,
-			(unsigned long long)st.st_dev,
-			(unsigned long long)st.st_nlink,
-			st.st_uid,
-			st.st_gid,
-			st.st_size,
-			st.st_atime,
-			st.st_mtime,
-			st.st_ctime);
+  return pysmbc_StatTuple (&st);
 }
 
 static PyObject *
@@ -556,9 +932,11 @@ Context_chmod (Context *self, PyObject *args)
       return NULL;
     }
 
-  errno = 0;
   fn = smbc_getFunctionChmod (self->context);
+  CONTEXT_BEGIN_CALL (self);
+  errno = 0;
   ret = (*fn) (self->context, uri, mode);
+  CONTEXT_END_CALL (self);
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
@@ -596,8 +974,10 @@ Context_getxattr (Context *self, PyObject *args)
         if (!PyArg_ParseTuple(args, "ss", &uri, &name))
             break;
         const smbc_getxattr_fn fn = smbc_getFunctionGetxattr(self->context);
+        CONTEXT_BEGIN_CALL (self);
         errno = 0;
         ret = fn(self->context, uri, name, NULL, 0);
+        CONTEXT_END_CALL (self);
         if (ret < 0)
           {
             pysmbc_SetFromErrno();
@@ -610,7 +990,9 @@ Context_getxattr (Context *self, PyObject *args)
             PyErr_NoMemory();
             break;
           } /*if*/
+        CONTEXT_BEGIN_CALL (self);
         ret = fn(self->context, uri, name, buffer, bufsize);
+        CONTEXT_END_CALL (self);
         if (ret < 0)
           {
             pysmbc_SetFromErrno();
@@ -711,10 +1093,11 @@ Context_setxattr (Context *self, PyObject *args)
       return NULL;
     }
 
-  errno = 0;
   fn = smbc_getFunctionSetxattr (self->context);
-
+  CONTEXT_BEGIN_CALL (self);
+  errno = 0;
   ret = (*fn)(self->context, uri, name, value, strlen (value), flags);
+  CONTEXT_END_CALL (self);
 
   if (ret < 0)
     {
@@ -728,6 +1111,271 @@ Context_setxattr (Context *self, PyObject *args)
 
 
 
+/* Context.download and Context.upload; see transfer.c. */
+static PyObject *
+context_transfer (Context *self, PyObject *args, PyObject *kwds,
+		  bool upload)
+{
+  char *uri;
+  char *path;
+  int streams = TRANSFER_DEFAULT_STREAMS;
+  Py_ssize_t chunk = TRANSFER_DEFAULT_CHUNK;
+  off_t total = 0;
+  bool local;
+  int ret;
+  static char *download_kwlist[] =
+    {
+      "uri",
+      "local_path",
+      "streams",
+      "chunk",
+      NULL
+    };
+  static char *upload_kwlist[] =
+    {
+      "local_path",
+      "uri",
+      "streams",
+      "chunk",
+      NULL
+    };
+
+  if (upload)
+    ret = PyArg_ParseTupleAndKeywords (args, kwds, "ss|O&n", upload_kwlist,
+				       &path, &uri, context_streams, &streams, &chunk);
+  else
+    ret = PyArg_ParseTupleAndKeywords (args, kwds, "ss|O&n", download_kwlist,
+				       &uri, &path, context_streams, &streams, &chunk);
+  if (!ret)
+    return NULL;
+
+  if (chunk < 1)
+    {
+      PyErr_SetString (PyExc_ValueError, "chunk must be positive");
+      return NULL;
+    }
+
+  debugprintf ("%p -> context_transfer(%s, %s, %s)\n", self->context,
+	       upload ? "upload" : "download", uri, path);
+  Py_BEGIN_ALLOW_THREADS
+  if (upload)
+    ret = transfer_upload (self, path, uri, streams, chunk, &total, &local);
+  else
+    ret = transfer_download (self, uri, path, streams, chunk, &total, &local);
+  Py_END_ALLOW_THREADS
+  if (upload)
+    dircache_invalidate (self->dircache, uri, false);
+
+  if (ret < 0)
+    {
+      if (local)
+	PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+      else
+	pysmbc_SetFromErrno ();
+
+      debugprintf ("%p <- context_transfer() EXCEPTION\n", self->context);
+      return NULL;
+    }
+
+  debugprintf ("%p <- context_transfer() = %lld\n", self->context,
+	       (long long) total);
+  return PyLong_FromLongLong (total);
+}
+
+static PyObject *
+Context_download (Context *self, PyObject *args, PyObject *kwds)
+{
+  return context_transfer (self, args, kwds, false);
+}
+
+static PyObject *
+Context_upload (Context *self, PyObject *args, PyObject *kwds)
+{
+  return context_transfer (self, args, kwds, true);
+}
+
+static PyObject *
+Context_sync_file (Context *self, PyObject *args, PyObject *kwds)
+{
+  char *path;
+  char *uri;
+  int streams = TRANSFER_DEFAULT_STREAMS;
+  Py_ssize_t block = TRANSFER_DEFAULT_BLOCK;
+  off_t written = 0;
+  bool local;
+  int ret;
+  static char *kwlist[] =
+    {
+      "local_path",
+      "uri",
+      "streams",
+      "block",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "ss|O&n", kwlist,
+				    &path, &uri, context_streams, &streams, &block))
+    return NULL;
+
+  if (block < 1 || block > TRANSFER_IO_SIZE * 16)
+    {
+      PyErr_SetString (PyExc_ValueError, "block must be between 1 and 16MiB");
+      return NULL;
+    }
+
+  debugprintf ("%p -> Context_sync_file(%s, %s)\n", self->context, path, uri);
+  Py_BEGIN_ALLOW_THREADS
+  ret = transfer_sync (self, path, uri, streams, block, &written, &local);
+  Py_END_ALLOW_THREADS
+  dircache_invalidate (self->dircache, uri, false);
+  if (ret < 0)
+    {
+      if (local)
+	PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+      else
+	pysmbc_SetFromErrno ();
+
+      debugprintf ("%p <- Context_sync_file() EXCEPTION\n", self->context);
+      return NULL;
+    }
+
+  debugprintf ("%p <- Context_sync_file() = %lld\n", self->context,
+	       (long long) written);
+  return PyLong_FromLongLong (written);
+}
+
+/* Calls the Python progress callback of Context.copy. */
+static int
+copy_progress (off_t done, void *priv)
+{
+  PyObject *fn = priv;
+  PyObject *result;
+  PyGILState_STATE gstate;
+  int ret;
+
+  gstate = PyGILState_Ensure ();
+  result = PyObject_CallFunction (fn, "L", (PY_LONG_LONG) done);
+  ret = result != NULL && result != Py_False;
+  Py_XDECREF (result);
+  PyGILState_Release (gstate);
+  return ret;
+}
+
+static PyObject *
+Context_copy (Context *self, PyObject *args, PyObject *kwds)
+{
+  char *src;
+  char *dst;
+  PyObject *progress = Py_None;
+  off_t total = 0;
+  int ret;
+  static char *kwlist[] =
+    {
+      "src_uri",
+      "dst_uri",
+      "progress",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "ss|O", kwlist,
+				    &src, &dst, &progress))
+    return NULL;
+
+  if (progress != Py_None && !PyCallable_Check (progress))
+    {
+      PyErr_SetString (PyExc_TypeError, "progress must be callable");
+      return NULL;
+    }
+
+  debugprintf ("%p -> Context_copy(%s, %s)\n", self->context, src, dst);
+  Py_BEGIN_ALLOW_THREADS
+  ret = transfer_copy (self, src, dst,
+		       progress == Py_None ? NULL : copy_progress,
+		       progress, &total);
+  Py_END_ALLOW_THREADS
+  dircache_invalidate (self->dircache, dst, false);
+  if (ret < 0)
+    {
+      /* An exception raised by the progress callback wins. */
+      if (!PyErr_Occurred ())
+	pysmbc_SetFromErrno ();
+
+      debugprintf ("%p <- Context_copy() EXCEPTION\n", self->context);
+      return NULL;
+    }
+
+  debugprintf ("%p <- Context_copy() = %lld\n", self->context,
+	       (long long) total);
+  return PyLong_FromLongLong (total);
+}
+
+static PyObject *
+Context_digest_many (Context *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *uris;
+  PyObject *algo = NULL;
+  PyObject *ret;
+  int workers = DIGEST_DEFAULT_WORKERS;
+  Py_ssize_t chunk = TRANSFER_IO_SIZE;
+  static char *kwlist[] =
+    {
+      "uris",
+      "algo",
+      "workers",
+      "chunk",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|OO&n", kwlist,
+				    &uris, &algo, context_workers, &workers, &chunk))
+    return NULL;
+
+  if (chunk < 1)
+    {
+      PyErr_SetString (PyExc_ValueError, "chunk must be positive");
+      return NULL;
+    }
+
+  if (algo)
+    Py_INCREF (algo);
+  else
+    {
+      algo = PyUnicode_FromString (DIGEST_DEFAULT_ALGO);
+      if (algo == NULL)
+	return NULL;
+    }
+
+  ret = digest_many (self, uris, algo, workers, chunk);
+  Py_DECREF (algo);
+  return ret;
+}
+
+static PyObject *
+Context_stat_many (Context *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *uris;
+  int workers = BULKSTAT_DEFAULT_WORKERS;
+  PyObject *return_exceptions = Py_True;
+  int do_return;
+  static char *kwlist[] =
+    {
+      "uris",
+      "workers",
+      "return_exceptions",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|O&O", kwlist,
+				    &uris, context_workers, &workers, &return_exceptions))
+    return NULL;
+
+  do_return = PyObject_IsTrue (return_exceptions);
+  if (do_return < 0)
+    return NULL;
+
+  return bulkstat_many (self, uris, workers, do_return);
+}
+
 static PyObject *
 Context_getDebug (Context *self, void *closure)
 {
@@ -752,7 +1400,9 @@ Context_setDebug (Context *self, PyObject *value, void *closure)
     }
 
   d = PyLong_AsLong (value);
+  CONTEXT_BEGIN_CALL (self);
   smbc_setDebug (self->context, d);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
@@ -825,7 +1475,9 @@ Context_setNetbiosName (Context *self, PyObject *value, void *closure)
     /* NUL-terminate it (this is why we allocated an extra byte) */
     name[written] = '\0';
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setNetbiosName (self->context, name);
+  CONTEXT_END_CALL (self);
   // Don't free name: the API function just takes a reference(!)
   return 0;
 }
@@ -900,7 +1552,9 @@ Context_setWorkgroup (Context *self, PyObject *value, void *closure)
     /* NUL-terminate it (this is why we allocated the extra byte) */
     workgroup[written] = '\0';
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setWorkgroup (self->context, workgroup);
+  CONTEXT_END_CALL (self);
   // Don't free workgroup: the API function just takes a reference(!)
   return 0;
 }
@@ -915,6 +1569,8 @@ Context_getTimeout (Context *self, void *closure)
 static int
 Context_setTimeout (Context *self, PyObject *value, void *closure)
 {
+  long n;
+
 #if PY_MAJOR_VERSION < 3
   if (!PyInt_Check (value))
 #else
@@ -926,10 +1582,16 @@ Context_setTimeout (Context *self, PyObject *value, void *closure)
     }
 
 #if PY_MAJOR_VERSION < 3
-  smbc_setTimeout (self->context, PyInt_AsLong (value));
+  n = PyInt_AsLong (value);
 #else
-  smbc_setTimeout (self->context, PyLong_AsLong (value));
+  n = PyLong_AsLong (value);
 #endif
+  if (n == -1 && PyErr_Occurred ())
+    return -1;
+
+  CONTEXT_BEGIN_CALL (self);
+  smbc_setTimeout (self->context, n);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
@@ -943,6 +1605,8 @@ Context_getPort (Context *self, void *closure)
 static int
 Context_setPort (Context *self, PyObject *value, void *closure)
 {
+  long n;
+
 #if PY_MAJOR_VERSION < 3
   if (!PyInt_Check (value))
 #else
@@ -954,26 +1618,39 @@ Context_setPort (Context *self, PyObject *value, void *closure)
     }
 
 #if PY_MAJOR_VERSION < 3
-  smbc_setPort (self->context, PyInt_AsLong (value));
+  n = PyInt_AsLong (value);
 #else
-  smbc_setPort (self->context, PyLong_AsLong (value));
+  n = PyLong_AsLong (value);
 #endif
+  if (n == -1 && PyErr_Occurred ())
+    return -1;
+
+  CONTEXT_BEGIN_CALL (self);
+  smbc_setPort (self->context, n);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
 static int
 Context_setFunctionAuthData (Context *self, PyObject *value, void *closure)
 {
+  PyObject *old;
+
   if (!PyCallable_Check (value))
     {
       PyErr_SetString (PyExc_TypeError, "must be callable object");
       return -1;
     }
 
-  Py_XDECREF (self->auth_fn);
+  /* The old callback is only let go of once no call can be using
+     it. */
   Py_INCREF (value);
+  CONTEXT_BEGIN_CALL (self);
+  old = self->auth_fn;
   self->auth_fn = value;
   smbc_setFunctionAuthDataWithContext (self->context, auth_fn);
+  CONTEXT_END_CALL (self);
+  Py_XDECREF (old);
   return 0;
 }
 
@@ -995,7 +1672,9 @@ Context_setOptionDebugToStderr (Context *self, PyObject *value,
       return -1;
     }
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setOptionDebugToStderr (self->context, value == Py_True);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
@@ -1017,7 +1696,9 @@ Context_setOptionFullTimeNames (Context *self, PyObject *value,
       return -1;
     }
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setOptionFullTimeNames (self->context, value == Py_True);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
@@ -1039,7 +1720,9 @@ Context_setOptionNoAutoAnonymousLogin (Context *self, PyObject *value,
       return -1;
     }
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setOptionNoAutoAnonymousLogin (self->context, value == Py_True);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
@@ -1061,7 +1744,9 @@ Context_setOptionUseKerberos (Context *self, PyObject *value,
       return -1;
     }
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setOptionUseKerberos (self->context, value == Py_True);
+  CONTEXT_END_CALL (self);
   return 0;
 }
 
@@ -1083,7 +1768,70 @@ Context_setOptionFallbackAfterKerberos (Context *self, PyObject *value,
       return -1;
     }
 
+  CONTEXT_BEGIN_CALL (self);
   smbc_setOptionFallbackAfterKerberos (self->context, value == Py_True);
+  CONTEXT_END_CALL (self);
+  return 0;
+}
+
+static PyObject *
+Context_getDirCacheTTL (Context *self, void *closure)
+{
+  return PyFloat_FromDouble (dircache_ttl (self->dircache));
+}
+
+static int
+Context_setDirCacheTTL (Context *self, PyObject *value, void *closure)
+{
+  double ttl;
+
+  if (!PyNumber_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be a number");
+      return -1;
+    }
+
+  ttl = PyFloat_AsDouble (value);
+  if (ttl == -1 && PyErr_Occurred ())
+    return -1;
+
+  if (ttl < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "must not be negative");
+      return -1;
+    }
+
+  dircache_set_ttl (self->dircache, ttl);
+  return 0;
+}
+
+static PyObject *
+Context_getDirCacheSize (Context *self, void *closure)
+{
+  return PyLong_FromSize_t (dircache_size (self->dircache));
+}
+
+static int
+Context_setDirCacheSize (Context *self, PyObject *value, void *closure)
+{
+  size_t size;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  size = PyLong_AsSize_t (value);
+  if (size == (size_t) -1 && PyErr_Occurred ())
+    return -1;
+
+  dircache_set_size (self->dircache, size);
   return 0;
 }
 
@@ -1155,6 +1903,24 @@ PyGetSetDef Context_getseters[] =
       "Whether to fallback after Kerberos.",
       NULL },
 
+    { "dirCacheTTL",
+      (getter) Context_getDirCacheTTL,
+      (setter) Context_setDirCacheTTL,
+      "Seconds for which directory listings read through this context are\n"
+      "cached and served again by opendir without asking the server (0,\n"
+      "the default, disables the cache and empties it).  Creating,\n"
+      "removing or renaming an entry through this context drops the\n"
+      "listings it affects; changes made by others are only seen once\n"
+      "they expire.",
+      NULL },
+
+    { "dirCacheSize",
+      (getter) Context_getDirCacheSize,
+      (setter) Context_setDirCacheSize,
+      "Bytes of memory the directory listing cache may use, 8MiB by\n"
+      "default.  The least recently used listings are dropped first.",
+      NULL },
+
     { NULL }
   };
 
@@ -1170,13 +1936,170 @@ PyMethodDef Context_methods[] =
       "@type password: string\n"
       "@param password: Password of user\n" },
 
+    { "walk",
+      (PyCFunction) Context_walk, METH_VARARGS | METH_KEYWORDS,
+      "walk(uri, workers=4, follow=False, onerror=None) -> Walk\n\n"
+      "List the tree below uri, like os.walk, with 'workers' threads each\n"
+      "using its own connection.  Directories are listed ahead of the\n"
+      "iteration, in no particular order, and without the GIL.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the top directory\n"
+      "@type workers: int\n"
+      "@param workers: number of directories listed in parallel\n"
+      "@type follow: bool or callable\n"
+      "@param follow: whether to enter directories that are links\n"
+      "(reparse points); or a callable, given the URI and L{smbc.Dirent}\n"
+      "of each subdirectory, returning whether to enter it\n"
+      "@type onerror: callable\n"
+      "@param onerror: called with the exception for each directory\n"
+      "that cannot be listed; by default such directories are skipped\n"
+      "@return: an L{smbc.Walk} yielding a (dirpath, dirs, files) tuple\n"
+      "per directory, where dirs and files are lists of L{smbc.Dirent}\n"
+      "objects with their attributes as from L{scandir}" },
+
+    { "rmtree",
+      (PyCFunction) Context_rmtree, METH_VARARGS | METH_KEYWORDS,
+      "rmtree(uri, workers=4, on_error=None) -> None\n\n"
+      "Remove a directory and everything below it, like shutil.rmtree.\n"
+      "Files are removed in batches by 'workers' threads, each using its\n"
+      "own connection, and each directory once it is empty.  Links to\n"
+      "directories are removed, not entered.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the directory\n"
+      "@type workers: int\n"
+      "@param workers: number of requests in flight\n"
+      "@type on_error: callable\n"
+      "@param on_error: called with the URI and the exception for each\n"
+      "entry that cannot be removed; by default the first error stops\n"
+      "the removal and is raised\n"
+      "@return: None" },
+
+    { "copytree",
+      (PyCFunction) Context_copytree, METH_VARARGS | METH_KEYWORDS,
+      "copytree(src, dst, workers=4, on_error=None) -> int\n\n"
+      "Copy a directory and everything below it, like shutil.copytree,\n"
+      "preserving modification times.  Either side may be an smb:// URI\n"
+      "or a local path.  Directories that already exist are copied\n"
+      "into, and files overwritten.  'workers' threads, each with its own\n"
+      "connection, create directories and copy files in parallel; files\n"
+      "of 16 MiB or more are moved in ranges over several streams, and\n"
+      "copies within a server are done by the server where it can.\n"
+      "Links to directories are skipped.\n\n"
+      "@type src: string\n"
+      "@param src: URI or path of the directory to copy\n"
+      "@type dst: string\n"
+      "@param dst: URI or path of the copy\n"
+      "@type workers: int\n"
+      "@param workers: number of requests in flight\n"
+      "@type on_error: callable\n"
+      "@param on_error: called with the URI or path and the exception for\n"
+      "each entry that cannot be copied; by default the first error\n"
+      "stops the copy and is raised\n"
+      "@return: number of bytes copied" },
+
+    { "snapshot",
+      (PyCFunction) Context_snapshot, METH_VARARGS | METH_KEYWORDS,
+      "snapshot(uri, index_path, workers=4, on_error=None) -> int\n\n"
+      "Write a compact index of the tree below uri to a local file: the\n"
+      "type, size and modification time of every entry, directory by\n"
+      "directory.  The tree is listed as by L{walk}, without making\n"
+      "Python objects for the entries, and links to directories are not\n"
+      "entered.  The file is replaced only once the index is complete.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the top directory\n"
+      "@type index_path: string\n"
+      "@param index_path: local path of the index\n"
+      "@type workers: int\n"
+      "@param workers: number of directories listed in parallel\n"
+      "@type on_error: callable\n"
+      "@param on_error: called with the URI and the exception for each\n"
+      "directory that cannot be listed; by default the first error\n"
+      "stops the snapshot and is raised\n"
+      "@return: number of entries indexed" },
+
+    { "diff",
+      (PyCFunction) Context_diff, METH_VARARGS | METH_KEYWORDS,
+      "diff(uri, index_path, workers=4, trust_dir_mtime=False,\n"
+      "     update=False, on_error=None) -> (list, list, list)\n\n"
+      "Compare the tree below uri with an index written by L{snapshot}.\n"
+      "Files whose size or modification time differ are modified; an\n"
+      "entry that changed between file and directory is both removed and\n"
+      "added, and everything below a removed directory is removed too.\n"
+      "The contents of directories that cannot be listed are taken to be\n"
+      "unchanged.  With libsmbclient older than 0.4.0 listings carry no\n"
+      "sizes or times, so each entry is statted for them, which is\n"
+      "slower; an entry that cannot be statted is never found modified.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the top directory\n"
+      "@type index_path: string\n"
+      "@param index_path: local path of the index\n"
+      "@type workers: int\n"
+      "@param workers: number of directories listed in parallel\n"
+      "@type trust_dir_mtime: bool\n"
+      "@param trust_dir_mtime: skip directories whose modification time\n"
+      "is unchanged, along with everything below them.  Servers usually\n"
+      "only update it when an entry is added, removed or renamed in the\n"
+      "directory itself, so this misses files changed in place and\n"
+      "changes further down unless whatever writes the tree also touches\n"
+      "the directories above\n"
+      "@type update: bool\n"
+      "@param update: rewrite the index to match the tree\n"
+      "@type on_error: callable\n"
+      "@param on_error: as for L{snapshot}\n"
+      "@return: the paths, relative to uri, of the entries added, removed\n"
+      "and modified, each list sorted" },
+
+    { "watch",
+      (PyCFunction) Context_watch, METH_VARARGS | METH_KEYWORDS,
+      "watch(uri, recursive=True, filter=-1) -> Watch\n\n"
+      "Ask the server to report changes to a directory, instead of\n"
+      "listing it over and over.  A native thread waits for them on a\n"
+      "connection of its own and queues them until they are read, in\n"
+      "batches, from the L{smbc.Watch} returned.  This returns once the\n"
+      "server is watching, which takes a quarter of a second or so;\n"
+      "changes made before then are not reported.  Needs libsmbclient\n"
+      "0.2.3 or newer.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the directory\n"
+      "@type recursive: bool\n"
+      "@param recursive: also report changes below the directory\n"
+      "@type filter: int\n"
+      "@param filter: the smbc.NOTIFY_CHANGE_* flags for the kinds of\n"
+      "change to report, or -1 for names, sizes and write times\n"
+      "@return: an L{smbc.Watch}\n"
+      "@raise NotImplementedError: libsmbclient is too old" },
+
     { "opendir",
-      (PyCFunction) Context_opendir, METH_VARARGS,
-      "opendir(uri) -> Dir\n\n"
+      (PyCFunction) Context_opendir, METH_VARARGS | METH_KEYWORDS,
+      "opendir(uri, pattern=None, types=None) -> Dir\n\n"
+      "Entries not matching pattern and types are skipped as they are\n"
+      "read, before any L{smbc.Dirent} is made for them.\n\n"
       "@type uri: string\n"
       "@param uri: URI to opendir\n"
+      "@type pattern: string\n"
+      "@param pattern: shell-style wildcard, as for fnmatch, that entry\n"
+      "names must match, ignoring case as the server does\n"
+      "@type types: collection of int\n"
+      "@param types: the entry types wanted, such as smbc.FILE and\n"
+      "smbc.DIR\n"
       "@return: a L{smbc.Dir} object for the URI" },
 
+    { "scandir",
+      (PyCFunction) Context_scandir, METH_VARARGS | METH_KEYWORDS,
+      "scandir(uri, pattern=None, types=None) -> Dir\n\n"
+      "Like opendir, but the entries come with their size, times and\n"
+      "DOS attributes, read by the same directory query, so that no\n"
+      "stat call is needed per entry.  '.' and '..' are left out.\n"
+      "With libsmbclient older than 0.4.0 this is the same as opendir.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the directory\n"
+      "@type pattern: string\n"
+      "@param pattern: as for L{opendir}\n"
+      "@type types: collection of int\n"
+      "@param types: as for L{opendir}; an entry is smbc.DIR or\n"
+      "smbc.FILE according to its attributes\n"
+      "@return: a L{smbc.Dir} object yielding L{smbc.Dirent} objects" },
+
     { "open",
       (PyCFunction) Context_open, METH_VARARGS,
       "open(uri) -> File\n\n"
@@ -1229,6 +2152,23 @@ PyMethodDef Context_methods[] =
       "@param uri: URI to get stat information\n"
       "@return: stat information" },
 
+    { "stat_many",
+      (PyCFunction) Context_stat_many, METH_VARARGS | METH_KEYWORDS,
+      "stat_many(uris, workers=8, return_exceptions=True) -> list\n\n"
+      "Stat many URIs, 'workers' at a time, each worker using its own\n"
+      "connection.  The calls are made without the GIL, and by default\n"
+      "a URI that cannot be statted raises no exception.\n\n"
+      "@type uris: sequence of strings\n"
+      "@param uris: URIs to get stat information for\n"
+      "@type workers: int\n"
+      "@param workers: number of requests in flight\n"
+      "@type return_exceptions: bool\n"
+      "@param return_exceptions: if false, the first error stops the\n"
+      "rest and is raised\n"
+      "@return: for each URI, in order, its stat information as from\n"
+      "L{stat}, or the exception raised trying to get it, such as\n"
+      "L{smbc.NoEntryError}" },
+
     { "chmod",
       (PyCFunction) Context_chmod, METH_VARARGS,
       "chmod(uri, mode) -> int\n\n"
@@ -1309,6 +2249,94 @@ PyMethodDef Context_methods[] =
       "@type	int\n"
       "@param flags - XATTR_FLAG_CREATE or XATTR_FLAG_REPLACE\n"
       "@return: 0 on success" },
+    { "download",
+      (PyCFunction) Context_download, METH_VARARGS | METH_KEYWORDS,
+      "download(uri, local_path, streams=4, chunk=8388608) -> int\n\n"
+      "Copy a file from the server to the local file system.  The file\n"
+      "is split into chunk-sized ranges, fetched by up to 'streams'\n"
+      "threads in parallel, each over its own connection.  The local\n"
+      "file is removed if the download fails.\n\n"
+      "@type uri: string\n"
+      "@param uri: URI of the file to fetch\n"
+      "@type local_path: string\n"
+      "@param local_path: local file to create or overwrite\n"
+      "@type streams: int\n"
+      "@param streams: number of parallel connections\n"
+      "@type chunk: int\n"
+      "@param chunk: size of each range, in bytes\n"
+      "@return: number of bytes copied" },
+
+    { "copy",
+      (PyCFunction) Context_copy, METH_VARARGS | METH_KEYWORDS,
+      "copy(src_uri, dst_uri, progress=None) -> int\n\n"
+      "Copy a file to another location, creating or overwriting it.  If\n"
+      "both are on the same server, the server is asked to copy the\n"
+      "data itself (server-side copy); otherwise, or if it cannot, the\n"
+      "data passes through the client.  The copy uses a connection of\n"
+      "its own and does not hold the GIL.  The destination is removed\n"
+      "if the copy fails.\n\n"
+      "@type src_uri: string\n"
+      "@param src_uri: URI of the file to copy\n"
+      "@type dst_uri: string\n"
+      "@param dst_uri: URI of the copy\n"
+      "@type progress: callable\n"
+      "@param progress: called with the number of bytes copied so far;\n"
+      "returning False cancels the copy\n"
+      "@return: number of bytes copied" },
+
+    { "digest_many",
+      (PyCFunction) Context_digest_many, METH_VARARGS | METH_KEYWORDS,
+      "digest_many(uris, algo='sha256', workers=4, chunk=1048576) -> list\n\n"
+      "Hash many files, 'workers' at a time, each worker using its own\n"
+      "connection.  Files are read without the GIL.\n\n"
+      "@type uris: sequence of strings\n"
+      "@param uris: URIs of the files to hash\n"
+      "@type algo: string or callable\n"
+      "@param algo: hashlib algorithm name, or a callable returning a\n"
+      "new hash object\n"
+      "@type workers: int\n"
+      "@param workers: number of files hashed in parallel\n"
+      "@type chunk: int\n"
+      "@param chunk: read size, in bytes\n"
+      "@return: for each URI, in order, its hash object or the\n"
+      "exception raised trying to read it" },
+
+    { "sync_file",
+      (PyCFunction) Context_sync_file, METH_VARARGS | METH_KEYWORDS,
+      "sync_file(local_path, uri, streams=4, block=131072) -> int\n\n"
+      "Make a remote file identical to a local one, rewriting only the\n"
+      "blocks that differ.  Both files are read in full, by up to\n"
+      "'streams' threads in parallel each over its own connection, so\n"
+      "this pays off when writes are dearer than reads: large files\n"
+      "that change little between runs.  The remote file is created\n"
+      "if need be and truncated or extended to the local file's size.\n\n"
+      "@type local_path: string\n"
+      "@param local_path: local file to copy\n"
+      "@type uri: string\n"
+      "@param uri: URI of the file to bring up to date\n"
+      "@type streams: int\n"
+      "@param streams: number of parallel connections\n"
+      "@type block: int\n"
+      "@param block: unit of comparison, in bytes\n"
+      "@return: number of bytes rewritten" },
+
+    { "upload",
+      (PyCFunction) Context_upload, METH_VARARGS | METH_KEYWORDS,
+      "upload(local_path, uri, streams=4, chunk=8388608) -> int\n\n"
+      "Copy a local file to the server.  The remote file is created (or\n"
+      "truncated) and sized first; then chunk-sized ranges are sent by\n"
+      "up to 'streams' threads in parallel, each over its own\n"
+      "connection.  The remote file is removed if the upload fails.\n\n"
+      "@type local_path: string\n"
+      "@param local_path: local file to send\n"
+      "@type uri: string\n"
+      "@param uri: URI of the file to create or overwrite\n"
+      "@type streams: int\n"
+      "@param streams: number of parallel connections\n"
+      "@type chunk: int\n"
+      "@param chunk: size of each range, in bytes\n"
+      "@return: number of bytes copied" },
+
     { NULL } /* Sentinel */
   };
 #if PY_MAJOR_VERSION >= 3
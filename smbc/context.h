@@ -32,8 +32,46 @@ typedef struct
   PyObject_HEAD
   SMBCCTX *context;
   PyObject *auth_fn;
+  PyThread_type_lock lock;
+  char *proto;			/* protocol passed to the constructor */
+  char *cred_workgroup;		/* from set_credentials_with_fallback */
+  char *cred_user;
+  char *cred_password;
+  struct dircache *dircache;	/* listings for Dir; see dircache.h */
 } Context;
 
+/*
+  An SMBCCTX must not be used by more than one thread at a time, so
+  every call into libsmbclient is made while holding the owning
+  Context's lock.  The GIL is dropped before the lock is taken (and
+  for the duration of the call) so that a slow server only blocks the
+  threads using that particular Context.
+
+  Use these in matched pairs within a single block:
+
+    CONTEXT_BEGIN_CALL (ctx);
+    ret = (*fn) (ctx->context, ...);
+    CONTEXT_END_CALL (ctx);
+
+  No Python API may be used between the two.
+*/
+#define CONTEXT_BEGIN_CALL(ctx)				\
+  Py_BEGIN_ALLOW_THREADS				\
+  PyThread_acquire_lock ((ctx)->lock, WAIT_LOCK)
+
+#define CONTEXT_END_CALL(ctx)				\
+  PyThread_release_lock ((ctx)->lock);			\
+  Py_END_ALLOW_THREADS
+
+/*
+  Native worker threads cannot share the Context's SMBCCTX without
+  serialising on its lock, so each one that needs its own connection
+  makes a clone: a new SMBCCTX with the same options, authentication
+  callback and credentials.  Both may be called without the GIL.
+*/
+extern SMBCCTX *context_clone (Context *self);
+extern void context_clone_free (SMBCCTX *ctx);
+
 extern Context *current_context;
 
 #endif /* HAVE_CONTEXT_H */
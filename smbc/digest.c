@@ -0,0 +1,249 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "digest.h"
+#include "pool.h"
+
+////////////
+// Digest //
+////////////
+
+/* A new hash object for algo.  GIL held. */
+PyObject *
+digest_make (PyObject *algo)
+{
+  PyObject *hashlib;
+  PyObject *hash;
+
+  if (PyCallable_Check (algo))
+    return PyObject_CallObject (algo, NULL);
+
+  hashlib = PyImport_ImportModule ("hashlib");
+  if (hashlib == NULL)
+    return NULL;
+
+  hash = PyObject_CallMethod (hashlib, "new", "O", algo);
+  Py_DECREF (hashlib);
+  return hash;
+}
+
+/*
+  A chunk buffer for digest_update().  It is a bytearray, so a view of
+  it can never outlive its memory; native code may fill it without the
+  GIL between updates.  GIL held.
+*/
+PyObject *
+digest_buffer (size_t size)
+{
+  return PyByteArray_FromStringAndSize (NULL, size);
+}
+
+/*
+  Feed the first len bytes of buf, from digest_buffer(), to hash.  GIL
+  held.  The view passed to update() is released afterwards, and if
+  the hash object still holds part of it this fails with BufferError
+  rather than let the next chunk change what it sees.
+*/
+int
+digest_update (PyObject *hash, PyObject *buf, size_t len)
+{
+  PyObject *view;
+  PyObject *ret;
+
+#if PY_MAJOR_VERSION >= 3
+  PyObject *whole = PyMemoryView_FromObject (buf);
+  if (whole == NULL)
+    return -1;
+
+  view = PySequence_GetSlice (whole, 0, len);
+  Py_DECREF (whole);
+#else
+  view = PyString_FromStringAndSize (PyByteArray_AS_STRING (buf), len);
+#endif
+  if (view == NULL)
+    return -1;
+
+  ret = PyObject_CallMethod (hash, "update", "O", view);
+#if PY_MAJOR_VERSION >= 3
+  if (ret)
+    {
+      Py_DECREF (ret);
+      ret = PyObject_CallMethod (view, "release", NULL);
+    }
+#endif
+  Py_DECREF (view);
+  if (ret == NULL)
+    return -1;
+
+  Py_DECREF (ret);
+  if (Py_REFCNT (buf) > 1)
+    {
+      PyErr_SetString (PyExc_BufferError,
+		       "hash object kept a view of the data");
+      return -1;
+    }
+
+  return 0;
+}
+
+struct digest_job
+{
+  struct pool_uris uris;
+  PyObject *algo;
+  size_t chunk;
+};
+
+/*
+  Hash one file with the worker's own connection.  Returns a new hash
+  object, or the exception raised trying.  Called without the GIL.
+*/
+static PyObject *
+digest_one (struct digest_job *job, SMBCCTX *c, const char *uri,
+	    PyObject *buf)
+{
+  PyGILState_STATE gstate;
+  PyObject *hash;
+  SMBCFILE *file;
+  ssize_t len;
+  int err;
+
+  gstate = PyGILState_Ensure ();
+  hash = digest_make (job->algo);
+  if (hash == NULL)
+    {
+      hash = pysmbc_TakeError ();
+      PyGILState_Release (gstate);
+      return hash;
+    }
+
+  PyGILState_Release (gstate);
+
+  errno = 0;
+  file = (*smbc_getFunctionOpen (c)) (c, uri, O_RDONLY, 0);
+  if (file == NULL)
+    len = -1;
+  else
+    for (;;)
+      {
+	errno = 0;
+	len = (*smbc_getFunctionRead (c)) (c, file,
+					   PyByteArray_AS_STRING (buf),
+					   job->chunk);
+	if (len <= 0)
+	  break;
+
+	gstate = PyGILState_Ensure ();
+	if (digest_update (hash, buf, len) < 0)
+	  {
+	    Py_DECREF (hash);
+	    hash = pysmbc_TakeError ();
+	    len = 0;
+	  }
+	PyGILState_Release (gstate);
+	if (len == 0)
+	  break;
+      }
+
+  err = errno;
+  if (file)
+    (*smbc_getFunctionClose (c)) (c, file);
+
+  if (len < 0)
+    {
+      gstate = PyGILState_Ensure ();
+      Py_DECREF (hash);
+      hash = pysmbc_ErrorFromErrno (err);
+      PyGILState_Release (gstate);
+    }
+
+  return hash;
+}
+
+static void
+digest_worker (void *arg)
+{
+  struct digest_job *job = arg;
+  PyGILState_STATE gstate;
+  PyObject *buf;
+  Py_ssize_t i;
+  SMBCCTX *c;
+  int err;
+
+  c = pool_uris_connect (&job->uris, &err);
+  gstate = PyGILState_Ensure ();
+  buf = digest_buffer (job->chunk);
+  PyErr_Clear ();
+  PyGILState_Release (gstate);
+  if (buf == NULL)
+    err = ENOMEM;
+
+  while (pool_uris_next (&job->uris, 1, &i))
+    {
+      PyObject *result;
+
+      if (buf == NULL || c == NULL)
+	{
+	  gstate = PyGILState_Ensure ();
+	  result = pysmbc_ErrorFromErrno (err);
+	}
+      else
+	{
+	  result = digest_one (job, c, job->uris.uris[i], buf);
+	  gstate = PyGILState_Ensure ();
+	}
+
+      PyList_SET_ITEM (job->uris.results, i, result);
+      PyGILState_Release (gstate);
+    }
+
+  gstate = PyGILState_Ensure ();
+  Py_XDECREF (buf);
+  PyGILState_Release (gstate);
+  context_clone_free (c);
+}
+
+/*
+  Hash each of a list of URIs, 'workers' at a time.  Returns a list
+  holding, for each URI, its hash object or the exception hashing it
+  raised.  GIL held.
+*/
+PyObject *
+digest_many (Context *ctx, PyObject *uris, PyObject *algo,
+	     unsigned workers, size_t chunk)
+{
+  struct digest_job job;
+  PyObject *hash;
+
+  /* Fail early on an unknown algorithm. */
+  hash = digest_make (algo);
+  if (hash == NULL)
+    return NULL;
+
+  Py_DECREF (hash);
+  if (pool_uris_init (&job.uris, ctx, uris) < 0)
+    return NULL;
+
+  job.algo = algo;
+  job.chunk = chunk;
+  pool_uris_run (&job.uris, workers, digest_worker, &job);
+  pool_uris_free (&job.uris);
+  return job.uris.results;
+}
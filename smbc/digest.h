@@ -0,0 +1,37 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef HAVE_DIGEST_H
+#define HAVE_DIGEST_H
+
+/*
+  Hashing of remote files.  The data is read by native code into a
+  reusable buffer and handed to a hashlib object's update() as a
+  memoryview, without copying; hashlib drops the GIL while hashing
+  large buffers.  The view is released once update() returns.  'algo' is a hashlib algorithm name or a callable
+  returning a new hash object, as for hashlib.file_digest().
+*/
+#define DIGEST_DEFAULT_ALGO "sha256"
+#define DIGEST_DEFAULT_WORKERS 4
+
+extern PyObject *digest_make (PyObject *algo);
+extern PyObject *digest_buffer (size_t size);
+extern int digest_update (PyObject *hash, PyObject *buf, size_t len);
+extern PyObject *digest_many (Context *ctx, PyObject *uris, PyObject *algo,
+			      unsigned workers, size_t chunk);
+
+#endif /* HAVE_DIGEST_H */
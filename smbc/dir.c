@@ -18,9 +18,11 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <fnmatch.h>
 #include "smbcmodule.h"
 #include "context.h"
 #include "dir.h"
+#include "dircache.h"
 #include "smbcdirent.h"
 
 typedef struct
@@ -28,8 +30,48 @@ typedef struct
   PyObject_HEAD
   Context *context;
   SMBCFILE *dir;
+  PyThread_type_lock lock;	/* guards the entry buffer */
+
+  /* Entries fetched by getdents but not yet returned. */
+  char *buf;
+  size_t buf_size;
+  size_t buf_pos;
+  size_t buf_len;
+  bool eof;
+  off_t buf_cookie;		/* telldir before the buffer was filled */
+  size_t index;			/* entries taken or skipped so far */
+
+  bool plus;			/* list with attributes (Context.scandir) */
+
+  /* Only entries matching these are returned. */
+  char *pattern;
+  unsigned int types;		/* a bit per smbc_type, or 0 for all */
+
+  /* Set if the entries were cached, and buf points into the listing. */
+  struct dircache_listing *listing;
+  struct dircache_record rec;	/* the listing read so far, to cache */
 } Dir;
 
+#define DIR_DEFAULT_BUFFER_SIZE (64 * 1024)
+#define DIR_MIN_BUFFER_SIZE 1024
+#define DIR_ATTR_DIRECTORY 0x10
+
+/* Names are matched the way the server compares them. */
+#ifdef FNM_CASEFOLD
+#define DIR_FNM_FLAGS FNM_CASEFOLD
+#else
+#define DIR_FNM_FLAGS 0
+#endif
+
+/*
+  Entries are read a buffer at a time with smbc_getdents and handed
+  out one by one, whether by iteration or by getdents().  Like the
+  File lock, the Dir's lock is only waited for without the GIL; with
+  the GIL held it is only ever tried.
+*/
+#define DIR_LOCK(self) PyThread_acquire_lock ((self)->lock, WAIT_LOCK)
+#define DIR_UNLOCK(self) PyThread_release_lock ((self)->lock)
+
 /////////
 // Dir //
 /////////
@@ -39,30 +81,109 @@ Dir_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
   Dir *self;
   self = (Dir *) type->tp_alloc (type, 0);
-  if (self != NULL)
-    self->dir = NULL;
+  if (self == NULL)
+    return NULL;
+
+  self->dir = NULL;
+  self->buf = NULL;
+  self->buf_size = DIR_DEFAULT_BUFFER_SIZE;
+  self->buf_pos = self->buf_len = 0;
+  self->eof = false;
+  self->buf_cookie = 0;
+  self->index = 0;
+  self->plus = false;
+  self->pattern = NULL;
+  self->types = 0;
+  self->listing = NULL;
+  memset (&self->rec, 0, sizeof (self->rec));
+  self->lock = PyThread_allocate_lock ();
+  if (self->lock == NULL)
+    {
+      Py_DECREF (self);
+      return PyErr_NoMemory ();
+    }
 
   return (PyObject *) self;
 }
 
+/* Turn the 'types' argument into a mask of smbc_type bits. */
+static int
+dir_types_mask (PyObject *types, unsigned int *mask)
+{
+  PyObject *iter;
+  PyObject *item;
+
+  *mask = 0;
+  if (types == Py_None)
+    return 0;
+
+  iter = PyObject_GetIter (types);
+  if (iter == NULL)
+    return -1;
+
+  while ((item = PyIter_Next (iter)) != NULL)
+    {
+      long type = PyLong_AsLong (item);
+      Py_DECREF (item);
+      if (type == -1 && PyErr_Occurred ())
+	break;
+
+      if (type < 0 || type >= 32)
+	{
+	  PyErr_Format (PyExc_ValueError, "invalid entry type %ld", type);
+	  break;
+	}
+
+      *mask |= 1u << type;
+    }
+
+  Py_DECREF (iter);
+  if (PyErr_Occurred ())
+    return -1;
+
+  /* An empty collection matches nothing. */
+  if (*mask == 0)
+    *mask = 1u << 31;
+
+  return 0;
+}
+
 static int
 Dir_init (Dir *self, PyObject *args, PyObject *kwds)
 {
   PyObject *ctxobj;
   Context *ctx;
   const char *uri;
+  const char *pattern = NULL;
+  PyObject *types = Py_None;
   smbc_opendir_fn fn;
   SMBCFILE *dir;
   static char *kwlist[] = 
     {
       "context",
       "uri",
+      "pattern",
+      "types",
       NULL
     };
 
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "Os", kwlist, &ctxobj, &uri))
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "Os|zO", kwlist, &ctxobj,
+				    &uri, &pattern, &types))
+    return -1;
+
+  if (dir_types_mask (types, &self->types) < 0)
     return -1;
 
+  if (pattern)
+    {
+      self->pattern = strdup (pattern);
+      if (self->pattern == NULL)
+	{
+	  PyErr_NoMemory ();
+	  return -1;
+	}
+    }
+
   debugprintf ("-> Dir_init (%p, \"%s\")\n", ctxobj, uri);
   if (!PyObject_TypeCheck (ctxobj, &smbc_ContextType))
     {
@@ -74,9 +195,31 @@ Dir_init (Dir *self, PyObject *args, PyObject *kwds)
   Py_INCREF (ctxobj);
   ctx = (Context *) ctxobj;
   self->context = ctx;
+
+  /* Listings with attributes are not cached. */
+  if (!self->plus)
+    {
+      const char *data;
+      size_t len;
+
+      self->listing = dircache_lookup (ctx->dircache, uri, &data, &len);
+      if (self->listing)
+	{
+	  self->buf = (char *) data;
+	  self->buf_len = len;
+	  self->eof = true;
+	  debugprintf ("<- Dir_init() = 0 (cached)\n");
+	  return 0;
+	}
+
+      dircache_record_start (ctx->dircache, uri, &self->rec);
+    }
+
   fn = smbc_getFunctionOpendir (ctx->context);
+  CONTEXT_BEGIN_CALL (ctx);
   errno = 0;
   dir = (*fn) (ctx->context, uri);
+  CONTEXT_END_CALL (ctx);
   if (dir == NULL) {
 	pysmbc_SetFromErrno();
 	return -1;
@@ -95,131 +238,1195 @@ Dir_dealloc (Dir *self)
     {
       debugprintf ("%p closedir()\n", self->dir);
       fn = smbc_getFunctionClosedir (ctx->context);
+      CONTEXT_BEGIN_CALL (ctx);
       (*fn) (ctx->context, self->dir);
+      CONTEXT_END_CALL (ctx);
     }
 
+  if (self->listing)
+    dircache_release (ctx->dircache, self->listing);
+  else
+    free (self->buf);
+
+  if (ctx)
+    dircache_record_end (ctx->dircache, &self->rec, false);
+
   if (self->context)
     {
       Py_DECREF ((PyObject *) self->context);
     }
 
+  if (self->lock)
+    PyThread_free_lock (self->lock);
+
+  free (self->pattern);
   Py_TYPE(self)->tp_free ((PyObject *) self);
 }
 
+/*
+  Most entries fit here, so that handing one out needs no malloc().
+*/
+union dir_entry
+{
+  struct smbc_dirent dirent;
+  char space[1024];
+};
+
+/*
+  Copy the entry at buf_pos into *space, or into a malloc()ed copy if
+  it does not fit, and step past it.  The comment is stored after the
+  name, within the entry, so its pointer is moved along with it.  The
+  Dir lock is held.
+*/
+static struct smbc_dirent *
+dir_take_entry (Dir *self, union dir_entry *space)
+{
+  struct smbc_dirent *dirp;
+  struct smbc_dirent *copy;
+  const char *start;
+
+  dirp = (struct smbc_dirent *) (self->buf + self->buf_pos);
+  start = (const char *) dirp;
+  if (dirp->dirlen <= sizeof (*space))
+    copy = &space->dirent;
+  else
+    {
+      copy = malloc (dirp->dirlen);
+      if (copy == NULL)
+	{
+	  errno = ENOMEM;
+	  return NULL;
+	}
+    }
+
+  memcpy (copy, dirp, dirp->dirlen);
+  if (dirp->comment >= start && dirp->comment < start + dirp->dirlen)
+    copy->comment = (char *) copy + (dirp->comment - start);
+
+  self->buf_pos += dirp->dirlen;
+  self->index++;
+  return copy;
+}
+
+static void
+dir_free_entry (struct smbc_dirent *dirp, union dir_entry *space)
+{
+  if (dirp != &space->dirent)
+    free (dirp);
+}
+
+/* Whether an entry matches the pattern and types asked for. */
+static bool
+dir_wanted (Dir *self, const char *name, unsigned int type)
+{
+  if (self->types && (type >= 32 || !(self->types & (1u << type))))
+    return false;
+
+  return self->pattern == NULL ||
+    fnmatch (self->pattern, name, DIR_FNM_FLAGS) == 0;
+}
+
+/*
+  Step past the buffered entries that are not wanted, without copying
+  them.  The Dir lock is held.
+*/
+static void
+dir_skip (Dir *self)
+{
+  const struct smbc_dirent *dirp;
+
+  if (self->pattern == NULL && self->types == 0)
+    return;
+
+  while (self->buf_pos < self->buf_len)
+    {
+      dirp = (const struct smbc_dirent *) (self->buf + self->buf_pos);
+      if (dir_wanted (self, dirp->name, dirp->smbc_type))
+	break;
+
+      self->buf_pos += dirp->dirlen;
+      self->index++;
+    }
+}
+
+/*
+  Copy the next wanted entry out, refilling the buffer as often as
+  need be.  Returns 1, 0 at the end of the directory, or -1 with errno
+  set.  Called without the GIL.
+*/
+static int
+dir_next (Dir *self, union dir_entry *space, struct smbc_dirent **direntp)
+{
+  Context *ctx = self->context;
+  int len;
+
+  DIR_LOCK (self);
+  dir_skip (self);
+  while (self->buf_pos >= self->buf_len && !self->eof)
+    {
+      if (self->buf == NULL)
+	{
+	  self->buf = malloc (self->buf_size);
+	  if (self->buf == NULL)
+	    {
+	      DIR_UNLOCK (self);
+	      errno = ENOMEM;
+	      return -1;
+	    }
+	}
+
+      PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+      self->buf_cookie = (*smbc_getFunctionTelldir (ctx->context))
+	(ctx->context, self->dir);
+      errno = 0;
+      len = (*smbc_getFunctionGetdents (ctx->context)) (ctx->context,
+							 self->dir,
+							 (struct smbc_dirent *)
+							 self->buf,
+							 self->buf_size);
+      PyThread_release_lock (ctx->lock);
+      debugprintf ("dirlen = %d\n", len);
+      if (len < 0)
+	{
+	  dircache_record_end (ctx->dircache, &self->rec, false);
+	  DIR_UNLOCK (self);
+	  return -1;
+	}
+
+      if (len > 0)
+	dircache_record (&self->rec, self->buf, len);
+      else
+	dircache_record_end (ctx->dircache, &self->rec, true);
+
+      self->buf_pos = 0;
+      self->buf_len = len;
+      self->eof = len == 0;
+      dir_skip (self);
+    }
+
+  if (self->buf_pos >= self->buf_len)
+    {
+      DIR_UNLOCK (self);
+      return 0;
+    }
+
+  *direntp = dir_take_entry (self, space);
+  DIR_UNLOCK (self);
+  return *direntp ? 1 : -1;
+}
+
+static PyObject *
+Dir_iter (PyObject *self)
+{
+  Py_INCREF (self);
+  return self;
+}
+
+#if SMBCLIENT_VERSION >= 400 /* 0.4.0 or newer */
+struct dir_plus_entry
+{
+  struct libsmb_file_info info;
+  struct stat st;
+  bool have_st;
+  char name[1024];
+};
+
+/*
+  Read the next entry and its attributes into *entry, whose name
+  points to entry->name or, if it does not fit, to a malloc()ed copy.
+  Returns 1, 0 at the end of the directory, or -1 with errno set.
+  Called without the GIL.
+*/
+static int
+dir_next_plus (Dir *self, struct dir_plus_entry *entry)
+{
+  Context *ctx = self->context;
+  const struct libsmb_file_info *info;
+  size_t len;
+
+  DIR_LOCK (self);
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+#if SMBCLIENT_VERSION >= 600 /* 0.6.0 or newer */
+  info = (*smbc_getFunctionReaddirPlus2 (ctx->context)) (ctx->context,
+							  self->dir,
+							  &entry->st);
+  entry->have_st = true;
+#else
+  info = (*smbc_getFunctionReaddirPlus (ctx->context)) (ctx->context,
+							 self->dir);
+  entry->have_st = false;
+#endif
+  if (info == NULL)
+    {
+      PyThread_release_lock (ctx->lock);
+      DIR_UNLOCK (self);
+      return errno ? -1 : 0;
+    }
+
+  entry->info = *info;
+  len = strlen (info->name) + 1;
+  if (len <= sizeof (entry->name))
+    entry->info.name = entry->name;
+  else
+    entry->info.name = malloc (len);
+
+  if (entry->info.name)
+    memcpy (entry->info.name, info->name, len);
+
+  entry->info.short_name = NULL;
+  PyThread_release_lock (ctx->lock);
+  DIR_UNLOCK (self);
+  if (entry->info.name == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  return 1;
+}
+
+static unsigned int
+dir_plus_type (const struct dir_plus_entry *entry)
+{
+  return (entry->info.attrs & DIR_ATTR_DIRECTORY) ? SMBC_DIR : SMBC_FILE;
+}
+
+/* As dir_next_plus, but only for the entries wanted. */
+static int
+dir_next_plus_wanted (Dir *self, struct dir_plus_entry *entry)
+{
+  int ret;
+
+  while ((ret = dir_next_plus (self, entry)) > 0)
+    {
+      /* Like os.scandir, leave out '.' and '..'. */
+      if (strcmp (entry->info.name, ".") && strcmp (entry->info.name, "..") &&
+	  dir_wanted (self, entry->info.name, dir_plus_type (entry)))
+	break;
+
+      if (entry->info.name != entry->name)
+	free (entry->info.name);
+    }
+
+  return ret;
+}
+
+static PyObject *
+dir_next_plus_dirent (Dir *self)
+{
+  struct dir_plus_entry entry;
+  PyObject *dent;
+  int ret;
+
+  Py_BEGIN_ALLOW_THREADS
+  ret = dir_next_plus_wanted (self, &entry);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  if (ret == 0)
+    return NULL;
+
+  dent = Dirent_FromFileInfo (&entry.info,
+			      entry.have_st ? &entry.st : NULL);
+  if (entry.info.name != entry.name)
+    free (entry.info.name);
+
+  return dent;
+}
+#endif /* SMBCLIENT_VERSION >= 400 */
+
+/* List entries with their attributes from now on. */
+void
+dir_use_readdirplus (PyObject *self)
+{
+  ((Dir *) self)->plus = true;
+}
+
+/*
+  Take the next entry, as dir_next does, but without releasing the GIL
+  if it is already buffered.
+*/
+static int
+dir_next_buffered (Dir *dir, union dir_entry *space,
+		   struct smbc_dirent **direntp)
+{
+  bool buffered = false;
+  int ret = 0;
+
+  /*
+    Entries already buffered are taken without releasing the GIL.
+    Trying the lock cannot deadlock; if another thread has it, or the
+    buffer needs refilling, take the slow path.
+  */
+  if (PyThread_acquire_lock (dir->lock, NOWAIT_LOCK))
+    {
+      dir_skip (dir);
+      if (dir->buf_pos < dir->buf_len)
+	{
+	  buffered = true;
+	  *direntp = dir_take_entry (dir, space);
+	  ret = *direntp ? 1 : -1;
+	}
+
+      DIR_UNLOCK (dir);
+    }
+
+  if (!buffered)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      ret = dir_next (dir, space, direntp);
+      Py_END_ALLOW_THREADS
+    }
+
+  return ret;
+}
+
+static PyObject *
+Dir_iternext (PyObject *self)
+{
+  Dir *dir = (Dir *) self;
+  union dir_entry space;
+  struct smbc_dirent *dirp = NULL;
+  PyObject *dent;
+  int ret;
+
+#if SMBCLIENT_VERSION >= 400 /* 0.4.0 or newer */
+  if (dir->plus)
+    return dir_next_plus_dirent (dir);
+#endif
+
+  ret = dir_next_buffered (dir, &space, &dirp);
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  if (ret == 0)
+    return NULL;
+
+  dent = Dirent_FromSmbcDirent (dirp);
+  dir_free_entry (dirp, &space);
+  return dent;
+}
+
 static PyObject *
 Dir_getdents (Dir *self)
-  {
-    PyObject *result = NULL;
-    PyObject *listobj = NULL;
-    SMBCCTX *ctx;
+{
+  PyObject *listobj;
+  PyObject *dent;
+
+  debugprintf ("-> Dir_getdents()\n");
+  listobj = PyList_New (0);
+  if (listobj == NULL)
+    return NULL;
+
+  while ((dent = Dir_iternext ((PyObject *) self)) != NULL)
+    {
+      int ret = PyList_Append (listobj, dent);
+      Py_DECREF (dent);
+      if (ret < 0)
+	break;
+    }
+
+  if (PyErr_Occurred ())
+    {
+      debugprintf ("<- Dir_getdents() EXCEPTION\n");
+      Py_DECREF (listobj);
+      return NULL;
+    }
+
+  debugprintf ("<- Dir_getdents() = list\n");
+  return listobj;
+}
+
+/*
+  Columns.  Dir.read_columns collects the entries into flat arrays,
+  all without the GIL, so that a huge listing costs a few bytes per
+  entry rather than a Dirent object each.  The names are packed one
+  after another into a single buffer, and entry i's name runs from
+  offsets[i] to offsets[i + 1].  array.array has no 64-bit codes in
+  Python 2, where the native long is used instead.
+*/
+
+#if PY_MAJOR_VERSION >= 3
+typedef unsigned long long dir_col_offset;
+typedef long long dir_col_int;
+#define DIR_COL_OFFSET_CODE "Q"
+#define DIR_COL_INT_CODE "q"
+#else
+typedef unsigned long dir_col_offset;
+typedef long dir_col_int;
+#define DIR_COL_OFFSET_CODE "L"
+#define DIR_COL_INT_CODE "l"
+#endif
+
+struct dir_column
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct dir_columns
+{
+  struct dir_column names;
+  struct dir_column offsets;
+  struct dir_column types;
+  struct dir_column sizes;
+  struct dir_column mtimes;	/* in nanoseconds */
+  bool have_times;		/* sizes and mtimes are filled in */
+};
+
+static int
+dir_column_add (struct dir_column *col, const void *data, size_t len)
+{
+  if (col->len + len > col->cap)
+    {
+      size_t cap = col->cap ? col->cap : 4096;
+      char *p;
+
+      while (cap < col->len + len)
+	cap *= 2;
+
+      p = realloc (col->data, cap);
+      if (p == NULL)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+
+      col->data = p;
+      col->cap = cap;
+    }
+
+  memcpy (col->data + col->len, data, len);
+  col->len += len;
+  return 0;
+}
+
+static void
+dir_columns_free (struct dir_columns *cols)
+{
+  free (cols->names.data);
+  free (cols->offsets.data);
+  free (cols->types.data);
+  free (cols->sizes.data);
+  free (cols->mtimes.data);
+}
+
+static int
+dir_columns_add (struct dir_columns *cols, const char *name,
+		 unsigned int type, off_t size, const struct timespec *mtime)
+{
+  dir_col_offset end;
+  unsigned char t = type;
+
+  if (dir_column_add (&cols->names, name, strlen (name)) < 0)
+    return -1;
+
+  end = cols->names.len;
+  if (dir_column_add (&cols->offsets, &end, sizeof (end)) < 0 ||
+      dir_column_add (&cols->types, &t, sizeof (t)) < 0)
+    return -1;
+
+  if (mtime)
+    {
+      dir_col_int sz = size;
+      dir_col_int ns = (dir_col_int) mtime->tv_sec * 1000000000 +
+	mtime->tv_nsec;
+
+      if (dir_column_add (&cols->sizes, &sz, sizeof (sz)) < 0 ||
+	  dir_column_add (&cols->mtimes, &ns, sizeof (ns)) < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+/*
+  Add up to max entries (all if negative) to cols.  Returns 0, or -1
+  with errno set.  Called without the GIL.
+*/
+static int
+dir_read_columns (Dir *self, Py_ssize_t max, struct dir_columns *cols)
+{
+  dir_col_offset start = 0;
+  Py_ssize_t n;
+  int ret = 0;
+
+  if (dir_column_add (&cols->offsets, &start, sizeof (start)) < 0)
+    return -1;
+
+#if SMBCLIENT_VERSION >= 400 /* 0.4.0 or newer */
+  if (self->plus)
+    {
+      cols->have_times = true;
+      for (n = 0; max < 0 || n < max; n++)
+	{
+	  struct dir_plus_entry entry;
 
-    debugprintf ("-> Dir_getdents()\n");
-    ctx = self->context->context;
-    do /*once*/
+	  ret = dir_next_plus_wanted (self, &entry);
+	  if (ret <= 0)
+	    break;
+
+	  ret = dir_columns_add (cols, entry.info.name, dir_plus_type (&entry),
+				 entry.info.size, &entry.info.mtime_ts);
+	  if (entry.info.name != entry.name)
+	    free (entry.info.name);
+	  if (ret < 0)
+	    break;
+	}
+
+      return ret < 0 ? -1 : 0;
+    }
+#endif
+
+  for (n = 0; max < 0 || n < max; n++)
+    {
+      union dir_entry space;
+      struct smbc_dirent *dirp = NULL;
+
+      ret = dir_next (self, &space, &dirp);
+      if (ret <= 0)
+	break;
+
+      ret = dir_columns_add (cols, dirp->name, dirp->smbc_type, 0, NULL);
+      dir_free_entry (dirp, &space);
+      if (ret < 0)
+	break;
+    }
+
+  return ret < 0 ? -1 : 0;
+}
+
+/* An array.array of the given type code holding a copy of col. */
+static PyObject *
+dir_column_array (PyObject *arraymod, const char *code,
+		  const struct dir_column *col)
+{
+  PyObject *array;
+  PyObject *view;
+  PyObject *ret;
+
+  array = PyObject_CallMethod (arraymod, "array", "s", code);
+  if (array == NULL || col->len == 0)
+    return array;
+
+#if PY_MAJOR_VERSION >= 3
+  view = PyMemoryView_FromMemory (col->data, col->len, PyBUF_READ);
+  ret = view ? PyObject_CallMethod (array, "frombytes", "O", view) : NULL;
+#else
+  view = PyBuffer_FromMemory (col->data, col->len);
+  ret = view ? PyObject_CallMethod (array, "fromstring", "O", view) : NULL;
+#endif
+  Py_XDECREF (view);
+  if (ret == NULL)
+    {
+      Py_DECREF (array);
+      return NULL;
+    }
+
+  Py_DECREF (ret);
+  return array;
+}
+
+static PyObject *
+Dir_read_columns (Dir *self, PyObject *args, PyObject *kwds)
+{
+  Py_ssize_t n = -1;
+  struct dir_columns cols;
+  PyObject *arraymod;
+  PyObject *result = NULL;
+  int ret;
+  static char *kwlist[] =
+    {
+      "n",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|n", kwlist, &n))
+    return NULL;
+
+  arraymod = PyImport_ImportModule ("array");
+  if (arraymod == NULL)
+    return NULL;
+
+  memset (&cols, 0, sizeof (cols));
+  Py_BEGIN_ALLOW_THREADS
+  ret = dir_read_columns (self, n, &cols);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    pysmbc_SetFromErrno ();
+  else
+    {
+      PyObject *names, *offsets, *types, *sizes, *mtimes;
+
+      names = PyBytes_FromStringAndSize (cols.names.data, cols.names.len);
+      offsets = dir_column_array (arraymod, DIR_COL_OFFSET_CODE,
+				  &cols.offsets);
+      types = dir_column_array (arraymod, "B", &cols.types);
+      if (cols.have_times)
+	{
+	  sizes = dir_column_array (arraymod, DIR_COL_INT_CODE, &cols.sizes);
+	  mtimes = dir_column_array (arraymod, DIR_COL_INT_CODE,
+				     &cols.mtimes);
+	}
+      else
+	{
+	  sizes = Py_None;
+	  mtimes = Py_None;
+	  Py_INCREF (sizes);
+	  Py_INCREF (mtimes);
+	}
+
+      if (names && offsets && types && sizes && mtimes)
+	result = Py_BuildValue ("{sOsOsOsOsO}",
+				"names", names,
+				"offsets", offsets,
+				"types", types,
+				"sizes", sizes,
+				"mtimes", mtimes);
+
+      Py_XDECREF (names);
+      Py_XDECREF (offsets);
+      Py_XDECREF (types);
+      Py_XDECREF (sizes);
+      Py_XDECREF (mtimes);
+    }
+
+  Py_DECREF (arraymod);
+  dir_columns_free (&cols);
+  return result;
+}
+
+/*
+  Positions.  libsmbclient reads the whole directory when it is
+  opened, so telldir, lseekdir and readdir only move through a list in
+  memory.  Their cookies mean nothing to any other handle, though, so
+  Dir.page hands out tokens of its own: the number of entries taken
+  so far, including those filtered out, and the name of the last one.
+
+  A listing from the cache has no handle; its cookies are offsets into
+  the buffer.  These are called without the GIL, with the Dir lock
+  held.
+*/
+
+/* Move the handle to the entry at buf_pos, or to the end. */
+static int
+dir_seek_handle (Dir *self, off_t cookie, size_t skip)
+{
+  Context *ctx = self->context;
+  SMBCCTX *c = ctx->context;
+  int ret;
+
+  errno = 0;
+  ret = (*smbc_getFunctionLseekdir (c)) (c, self->dir, cookie);
+  while (ret == 0 && skip-- > 0)
+    if ((*smbc_getFunctionReaddir (c)) (c, self->dir) == NULL)
       {
-        listobj = PyList_New(0);
-        if (PyErr_Occurred())
-            break;
-        const smbc_getdents_fn fn_getdents = smbc_getFunctionGetdents(ctx);
-        errno = 0;
-        for (;;)
-          {
-            char dirbuf[1024];
-            int dirlen = fn_getdents(ctx, self->dir, (struct smbc_dirent *)dirbuf, sizeof dirbuf);
-            struct smbc_dirent *dirp;
-            if (dirlen <= 0)
-              {
-                if (dirlen < 0)
-                  {
-                    pysmbc_SetFromErrno();
-                    debugprintf ("<- Dir_getdents() EXCEPTION\n");
-                  } /*if*/
-                break;
-              } /*if*/
-            debugprintf ("dirlen = %d\n", dirlen);
-            dirp = (struct smbc_dirent *)dirbuf;
-            for (;;)
-              {
-                PyObject *dent = NULL;
-                PyObject *largs = NULL;
-                PyObject *lkwlist = NULL;
-                PyObject *name = NULL;
-                PyObject *comment = NULL;
-                PyObject *type = NULL;
-                do /*once*/
-                  {
-                    largs = Py_BuildValue("()");
-                    if (PyErr_Occurred())
-                        break;
-                    name = PyBytes_FromString(dirp->name);
-                    if (PyErr_Occurred())
-                        break;
-                    comment = PyBytes_FromString(dirp->comment);
-                    if (PyErr_Occurred())
-                        break;
-                    type = PyLong_FromLong(dirp->smbc_type);
-                    if (PyErr_Occurred())
-                        break;
-                    lkwlist = PyDict_New();
-                    if (PyErr_Occurred())
-                        break;
-                    PyDict_SetItemString(lkwlist, "name", name);
-                    if (PyErr_Occurred())
-                        break;
-                    PyDict_SetItemString(lkwlist, "comment", comment);
-                    if (PyErr_Occurred())
-                        break;
-                    PyDict_SetItemString(lkwlist, "smbc_type", type);
-                    if (PyErr_Occurred())
-                        break;
-                    dent = smbc_DirentType.tp_new(&smbc_DirentType, largs, lkwlist);
-                    if (PyErr_Occurred())
-                        break;
-                    if (smbc_DirentType.tp_init(dent, largs, lkwlist) < 0)
-                      {
-                        PyErr_SetString(PyExc_RuntimeError, "Cannot initialize smbc_DirentType");
-                        break;
-                      } /*if*/
-                    PyList_Append(listobj, dent);
-                    if (PyErr_Occurred())
-                        break;
-                  }
-                while (false);
-                Py_XDECREF(dent);
-                Py_XDECREF(largs);
-                Py_XDECREF(lkwlist);
-                Py_XDECREF(name);
-                Py_XDECREF(comment);
-                Py_XDECREF(type);
-                if (PyErr_Occurred())
-                    break;
-                const int len = dirp->dirlen;
-                dirp = (struct smbc_dirent *)(((char *)dirp) + len);
-                dirlen -= len;
-                if (dirlen == 0)
-                    break;
-              } /*for*/
-            if (PyErr_Occurred())
-                break;
-          } /*for*/
-        if (PyErr_Occurred())
-            break;
-      /* all done */
-        result = listobj;
-        listobj = NULL; /* so I don't dispose of it yet */
-        debugprintf ("<- Dir_getdents() = list\n");
+	errno = EINVAL;
+	ret = -1;
       }
-    while (false);
-    Py_XDECREF(listobj);
-    return result;
-  } /*Dir_getdents*/
+
+  return ret;
+}
+
+/* The number of entries in the buffer before buf_pos. */
+static size_t
+dir_buffered_before (Dir *self)
+{
+  size_t pos = 0;
+  size_t n = 0;
+
+  while (pos < self->buf_pos)
+    {
+      pos += ((struct smbc_dirent *) (self->buf + pos))->dirlen;
+      n++;
+    }
+
+  return n;
+}
+
+/* Forget the buffered entries: the handle has moved. */
+static void
+dir_drop_buffer (Dir *self)
+{
+  self->buf_pos = self->buf_len = 0;
+  self->eof = false;
+  dircache_record_end (self->context->dircache, &self->rec, false);
+}
+
+static int
+dir_tell (Dir *self, off_t *cookie)
+{
+  Context *ctx = self->context;
+  SMBCCTX *c = ctx->context;
+  smbc_telldir_fn telldir = smbc_getFunctionTelldir (c);
+  int ret = 0;
+
+  if (self->listing)
+    {
+      *cookie = self->buf_pos;
+      return 0;
+    }
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  *cookie = -1;
+  if (self->buf_pos < self->buf_len)
+    {
+      /* The handle is past the buffer: step back to buf_pos and return. */
+      off_t end = (*telldir) (c, self->dir);
+
+      ret = dir_seek_handle (self, self->buf_cookie,
+			     dir_buffered_before (self));
+      if (ret == 0)
+	{
+	  *cookie = (*telldir) (c, self->dir);
+	  ret = dir_seek_handle (self, end, 0);
+	}
+    }
+  else
+    *cookie = (*telldir) (c, self->dir);
+
+  /* At the end, telldir returns -1 without setting errno. */
+  if (*cookie == -1 && errno)
+    ret = -1;
+
+  PyThread_release_lock (ctx->lock);
+  return ret;
+}
+
+static int
+dir_seek (Dir *self, off_t cookie)
+{
+  Context *ctx = self->context;
+  SMBCCTX *c = ctx->context;
+  size_t index = 0;
+  int ret;
+
+  if (self->listing)
+    {
+      size_t pos = 0;
+
+      while (cookie >= 0 && pos < (size_t) cookie && pos < self->buf_len)
+	{
+	  pos += ((struct smbc_dirent *) (self->buf + pos))->dirlen;
+	  index++;
+	}
+
+      if (cookie < 0 || pos != (size_t) cookie)
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+
+      self->buf_pos = pos;
+      self->index = index;
+      return 0;
+    }
+
+  /* Count the entries before cookie, for Dir.page. */
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  ret = dir_seek_handle (self, cookie, 0);
+  if (ret == 0)
+    ret = dir_seek_handle (self, 0, 0);
+
+  while (ret == 0 &&
+	 (*smbc_getFunctionTelldir (c)) (c, self->dir) != cookie)
+    {
+      if ((*smbc_getFunctionReaddir (c)) (c, self->dir) == NULL)
+	{
+	  errno = EINVAL;
+	  ret = -1;
+	}
+
+      index++;
+    }
+
+  PyThread_release_lock (ctx->lock);
+  dir_drop_buffer (self);
+  if (ret < 0)
+    return -1;
+
+  self->index = index;
+  return 0;
+}
+
+static bool
+dir_name_is (const char *name, const char *want, size_t len)
+{
+  return strlen (name) == len && memcmp (name, want, len) == 0;
+}
+
+/*
+  Go back to just after the index'th entry, if it is still called
+  name, or else to just after the entry called name, wherever it has
+  moved to.
+*/
+static int
+dir_resume (Dir *self, size_t index, const char *name, size_t len)
+{
+  Context *ctx = self->context;
+  SMBCCTX *c = ctx->context;
+  smbc_readdir_fn readdir = smbc_getFunctionReaddir (c);
+  struct smbc_dirent *dirp = NULL;
+  size_t i;
+  int ret = 0;
+
+  if (self->listing)
+    {
+      size_t pos = 0;
+
+      for (i = 0; i < index && pos < self->buf_len; i++)
+	{
+	  dirp = (struct smbc_dirent *) (self->buf + pos);
+	  pos += dirp->dirlen;
+	}
+
+      if (i < index || (dirp && !dir_name_is (dirp->name, name, len)))
+	for (pos = 0, i = 0; pos < self->buf_len; )
+	  {
+	    dirp = (struct smbc_dirent *) (self->buf + pos);
+	    pos += dirp->dirlen;
+	    i++;
+	    if (dir_name_is (dirp->name, name, len))
+	      break;
+	  }
+
+      if (dirp && !dir_name_is (dirp->name, name, len))
+	{
+	  errno = ENOENT;
+	  return -1;
+	}
+
+      self->buf_pos = pos;
+      self->index = i;
+      return 0;
+    }
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  ret = dir_seek_handle (self, 0, 0);
+  for (i = 0; ret == 0 && i < index; i++)
+    if ((dirp = (*readdir) (c, self->dir)) == NULL)
+      break;
+
+  if (ret == 0 && (dirp == NULL || !dir_name_is (dirp->name, name, len)))
+    {
+      ret = dir_seek_handle (self, 0, 0);
+      for (i = 0; ret == 0; )
+	{
+	  dirp = (*readdir) (c, self->dir);
+	  if (dirp == NULL)
+	    {
+	      errno = ENOENT;
+	      ret = -1;
+	      break;
+	    }
+
+	  i++;
+	  if (dir_name_is (dirp->name, name, len))
+	    break;
+	}
+    }
+
+  PyThread_release_lock (ctx->lock);
+  dir_drop_buffer (self);
+  if (ret < 0)
+    return -1;
+
+  self->index = i;
+  return 0;
+}
+
+static int
+dir_check_positions (Dir *self)
+{
+  if (self->plus)
+    {
+      PyErr_SetString (PyExc_NotImplementedError,
+		       "not supported for scandir listings");
+      return -1;
+    }
+
+  return 0;
+}
+
+static PyObject *
+Dir_tell (Dir *self)
+{
+  off_t cookie;
+  int ret;
+
+  if (dir_check_positions (self) < 0)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  DIR_LOCK (self);
+  ret = dir_tell (self, &cookie);
+  DIR_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  return PyLong_FromLongLong (cookie);
+}
+
+static PyObject *
+Dir_seek (Dir *self, PyObject *args)
+{
+  PY_LONG_LONG cookie;
+  int ret;
+
+  if (!PyArg_ParseTuple (args, "L", &cookie))
+    return NULL;
+
+  if (dir_check_positions (self) < 0)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  DIR_LOCK (self);
+  ret = dir_seek (self, cookie);
+  DIR_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Dir_page (Dir *self, PyObject *args, PyObject *kwds)
+{
+  Py_ssize_t n;
+  PyObject *token = Py_None;
+  PyObject *listobj;
+  PyObject *next = NULL;
+  Py_ssize_t i;
+  static char *kwlist[] =
+    {
+      "n",
+      "token",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "n|O", kwlist, &n, &token))
+    return NULL;
+
+  if (n < 1)
+    {
+      PyErr_SetString (PyExc_ValueError, "n must be positive");
+      return NULL;
+    }
+
+  if (dir_check_positions (self) < 0)
+    return NULL;
+
+  if (token != Py_None)
+    {
+      Py_ssize_t index;
+      const char *name;
+      Py_ssize_t len;
+      int ret;
+
+      if (!PyArg_ParseTuple (token, "ns#;token must come from Dir.page",
+			     &index, &name, &len))
+	return NULL;
+
+      if (index < 0)
+	{
+	  PyErr_SetString (PyExc_ValueError, "invalid token");
+	  return NULL;
+	}
+
+      Py_BEGIN_ALLOW_THREADS
+      DIR_LOCK (self);
+      ret = dir_resume (self, index, name, len);
+      DIR_UNLOCK (self);
+      Py_END_ALLOW_THREADS
+      if (ret < 0)
+	{
+	  pysmbc_SetFromErrno ();
+	  return NULL;
+	}
+    }
+
+  listobj = PyList_New (0);
+  if (listobj == NULL)
+    return NULL;
+
+  for (i = 0; i < n; i++)
+    {
+      union dir_entry space;
+      struct smbc_dirent *dirp = NULL;
+      PyObject *dent;
+      int ret = dir_next_buffered (self, &space, &dirp);
+
+      if (ret <= 0)
+	{
+	  if (ret < 0)
+	    pysmbc_SetFromErrno ();
+	  break;
+	}
+
+      dent = Dirent_FromSmbcDirent (dirp);
+      if (dent && i == n - 1)
+	next = Py_BuildValue ("(nN)", (Py_ssize_t) self->index,
+			      PyBytes_FromString (dirp->name));
+
+      dir_free_entry (dirp, &space);
+      if (dent == NULL || PyList_Append (listobj, dent) < 0)
+	{
+	  Py_XDECREF (dent);
+	  break;
+	}
+
+      Py_DECREF (dent);
+    }
+
+  if (PyErr_Occurred ())
+    {
+      Py_DECREF (listobj);
+      Py_XDECREF (next);
+      return NULL;
+    }
+
+  if (next == NULL)
+    {
+      Py_INCREF (Py_None);
+      next = Py_None;
+    }
+
+  return Py_BuildValue ("(NN)", listobj, next);
+}
+
+static PyObject *
+Dir_getBufferSize (Dir *self, void *closure)
+{
+  return PyLong_FromSize_t (self->buf_size);
+}
+
+static int
+Dir_setBufferSize (Dir *self, PyObject *value, void *closure)
+{
+  size_t size;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  size = PyLong_AsSize_t (value);
+  if (size == (size_t) -1 && PyErr_Occurred ())
+    return -1;
+
+  if (size < DIR_MIN_BUFFER_SIZE || size > INT_MAX)
+    {
+      PyErr_Format (PyExc_ValueError, "must be between %d and %d",
+		    DIR_MIN_BUFFER_SIZE, INT_MAX);
+      return -1;
+    }
+
+  /* Takes effect once the entries already fetched are used up. */
+  Py_BEGIN_ALLOW_THREADS
+  DIR_LOCK (self);
+  if (self->buf_pos >= self->buf_len && self->listing == NULL)
+    {
+      free (self->buf);
+      self->buf = NULL;
+      self->buf_pos = self->buf_len = 0;
+    }
+
+  if (self->buf == NULL)
+    self->buf_size = size;
+  DIR_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  return 0;
+}
+
+PyGetSetDef Dir_getseters[] =
+  {
+    { "bufferSize",
+      (getter) Dir_getBufferSize,
+      (setter) Dir_setBufferSize,
+      "Size in bytes of the buffer each smbc_getdents call fills.  Larger\n"
+      "buffers need fewer round trips per directory.",
+      NULL },
+
+    { NULL }
+  };
 
 PyMethodDef Dir_methods[] =
   {
     { "getdents",
       (PyCFunction) Dir_getdents, METH_NOARGS,
       "getdents() -> list\n\n"
-      "@return: a list of L{smbc.Dirent} objects" },
+      "@return: a list of L{smbc.Dirent} objects for the entries not\n"
+      "yet returned" },
+
+    { "read_columns",
+      (PyCFunction) Dir_read_columns, METH_VARARGS | METH_KEYWORDS,
+      "read_columns(n=-1) -> dict\n\n"
+      "Read entries as columns rather than L{smbc.Dirent} objects, for\n"
+      "listings too large to hold an object per entry.  The entries are\n"
+      "read without the GIL, and are those that iterating would return.\n\n"
+      "@type n: int\n"
+      "@param n: most entries to read, or -1 for all those left\n"
+      "@return: a dict of columns: 'names', every name as UTF-8 bytes\n"
+      "packed end to end; 'offsets', an array.array of offsets into\n"
+      "names, one more than there are entries, entry i's name running\n"
+      "from offsets[i] to offsets[i + 1]; 'types', an array.array of\n"
+      "smbc_type values;\n"
+      "and, for a L{smbc.Context.scandir} listing, 'sizes' and 'mtimes'\n"
+      "(in nanoseconds since the epoch) as 64-bit array.arrays, which\n"
+      "are None otherwise.  Every array supports the buffer protocol,\n"
+      "so numpy.frombuffer can use it without a copy." },
+
+    { "tell",
+      (PyCFunction) Dir_tell, METH_NOARGS,
+      "tell() -> int\n\n"
+      "@return: a cookie for the current position, which L{seek} on this\n"
+      "Dir returns to; it means nothing to any other" },
+
+    { "seek",
+      (PyCFunction) Dir_seek, METH_VARARGS,
+      "seek(cookie)\n\n"
+      "@type cookie: int\n"
+      "@param cookie: position returned by L{tell}" },
+
+    { "page",
+      (PyCFunction) Dir_page, METH_VARARGS | METH_KEYWORDS,
+      "page(n, token=None) -> (list, token)\n\n"
+      "Read up to n more entries, and a token to resume after them.\n"
+      "Unlike a L{tell} cookie, the token may be passed to page on any\n"
+      "Dir listing the same directory, with the same pattern and types,\n"
+      "such as one opened after the connection was lost.  It finds the\n"
+      "entry it names again even if entries before it came or went.\n\n"
+      "@type n: int\n"
+      "@param n: most entries to return\n"
+      "@type token: tuple\n"
+      "@param token: resume after the entries a previous page returned\n"
+      "@return: a list of L{smbc.Dirent} objects, and the token for the\n"
+      "next page, or None once the end has been reached\n"
+      "@raise NoEntryError: the entry the token names has gone" },
 
     { NULL } /* Sentinel */
   };
@@ -250,17 +1457,18 @@ PyMethodDef Dir_methods[] =
       "SMBC Dir\n"
       "========\n\n"
   
-      "  A directory object."
+      "  A directory object.  Iterating over it yields L{smbc.Dirent}\n"
+      "  objects as they are read from the server."
       "",                        /* tp_doc */
       0,                         /* tp_traverse */
       0,                         /* tp_clear */
       0,                         /* tp_richcompare */
       0,                         /* tp_weaklistoffset */
-      0,                         /* tp_iter */
-      0,                         /* tp_iternext */
+      Dir_iter,                  /* tp_iter */
+      Dir_iternext,              /* tp_iternext */
       Dir_methods,               /* tp_methods */
       0,                         /* tp_members */
-      0,                         /* tp_getset */
+      Dir_getseters,             /* tp_getset */
       0,                         /* tp_base */
       0,                         /* tp_dict */
       0,                         /* tp_descr_get */
@@ -297,17 +1505,18 @@ PyMethodDef Dir_methods[] =
       "SMBC Dir\n"
       "========\n\n"
   
-      "  A directory object."
+      "  A directory object.  Iterating over it yields L{smbc.Dirent}\n"
+      "  objects as they are read from the server."
       "",                        /* tp_doc */
       0,                         /* tp_traverse */
       0,                         /* tp_clear */
       0,                         /* tp_richcompare */
       0,                         /* tp_weaklistoffset */
-      0,                         /* tp_iter */
-      0,                         /* tp_iternext */
+      Dir_iter,                  /* tp_iter */
+      Dir_iternext,              /* tp_iternext */
       Dir_methods,               /* tp_methods */
       0,                         /* tp_members */
-      0,                         /* tp_getset */
+      Dir_getseters,             /* tp_getset */
       0,                         /* tp_base */
       0,                         /* tp_dict */
       0,                         /* tp_descr_get */
@@ -22,5 +22,6 @@
 
 extern PyMethodDef Dir_methods[];
 extern PyTypeObject smbc_DirType;
+extern void dir_use_readdirplus (PyObject *dir);
 
 #endif /* HAVE_DIR_H */
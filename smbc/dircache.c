@@ -0,0 +1,507 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "smbcmodule.h"
+#include "dircache.h"
+
+//////////////
+// DirCache //
+//////////////
+
+#define DIRCACHE_BUCKETS 256
+
+struct dircache_listing
+{
+  struct dircache_listing *chain;	/* next in its hash bucket */
+  struct dircache_listing *newer;	/* least recently used order */
+  struct dircache_listing *older;
+  unsigned int refs;			/* the cache's, and each Dir's */
+  unsigned int hash;
+  double stored;			/* when it was read */
+  size_t bytes;				/* counted against the size */
+  char *data;
+  size_t len;
+  char key[];
+};
+
+struct dircache
+{
+  PyThread_type_lock lock;
+  double ttl;
+  size_t size;
+  size_t used;
+  unsigned long gen;		/* bumped by each invalidation */
+  struct dircache_listing *newest;
+  struct dircache_listing *oldest;
+  struct dircache_listing *buckets[DIRCACHE_BUCKETS];
+};
+
+static double
+dircache_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  The key for uri: the scheme and server in lower case, and the path
+  without repeated or trailing slashes, so that "smb://Server/share/"
+  and "smb://server//share" name the same directory.  Returns a
+  malloc()ed string, or NULL.
+*/
+static char *
+dircache_key (const char *uri)
+{
+  const char *path = strstr (uri, "://");
+  char *key = malloc (strlen (uri) + 1);
+  char *p = key;
+
+  if (key == NULL)
+    return NULL;
+
+  path = path ? strchr (path + 3, '/') : NULL;
+  while (*uri && uri != path)
+    *p++ = tolower ((unsigned char) *uri++);
+
+  for (; *uri; uri++)
+    if (*uri != '/' || (uri[1] != '/' && uri[1] != '\0'))
+      *p++ = *uri;
+
+  *p = '\0';
+  return key;
+}
+
+/* The length of the key of the directory containing key, or zero. */
+static size_t
+dircache_parent (const char *key)
+{
+  const char *path = strstr (key, "://");
+  const char *slash = strrchr (key, '/');
+
+  if (path == NULL || slash <= path + 2)
+    return 0;
+
+  return slash - key;
+}
+
+static unsigned int
+dircache_hash (const char *key, size_t len)
+{
+  unsigned int hash = 5381;
+
+  while (len--)
+    hash = hash * 33 + (unsigned char) *key++;
+
+  return hash;
+}
+
+static void
+dircache_unref (struct dircache_listing *listing)
+{
+  if (--listing->refs == 0)
+    {
+      free (listing->data);
+      free (listing);
+    }
+}
+
+/* Take listing out of the cache.  The lock is held. */
+static void
+dircache_drop (struct dircache *cache, struct dircache_listing *listing)
+{
+  struct dircache_listing **pp;
+
+  pp = &cache->buckets[listing->hash % DIRCACHE_BUCKETS];
+  while (*pp != listing)
+    pp = &(*pp)->chain;
+
+  *pp = listing->chain;
+  if (listing->newer)
+    listing->newer->older = listing->older;
+  else
+    cache->newest = listing->older;
+
+  if (listing->older)
+    listing->older->newer = listing->newer;
+  else
+    cache->oldest = listing->newer;
+
+  cache->used -= listing->bytes;
+  dircache_unref (listing);
+}
+
+/* The lock is held. */
+static struct dircache_listing *
+dircache_find (struct dircache *cache, const char *key, size_t len)
+{
+  unsigned int hash = dircache_hash (key, len);
+  struct dircache_listing *listing;
+
+  for (listing = cache->buckets[hash % DIRCACHE_BUCKETS];
+       listing;
+       listing = listing->chain)
+    if (listing->hash == hash &&
+	!strncmp (listing->key, key, len) && listing->key[len] == '\0')
+      return listing;
+
+  return NULL;
+}
+
+/* Drop the oldest listings until 'extra' more bytes fit.  The lock is held. */
+static void
+dircache_trim (struct dircache *cache, size_t extra)
+{
+  while (cache->oldest && cache->used + extra > cache->size)
+    dircache_drop (cache, cache->oldest);
+}
+
+static void
+dircache_clear (struct dircache *cache)
+{
+  while (cache->oldest)
+    dircache_drop (cache, cache->oldest);
+}
+
+struct dircache *
+dircache_new (void)
+{
+  struct dircache *cache = calloc (1, sizeof (*cache));
+
+  if (cache == NULL)
+    return NULL;
+
+  cache->lock = PyThread_allocate_lock ();
+  if (cache->lock == NULL)
+    {
+      free (cache);
+      return NULL;
+    }
+
+  cache->size = DIRCACHE_DEFAULT_SIZE;
+  return cache;
+}
+
+void
+dircache_free (struct dircache *cache)
+{
+  dircache_clear (cache);
+  PyThread_free_lock (cache->lock);
+  free (cache);
+}
+
+double
+dircache_ttl (struct dircache *cache)
+{
+  return cache->ttl;
+}
+
+void
+dircache_set_ttl (struct dircache *cache, double ttl)
+{
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+  cache->ttl = ttl;
+  /* Nothing is invalidated while disabled, so no listing being
+     recorded from before can be trusted. */
+  cache->gen++;
+  if (ttl <= 0)
+    dircache_clear (cache);
+  PyThread_release_lock (cache->lock);
+}
+
+size_t
+dircache_size (struct dircache *cache)
+{
+  return cache->size;
+}
+
+void
+dircache_set_size (struct dircache *cache, size_t size)
+{
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+  cache->size = size;
+  dircache_trim (cache, 0);
+  PyThread_release_lock (cache->lock);
+}
+
+struct dircache_listing *
+dircache_lookup (struct dircache *cache, const char *uri, const char **data,
+		 size_t *len)
+{
+  struct dircache_listing *listing;
+  char *key;
+
+  if (cache->ttl <= 0)
+    return NULL;
+
+  key = dircache_key (uri);
+  if (key == NULL)
+    return NULL;
+
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+  listing = dircache_find (cache, key, strlen (key));
+  if (listing && dircache_now () - listing->stored >= cache->ttl)
+    {
+      dircache_drop (cache, listing);
+      listing = NULL;
+    }
+
+  if (listing)
+    {
+      /* Make it the most recently used. */
+      if (listing->newer)
+	{
+	  listing->newer->older = listing->older;
+	  if (listing->older)
+	    listing->older->newer = listing->newer;
+	  else
+	    cache->oldest = listing->newer;
+
+	  listing->older = cache->newest;
+	  listing->newer = NULL;
+	  cache->newest->newer = listing;
+	  cache->newest = listing;
+	}
+
+      listing->refs++;
+      *data = listing->data;
+      *len = listing->len;
+    }
+
+  PyThread_release_lock (cache->lock);
+  free (key);
+  return listing;
+}
+
+void
+dircache_release (struct dircache *cache, struct dircache_listing *listing)
+{
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+  dircache_unref (listing);
+  PyThread_release_lock (cache->lock);
+}
+
+bool
+dircache_record_start (struct dircache *cache, const char *uri,
+		       struct dircache_record *rec)
+{
+  memset (rec, 0, sizeof (*rec));
+  if (cache->ttl <= 0)
+    return false;
+
+  rec->key = dircache_key (uri);
+  if (rec->key == NULL)
+    return false;
+
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+  rec->gen = cache->gen;
+  PyThread_release_lock (cache->lock);
+  return true;
+}
+
+static void
+dircache_record_clear (struct dircache_record *rec)
+{
+  free (rec->key);
+  free (rec->data);
+  memset (rec, 0, sizeof (*rec));
+}
+
+/*
+  The data is moved as it grows, so until the listing is complete
+  each entry's comment pointer holds the comment's offset within the
+  entry instead.  A comment stored elsewhere, which libsmbclient does
+  not do, is replaced by an empty one.
+*/
+void
+dircache_record (struct dircache_record *rec, const char *buf, size_t len)
+{
+  size_t pos;
+
+  if (rec->key == NULL)
+    return;
+
+  if (rec->len + len > rec->cap)
+    {
+      size_t cap = rec->cap ? rec->cap : len;
+      char *data;
+
+      while (cap < rec->len + len)
+	cap *= 2;
+
+      data = realloc (rec->data, cap);
+      if (data == NULL)
+	{
+	  dircache_record_clear (rec);
+	  return;
+	}
+
+      rec->data = data;
+      rec->cap = cap;
+    }
+
+  memcpy (rec->data + rec->len, buf, len);
+  for (pos = 0; pos < len; )
+    {
+      const struct smbc_dirent *dirp;
+      struct smbc_dirent *copy;
+      const char *start = buf + pos;
+      size_t offset;
+
+      dirp = (const struct smbc_dirent *) start;
+      if (dirp->dirlen <= offsetof (struct smbc_dirent, name) ||
+	  dirp->dirlen > len - pos)
+	{
+	  dircache_record_clear (rec);
+	  return;
+	}
+
+      if (dirp->comment >= start && dirp->comment < start + dirp->dirlen)
+	offset = dirp->comment - start;
+      else
+	offset = dirp->name + strlen (dirp->name) - start;
+
+      copy = (struct smbc_dirent *) (rec->data + rec->len + pos);
+      copy->comment = (char *) (uintptr_t) offset;
+      pos += dirp->dirlen;
+    }
+
+  rec->len += len;
+}
+
+void
+dircache_record_end (struct dircache *cache, struct dircache_record *rec,
+		     bool complete)
+{
+  struct dircache_listing *listing;
+  struct dircache_listing *old;
+  size_t keylen;
+  size_t pos;
+
+  if (rec->key == NULL || !complete)
+    {
+      dircache_record_clear (rec);
+      return;
+    }
+
+  for (pos = 0; pos < rec->len; )
+    {
+      struct smbc_dirent *dirp = (struct smbc_dirent *) (rec->data + pos);
+      dirp->comment = (char *) dirp + (uintptr_t) dirp->comment;
+      pos += dirp->dirlen;
+    }
+
+  keylen = strlen (rec->key);
+  listing = malloc (sizeof (*listing) + keylen + 1);
+  if (listing == NULL)
+    {
+      dircache_record_clear (rec);
+      return;
+    }
+
+  memcpy (listing->key, rec->key, keylen + 1);
+  listing->hash = dircache_hash (rec->key, keylen);
+  listing->data = rec->data;
+  listing->len = rec->len;
+  listing->bytes = sizeof (*listing) + keylen + rec->cap;
+  listing->refs = 1;
+  rec->data = NULL;
+
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+  if (cache->ttl <= 0 || cache->gen != rec->gen ||
+      listing->bytes > cache->size)
+    {
+      dircache_unref (listing);
+      PyThread_release_lock (cache->lock);
+      dircache_record_clear (rec);
+      return;
+    }
+
+  old = dircache_find (cache, listing->key, keylen);
+  if (old)
+    dircache_drop (cache, old);
+
+  dircache_trim (cache, listing->bytes);
+  listing->stored = dircache_now ();
+  listing->chain = cache->buckets[listing->hash % DIRCACHE_BUCKETS];
+  cache->buckets[listing->hash % DIRCACHE_BUCKETS] = listing;
+  listing->newer = NULL;
+  listing->older = cache->newest;
+  if (cache->newest)
+    cache->newest->newer = listing;
+  else
+    cache->oldest = listing;
+
+  cache->newest = listing;
+  cache->used += listing->bytes;
+  PyThread_release_lock (cache->lock);
+  dircache_record_clear (rec);
+}
+
+void
+dircache_invalidate (struct dircache *cache, const char *uri, bool tree)
+{
+  struct dircache_listing *listing;
+  struct dircache_listing *older;
+  int err = errno;
+  char *key;
+  size_t len;
+
+  if (cache->ttl <= 0)
+    return;
+
+  key = dircache_key (uri);
+  PyThread_acquire_lock (cache->lock, WAIT_LOCK);
+
+  /* Listings being recorded may already be stale. */
+  cache->gen++;
+  if (key == NULL)
+    {
+      /* Without the key, play safe. */
+      dircache_clear (cache);
+      PyThread_release_lock (cache->lock);
+      errno = err;
+      return;
+    }
+
+  len = strlen (key);
+  if (tree)
+    {
+      for (listing = cache->newest; listing; listing = older)
+	{
+	  older = listing->older;
+	  if (!strncmp (listing->key, key, len) &&
+	      (listing->key[len] == '\0' || listing->key[len] == '/'))
+	    dircache_drop (cache, listing);
+	}
+    }
+  else if ((listing = dircache_find (cache, key, len)) != NULL)
+    dircache_drop (cache, listing);
+
+  len = dircache_parent (key);
+  if (len && (listing = dircache_find (cache, key, len)) != NULL)
+    dircache_drop (cache, listing);
+
+  PyThread_release_lock (cache->lock);
+  free (key);
+  errno = err;
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_DIRCACHE_H
+#define HAVE_DIRCACHE_H
+
+#define DIRCACHE_DEFAULT_SIZE (8 * 1024 * 1024)
+
+/*
+  An optional cache of directory listings, one per Context, used by
+  Dir so that listing a directory again within 'ttl' seconds needs no
+  round trip to the server.  A listing is kept as the raw smbc_dirent
+  entries smbc_getdents returned for it, keyed by the normalized URI
+  of the directory, and the least recently used listings are dropped
+  to keep the total under 'size' bytes.
+
+  The cache has its own lock, which is never held across a call into
+  libsmbclient, so all of these may be called with or without the
+  GIL.
+*/
+struct dircache;
+
+/* A cached listing, shared read-only by the Dirs using it. */
+struct dircache_listing;
+
+/* A listing being read by a Dir, to be cached once it is complete. */
+struct dircache_record
+{
+  char *key;
+  unsigned long gen;
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+extern struct dircache *dircache_new (void);
+extern void dircache_free (struct dircache *cache);
+
+/* A ttl of zero, the default, disables the cache and empties it. */
+extern double dircache_ttl (struct dircache *cache);
+extern void dircache_set_ttl (struct dircache *cache, double ttl);
+extern size_t dircache_size (struct dircache *cache);
+extern void dircache_set_size (struct dircache *cache, size_t size);
+
+/*
+  Find the listing of uri.  On success its entries are at *data and
+  the listing must be given back with dircache_release once they are
+  no longer used; NULL means there is none, or it has expired.
+*/
+extern struct dircache_listing *dircache_lookup (struct dircache *cache,
+						 const char *uri,
+						 const char **data,
+						 size_t *len);
+extern void dircache_release (struct dircache *cache,
+			      struct dircache_listing *listing);
+
+/*
+  Recording a listing: dircache_record_start returns false if the
+  cache is disabled.  Each buffer smbc_getdents fills is passed to
+  dircache_record, and dircache_record_end caches the whole listing if
+  'complete', unless the directory was invalidated meanwhile.  Either
+  way the record is emptied again.
+*/
+extern bool dircache_record_start (struct dircache *cache, const char *uri,
+				   struct dircache_record *rec);
+extern void dircache_record (struct dircache_record *rec, const char *buf,
+			     size_t len);
+extern void dircache_record_end (struct dircache *cache,
+				 struct dircache_record *rec, bool complete);
+
+/*
+  Drop the listings that a change to uri makes stale: those of uri and
+  of its parent directory, and if 'tree' those of every directory
+  below uri as well.  Does nothing if the cache is disabled, and
+  leaves errno alone, so may be called between a failed call and
+  reporting its error.
+*/
+extern void dircache_invalidate (struct dircache *cache, const char *uri,
+				 bool tree);
+
+#endif /* HAVE_DIRCACHE_H */
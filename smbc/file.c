@@ -23,9 +23,14 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <poll.h>
+#include <unistd.h>
 #include "smbcmodule.h"
 #include "context.h"
 #include "file.h"
+#include "digest.h"
+#include "readahead.h"
+#include "writebehind.h"
 
 //////////
 // File //
@@ -48,13 +53,955 @@ typedef PY_LONG off_t_long;
 #define OFF_T_FORMAT "l"
 #endif
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+/*
+  Buffering.
+
+  When bufferSize is non-zero the File keeps a buffer of that many
+  bytes.  It is either a read buffer, of which buf[buf_pos..buf_len)
+  has been fetched from the server but not yet consumed, or, when
+  buf_dirty is set, a write buffer of which buf[buf_pos..buf_len) has
+  not yet been sent.  Either way the server-side offset is at the end
+  of the buffered data.
+
+  Beneath the buffer sits the readahead engine.  Once reads are seen
+  to be sequential it serves them from blocks prefetched by its own
+  thread, and ra_pos rather than the SMBCFILE offset tracks where the
+  stream is; any other operation stops it first, which moves the
+  SMBCFILE offset to ra_pos.  Write-behind does the same for writes
+  with wb_pos; stopping it waits for the queued writes to complete,
+  and an error doing so is kept in wb_err for the next write, flush
+  or close to report.
+
+  The buffer and the file offset are guarded by the File's lock.  It
+  is only ever taken without the GIL, and before the Context's lock,
+  which is held for each individual libsmbclient call.
+*/
+#define FILE_LOCK(self) PyThread_acquire_lock ((self)->lock, WAIT_LOCK)
+#define FILE_UNLOCK(self) PyThread_release_lock ((self)->lock)
+
+static int
+file_readahead_stop (File *self)
+{
+  Context *ctx = self->context;
+  smbc_lseek_fn fn;
+  off_t ret;
+
+  if (!self->ra_active)
+    return 0;
+
+  readahead_reset (self->ra);
+  self->ra_active = false;
+  fn = smbc_getFunctionLseek (ctx->context);
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  ret = (*fn) (ctx->context, self->file, self->ra_pos, SEEK_SET);
+  PyThread_release_lock (ctx->lock);
+  return ret < 0 ? -1 : 0;
+}
+
+static int
+file_writebehind_stop (File *self)
+{
+  Context *ctx = self->context;
+  smbc_lseek_fn fn;
+  off_t ret;
+
+  if (!self->wb_active)
+    return 0;
+
+  if (writebehind_drain (self->wb) < 0 && self->wb_err == 0)
+    self->wb_err = errno;
+
+  self->wb_active = false;
+  fn = smbc_getFunctionLseek (ctx->context);
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  ret = (*fn) (ctx->context, self->file, self->wb_pos, SEEK_SET);
+  PyThread_release_lock (ctx->lock);
+  return ret < 0 ? -1 : 0;
+}
+
+/* Stop both engines, leaving the SMBCFILE offset at the stream offset. */
+static int
+file_engines_stop (File *self)
+{
+  if (file_readahead_stop (self) < 0)
+    return -1;
+
+  return file_writebehind_stop (self);
+}
+
+/* Report, once, an error deferred by file_writebehind_stop. */
+static int
+file_take_write_error (File *self)
+{
+  if (self->wb_err == 0)
+    return 0;
+
+  errno = self->wb_err;
+  self->wb_err = 0;
+  return -1;
+}
+
+static ssize_t
+file_raw_read (File *self, void *buf, size_t size)
+{
+  Context *ctx = self->context;
+  smbc_read_fn fn = smbc_getFunctionRead (ctx->context);
+  ssize_t len;
+
+  if (file_engines_stop (self) < 0)
+    return -1;
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  len = (*fn) (ctx->context, self->file, buf, size);
+  PyThread_release_lock (ctx->lock);
+  return len;
+}
+
+static ssize_t
+file_raw_write (File *self, const void *buf, size_t size)
+{
+  Context *ctx = self->context;
+  smbc_write_fn fn = smbc_getFunctionWrite (ctx->context);
+  ssize_t len;
+
+  if (file_engines_stop (self) < 0)
+    return -1;
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  len = (*fn) (ctx->context, self->file, buf, size);
+  PyThread_release_lock (ctx->lock);
+  return len;
+}
+
+static off_t
+file_raw_lseek (File *self, off_t offset, int whence)
+{
+  Context *ctx = self->context;
+  smbc_lseek_fn fn = smbc_getFunctionLseek (ctx->context);
+  off_t ret;
+
+  if (file_engines_stop (self) < 0)
+    return -1;
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  ret = (*fn) (ctx->context, self->file, offset, whence);
+  PyThread_release_lock (ctx->lock);
+  return ret;
+}
+
+/*
+  Positional read: read up to size bytes at offset, leaving the
+  SMBCFILE offset where it was.  May be called from any thread, but
+  never with the GIL held.
+*/
+ssize_t
+file_pread (File *self, void *buf, size_t size, off_t offset)
+{
+  Context *ctx = self->context;
+  smbc_lseek_fn fn_lseek = smbc_getFunctionLseek (ctx->context);
+  smbc_read_fn fn_read = smbc_getFunctionRead (ctx->context);
+  size_t done = 0;
+  ssize_t len = 0;
+  off_t saved;
+  int err = 0;
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  saved = (*fn_lseek) (ctx->context, self->file, 0, SEEK_CUR);
+  if (saved < 0 ||
+      (*fn_lseek) (ctx->context, self->file, offset, SEEK_SET) < 0)
+    {
+      err = errno;
+      PyThread_release_lock (ctx->lock);
+      errno = err;
+      return -1;
+    }
+
+  while (done < size)
+    {
+      len = (*fn_read) (ctx->context, self->file,
+			(char *) buf + done, size - done);
+      if (len <= 0)
+	break;
+
+      done += len;
+    }
+
+  err = errno;
+  (*fn_lseek) (ctx->context, self->file, saved, SEEK_SET);
+  PyThread_release_lock (ctx->lock);
+  if (len < 0 && done == 0)
+    {
+      errno = err;
+      return -1;
+    }
+
+  return done;
+}
+
+/* Positional write; the counterpart of file_pread. */
+ssize_t
+file_pwrite (File *self, const void *buf, size_t size, off_t offset)
+{
+  Context *ctx = self->context;
+  smbc_lseek_fn fn_lseek = smbc_getFunctionLseek (ctx->context);
+  smbc_write_fn fn_write = smbc_getFunctionWrite (ctx->context);
+  size_t done = 0;
+  ssize_t len = 0;
+  off_t saved;
+  int err = 0;
+
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  saved = (*fn_lseek) (ctx->context, self->file, 0, SEEK_CUR);
+  if (saved < 0 ||
+      (*fn_lseek) (ctx->context, self->file, offset, SEEK_SET) < 0)
+    {
+      err = errno;
+      PyThread_release_lock (ctx->lock);
+      errno = err;
+      return -1;
+    }
+
+  while (done < size)
+    {
+      len = (*fn_write) (ctx->context, self->file,
+			 (const char *) buf + done, size - done);
+      if (len <= 0)
+	break;
+
+      done += len;
+    }
+
+  err = errno;
+  (*fn_lseek) (ctx->context, self->file, saved, SEEK_SET);
+  PyThread_release_lock (ctx->lock);
+  if (len < 0 && done == 0)
+    {
+      errno = err;
+      return -1;
+    }
+
+  return done;
+}
+
+/* Write to the server, or queue on the write-behind engine. */
+static ssize_t
+file_sink_write (File *self, const char *buf, size_t size)
+{
+  ssize_t len;
+  off_t pos;
+
+  if (self->wb_blocks && !self->wb_active)
+    {
+      if (self->wb == NULL)
+	self->wb = writebehind_new (self, self->write_chunk_size,
+				    self->wb_blocks);
+
+      if (self->wb)
+	{
+	  pos = file_raw_lseek (self, 0, SEEK_CUR);
+	  if (pos < 0)
+	    return -1;
+
+	  self->wb_pos = pos;
+	  self->wb_active = true;
+	}
+    }
+
+  if (!self->wb_active)
+    return file_raw_write (self, buf, size);
+
+  len = writebehind_write (self->wb, self->wb_pos, buf, size);
+  if (len > 0)
+    self->wb_pos += len;
+
+  return len;
+}
+
+/* Read from the server, or from the readahead window if active. */
+static ssize_t
+file_source_read (File *self, char *buf, size_t size)
+{
+  ssize_t len;
+
+  if (!self->ra_active)
+    return file_raw_read (self, buf, size);
+
+  len = readahead_read (self->ra, self->ra_pos, buf, size);
+  if (len > 0)
+    self->ra_pos += len;
+
+  return len;
+}
+
+/*
+  Read up to size bytes into buf, issuing requests of at most
+  read_chunk_size bytes until the buffer is full or end of file is
+  reached.  Returns the number of bytes read, or -1 with errno set if
+  any request fails: a short count must only ever mean end of file.
+*/
+static ssize_t
+file_read_fully (File *self, char *buf, size_t size)
+{
+  size_t chunk = self->read_chunk_size;
+  size_t done = 0;
+  ssize_t len;
+
+  while (done < size)
+    {
+      size_t want = size - done;
+      if (chunk && want > chunk)
+	want = chunk;
+
+      len = file_source_read (self, buf + done, want);
+      if (len < 0)
+	return -1;
+
+      if (len == 0)
+	break;
+
+      done += len;
+    }
+
+  return done;
+}
+
+/* Write all of buf, or fail with errno set. */
+static ssize_t
+file_write_fully (File *self, const char *buf, size_t size)
+{
+  size_t chunk = self->write_chunk_size;
+  size_t done = 0;
+  ssize_t len;
+
+  while (done < size)
+    {
+      size_t want = size - done;
+      if (chunk && want > chunk)
+	want = chunk;
+
+      len = file_sink_write (self, buf + done, want);
+      if (len <= 0)
+	{
+	  if (len == 0)
+	    errno = EIO;
+	  return -1;
+	}
+
+      done += len;
+    }
+
+  return done;
+}
+
+/* Send any pending buffered writes. */
+static int
+file_flush_buffer (File *self)
+{
+  ssize_t len;
+
+  if (!self->buf_dirty)
+    return 0;
+
+  while (self->buf_pos < self->buf_len)
+    {
+      len = file_sink_write (self, self->buf + self->buf_pos,
+			     self->buf_len - self->buf_pos);
+      if (len <= 0)
+	{
+	  if (len == 0)
+	    errno = EIO;
+	  return -1;
+	}
+
+      self->buf_pos += len;
+    }
+
+  self->buf_pos = self->buf_len = 0;
+  self->buf_dirty = false;
+  return 0;
+}
+
+/*
+  Empty the buffer, leaving the server-side offset at the logical
+  file position: pending writes are sent and unconsumed read-ahead is
+  given back by seeking backwards.
+*/
+static int
+file_drop_buffer (File *self)
+{
+  size_t unread;
+
+  if (self->buf_dirty)
+    return file_flush_buffer (self);
+
+  unread = self->buf_len - self->buf_pos;
+  if (unread && file_raw_lseek (self, -(off_t) unread, SEEK_CUR) < 0)
+    return -1;
+
+  self->buf_pos = self->buf_len = 0;
+  return 0;
+}
+
+/*
+  Read up to size bytes, looping until satisfied or end of file.  As
+  for file_read_fully, an error is reported even after partial
+  progress.
+*/
+static ssize_t
+file_read (File *self, char *dst, size_t size)
+{
+  size_t done = 0;
+  ssize_t len;
+
+  if (self->buf == NULL)
+    return file_read_fully (self, dst, size);
+
+  if (self->buf_dirty && file_flush_buffer (self) < 0)
+    return -1;
+
+  while (done < size)
+    {
+      size_t avail = self->buf_len - self->buf_pos;
+      if (avail)
+	{
+	  size_t take = MIN (avail, size - done);
+	  memcpy (dst + done, self->buf + self->buf_pos, take);
+	  self->buf_pos += take;
+	  done += take;
+	  continue;
+	}
+
+      if (size - done >= self->buf_size)
+	{
+	  /* Too big to be worth buffering. */
+	  len = file_read_fully (self, dst + done, size - done);
+	  if (len < 0)
+	    return -1;
+
+	  return done + len;
+	}
+
+      len = file_source_read (self, self->buf, self->buf_size);
+      self->buf_pos = 0;
+      self->buf_len = len > 0 ? len : 0;
+      if (len < 0)
+	return -1;
+
+      if (len == 0)
+	break;
+    }
+
+  return done;
+}
+
+/*
+  Read up to size bytes with at most one server request: whatever is
+  already buffered, or else a single read straight into dst.
+*/
+static ssize_t
+file_read_some (File *self, char *dst, size_t size)
+{
+  size_t avail;
+
+  if (self->buf == NULL)
+    return file_source_read (self, dst, size);
+
+  if (self->buf_dirty && file_flush_buffer (self) < 0)
+    return -1;
+
+  avail = self->buf_len - self->buf_pos;
+  if (avail == 0)
+    return file_source_read (self, dst, size);
+
+  if (avail > size)
+    avail = size;
+
+  memcpy (dst, self->buf + self->buf_pos, avail);
+  self->buf_pos += avail;
+  return avail;
+}
+
+static ssize_t
+file_write (File *self, const char *src, size_t size)
+{
+  if (file_take_write_error (self) < 0)
+    return -1;
+
+  if (self->buf == NULL)
+    return file_write_fully (self, src, size);
+
+  if (!self->buf_dirty && file_drop_buffer (self) < 0)
+    return -1;
+
+  if (self->buf_len + size > self->buf_size &&
+      file_flush_buffer (self) < 0)
+    return -1;
+
+  if (size >= self->buf_size)
+    return file_write_fully (self, src, size);
+
+  memcpy (self->buf + self->buf_len, src, size);
+  self->buf_len += size;
+  self->buf_dirty = true;
+  return size;
+}
+
+static off_t
+file_tell (File *self)
+{
+  off_t pos;
+
+  if (self->ra_active)
+    pos = self->ra_pos;
+  else if (self->wb_active)
+    pos = self->wb_pos;
+  else
+    pos = file_raw_lseek (self, 0, SEEK_CUR);
+
+  if (pos < 0)
+    return pos;
+
+  if (self->buf_dirty)
+    return pos + (self->buf_len - self->buf_pos);
+
+  return pos - (self->buf_len - self->buf_pos);
+}
+
+static off_t
+file_seek (File *self, off_t offset, int whence)
+{
+  if (file_drop_buffer (self) < 0)
+    return -1;
+
+  return file_raw_lseek (self, offset, whence);
+}
+
+/*
+  Called before each read.  Readahead starts when a read begins where
+  the previous one ended and stops when one does not.  Failing to
+  start it is not an error: reads just go to the server directly.
+*/
+static void
+file_readahead_check (File *self)
+{
+  off_t pos;
+
+  if (self->ra_blocks == 0)
+    return;
+
+  pos = file_tell (self);
+  if (pos < 0)
+    return;
+
+  if (pos != self->ra_expect)
+    {
+      file_readahead_stop (self);
+      return;
+    }
+
+  if (self->ra_active)
+    return;
+
+  if (self->ra == NULL)
+    {
+      self->ra = readahead_new (self, self->read_chunk_size,
+				self->ra_blocks);
+      if (self->ra == NULL)
+	return;
+    }
+
+  pos = file_raw_lseek (self, 0, SEEK_CUR);
+  if (pos < 0)
+    return;
+
+  self->ra_pos = pos;
+  self->ra_active = true;
+}
+
+/* Called after each read: remember where the next one should start. */
+static void
+file_readahead_update (File *self)
+{
+  off_t pos;
+
+  if (self->ra_blocks == 0)
+    return;
+
+  pos = file_tell (self);
+  if (pos >= 0)
+    self->ra_expect = pos;
+}
+
+/* Shut the readahead engine down, e.g. before closing. */
+static void
+file_readahead_free (File *self)
+{
+  file_readahead_stop (self);
+  readahead_free (self->ra);
+  self->ra = NULL;
+}
+
+/*
+  Send everything written so far: the buffer, then anything queued
+  for write-behind.  Reports any deferred write error.
+*/
+static int
+file_flush (File *self)
+{
+  if (file_flush_buffer (self) < 0)
+    return -1;
+
+  if (self->wb_active && writebehind_drain (self->wb) < 0)
+    return -1;
+
+  return file_take_write_error (self);
+}
+
+/* Shut the write-behind engine down, after sending what it holds. */
+static int
+file_writebehind_free (File *self)
+{
+  int ret = file_flush (self);
+  int err = errno;
+
+  if (file_writebehind_stop (self) < 0 && ret == 0)
+    {
+      ret = -1;
+      err = errno;
+    }
+
+  writebehind_free (self->wb);
+  self->wb = NULL;
+  if (file_take_write_error (self) < 0 && ret == 0)
+    {
+      ret = -1;
+      err = errno;
+    }
+
+  errno = err;
+  return ret;
+}
+
+/*
+  Prepare for positional I/O, which bypasses the buffer and both
+  engines: send anything written so far and, before a positional
+  write, discard whatever has been read ahead of the file position.
+*/
+static int
+file_positional_sync (File *self, bool writing)
+{
+  if (file_flush (self) < 0)
+    return -1;
+
+  if (!writing)
+    return 0;
+
+  if (file_drop_buffer (self) < 0)
+    return -1;
+
+  return file_readahead_stop (self);
+}
+
+/*
+  Streaming between the File and a local descriptor.  The descriptor
+  may be a non-blocking socket or pipe, in which case we wait for it
+  to become ready rather than fail with EAGAIN.
+*/
+static int
+fd_wait (int fd, short events)
+{
+  struct pollfd pfd = { fd, events, 0 };
+
+  while (poll (&pfd, 1, -1) < 0)
+    if (errno != EINTR)
+      return -1;
+
+  return 0;
+}
+
+static ssize_t
+fd_write_fully (int fd, const char *buf, size_t size)
+{
+  size_t done = 0;
+
+  while (done < size)
+    {
+      ssize_t len = write (fd, buf + done, size - done);
+      if (len < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+	      fd_wait (fd, POLLOUT) == 0)
+	    continue;
+
+	  return -1;
+	}
+
+      done += len;
+    }
+
+  return done;
+}
+
+static ssize_t
+fd_read (int fd, char *buf, size_t size)
+{
+  for (;;)
+    {
+      ssize_t len = read (fd, buf, size);
+      if (len >= 0)
+	return len;
+
+      if (errno == EINTR)
+	continue;
+
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+	  fd_wait (fd, POLLIN) == 0)
+	continue;
+
+      return -1;
+    }
+}
+
+/*
+  Copy up to limit bytes (or to end of file, if limit is negative)
+  from the File to fd, or from fd to the File.  *local is set if the
+  error concerns fd.
+*/
+static off_t
+file_copy_fd (File *self, int fd, off_t limit, bool to_fd, bool *local)
+{
+  size_t bufsize = self->read_chunk_size;
+  off_t total = 0;
+  char *buf;
+  int err = 0;
+
+  *local = false;
+  buf = malloc (bufsize);
+  if (buf == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  while (limit < 0 || total < limit)
+    {
+      size_t want = bufsize;
+      ssize_t len;
+
+      if (limit >= 0 && (off_t) want > limit - total)
+	want = limit - total;
+
+      if (to_fd)
+	{
+	  file_readahead_check (self);
+	  len = file_read_some (self, buf, want);
+	  err = errno;
+	  file_readahead_update (self);
+	  if (len > 0 && fd_write_fully (fd, buf, len) < 0)
+	    *local = true;
+	  else
+	    errno = err;
+	}
+      else
+	{
+	  len = fd_read (fd, buf, want);
+	  if (len < 0)
+	    *local = true;
+	  else if (len > 0 && file_write (self, buf, len) < 0)
+	    len = -1;
+	}
+
+      if (len < 0 || *local)
+	{
+	  free (buf);
+	  return -1;
+	}
+
+      if (len == 0)
+	break;
+
+      total += len;
+    }
+
+  free (buf);
+  return total;
+}
+
+/*
+  Read one line (up to limit bytes if limit is non-zero) into a newly
+  malloc()ed buffer.  An unbuffered File borrows a temporary buffer
+  and gives back anything it over-read before returning.  So as not to
+  fetch far more than a short line, it starts small and doubles, up to
+  FILE_DEFAULT_BUFFER_SIZE, each time it runs out without a newline.
+*/
+#define FILE_READLINE_PROBE 2048
+
+static ssize_t
+file_readline (File *self, char **linep, size_t limit)
+{
+  char *line = NULL;
+  size_t alloc = 0;
+  size_t done = 0;
+  bool borrowed = false;
+  bool found = false;
+  int saved_errno;
+  ssize_t ret = -1;
+
+  if (self->buf == NULL)
+    {
+      self->buf = malloc (FILE_READLINE_PROBE);
+      if (self->buf == NULL)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+
+      self->buf_size = FILE_READLINE_PROBE;
+      self->buf_pos = self->buf_len = 0;
+      borrowed = true;
+    }
+
+  if (self->buf_dirty && file_flush_buffer (self) < 0)
+    goto out;
+
+  while (!found && (limit == 0 || done < limit))
+    {
+      size_t avail = self->buf_len - self->buf_pos;
+      size_t take;
+      char *nl;
+
+      if (avail == 0)
+	{
+	  ssize_t len;
+
+	  if (borrowed && done > 0 &&
+	      self->buf_size < FILE_DEFAULT_BUFFER_SIZE)
+	    {
+	      char *grown = realloc (self->buf, 2 * self->buf_size);
+	      if (grown)
+		{
+		  self->buf = grown;
+		  self->buf_size *= 2;
+		}
+	    }
+
+	  len = file_source_read (self, self->buf, self->buf_size);
+	  self->buf_pos = 0;
+	  self->buf_len = len > 0 ? len : 0;
+	  if (len < 0)
+	    goto out;
+
+	  if (len == 0)
+	    break;
+
+	  continue;
+	}
+
+      take = avail;
+      if (limit && take > limit - done)
+	take = limit - done;
+
+      nl = memchr (self->buf + self->buf_pos, '\n', take);
+      if (nl)
+	{
+	  take = nl - (self->buf + self->buf_pos) + 1;
+	  found = true;
+	}
+
+      if (done + take > alloc)
+	{
+	  size_t want = alloc ? alloc * 2 : 128;
+	  char *grown;
+	  while (want < done + take)
+	    want *= 2;
+
+	  grown = realloc (line, want);
+	  if (grown == NULL)
+	    {
+	      errno = ENOMEM;
+	      goto out;
+	    }
+
+	  line = grown;
+	  alloc = want;
+	}
+
+      memcpy (line + done, self->buf + self->buf_pos, take);
+      self->buf_pos += take;
+      done += take;
+    }
+
+  *linep = line;
+  line = NULL;
+  ret = done;
+
+ out:
+  saved_errno = errno;
+  free (line);
+  if (borrowed)
+    {
+      if (file_drop_buffer (self) < 0 && ret >= 0)
+	{
+	  free (*linep);
+	  ret = -1;
+	  saved_errno = errno;
+	}
+
+      free (self->buf);
+      self->buf = NULL;
+      self->buf_size = 0;
+    }
+
+  errno = saved_errno;
+  return ret;
+}
+
 static PyObject *
 File_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
   File *self;
   self = (File *) type->tp_alloc (type, 0);
-  if (self != NULL)
-    self->file = NULL;
+  if (self == NULL)
+    return NULL;
+
+  self->file = NULL;
+  self->read_chunk_size = FILE_DEFAULT_READ_CHUNK_SIZE;
+  self->max_read_size = 0;
+  self->buf = NULL;
+  self->buf_size = 0;
+  self->buf_pos = self->buf_len = 0;
+  self->buf_dirty = false;
+  self->ra = NULL;
+  self->ra_blocks = 0;
+  self->ra_active = false;
+  self->ra_pos = 0;
+  self->ra_expect = 0;
+  self->write_chunk_size = FILE_DEFAULT_WRITE_CHUNK_SIZE;
+  self->wb = NULL;
+  self->wb_blocks = 0;
+  self->wb_active = false;
+  self->wb_pos = 0;
+  self->wb_err = 0;
+  self->lock = PyThread_allocate_lock ();
+  if (self->lock == NULL)
+    {
+      Py_DECREF (self);
+      return PyErr_NoMemory ();
+    }
 
   return (PyObject *) self;
 }
@@ -96,10 +1043,13 @@ File_init (File *self, PyObject *args, PyObject *kwds)
   if (uri)
     {
       fn = smbc_getFunctionOpen (ctx->context);
+      CONTEXT_BEGIN_CALL (ctx);
       file = (*fn) (ctx->context, uri, (int) flags, (mode_t) mode);
+      CONTEXT_END_CALL (ctx);
       if (file == NULL)
 	{
 	  pysmbc_SetFromErrno();
+	  self->context = NULL;
           Py_DECREF (ctxobj);
 	  return -1;
 	}
@@ -121,9 +1071,19 @@ File_dealloc (File *self)
     {
       debugprintf ("%p close()\n", self->file);
       fn = smbc_getFunctionClose (ctx->context);
+      Py_BEGIN_ALLOW_THREADS
+      file_readahead_free (self);
+      file_writebehind_free (self);
+      PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
       (*fn) (ctx->context, self->file);
+      PyThread_release_lock (ctx->lock);
+      Py_END_ALLOW_THREADS
     }
 
+  free (self->buf);
+  if (self->lock)
+    PyThread_free_lock (self->lock);
+
   if (self->context)
     Py_DECREF ((PyObject *) self->context);
 
@@ -135,91 +1095,597 @@ File_read (File *self, PyObject *args)
 {
   Context *ctx = self->context;
   size_t size = 0;
-  smbc_read_fn fn;
-  char *buf;
   ssize_t len;
   PyObject *ret;
   smbc_fstat_fn fn_fstat;
   struct stat st;
-  smbc_lseek_fn fn_lseek;
-  int current = 0;
+  off_t current = 0;
+  int err = 0;
 
   if (!PyArg_ParseTuple (args, "|k", &size))
 	return NULL;
 
-  fn = smbc_getFunctionRead (ctx->context);
-
   if (size == 0)
     {
+      /* Read the rest of the file: size the result up front. */
       fn_fstat = smbc_getFunctionFstat (ctx->context);
-      (*fn_fstat) (ctx->context, self->file, &st);
-      fn_lseek = smbc_getFunctionLseek (ctx->context);
-      current = (*fn_lseek) (ctx->context, self->file, 0, 1);
-      size = st.st_size-current;
+      Py_BEGIN_ALLOW_THREADS
+      FILE_LOCK (self);
+      err = file_flush (self);
+      if (err == 0)
+	{
+	  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+	  errno = 0;
+	  err = (*fn_fstat) (ctx->context, self->file, &st);
+	  PyThread_release_lock (ctx->lock);
+	}
+
+      if (err == 0)
+	{
+	  current = file_tell (self);
+	  if (current < 0)
+	    err = -1;
+	}
+      FILE_UNLOCK (self);
+      Py_END_ALLOW_THREADS
+      if (err < 0)
+	{
+	  pysmbc_SetFromErrno ();
+	  return NULL;
+	}
+
+      size = st.st_size > current ? st.st_size - current : 0;
+    }
+
+  if (self->max_read_size && size > self->max_read_size)
+    {
+      PyErr_Format (PyExc_MemoryError,
+		    "read of %zu bytes exceeds maxReadSize (%zu)",
+		    size, self->max_read_size);
+      return NULL;
+    }
+
+  if (size > PY_SSIZE_T_MAX)
+    {
+      PyErr_SetString (PyExc_OverflowError, "read size too large");
+      return NULL;
     }
 
-  buf = (char *)malloc (size);
-  if (!buf)
-    return PyErr_NoMemory ();
+  /* Read straight into the result object; no intermediate copy. */
+  ret = PyBytes_FromStringAndSize (NULL, size);
+  if (ret == NULL)
+    return NULL;
 
-  len = (*fn) (ctx->context, self->file, buf, size);
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  file_readahead_check (self);
+  len = file_read (self, PyBytes_AS_STRING (ret), size);
+  err = errno;
+  file_readahead_update (self);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
   if (len < 0)
     {
+      Py_DECREF (ret);
+      errno = err;
       pysmbc_SetFromErrno ();
-      free (buf);
       return NULL;
     }
 
-  ret = PyBytes_FromStringAndSize (buf, len);
-  free (buf);
+  if ((size_t) len != size && _PyBytes_Resize (&ret, len) < 0)
+    return NULL;
+
   return ret;
 }
 
 static PyObject *
 File_readinto (File *self, PyObject *args)
 {
-  Context *ctx = self->context;
-  smbc_read_fn fn;
   Py_buffer buf;
   ssize_t len;
+  int err;
+
+  if (!PyArg_ParseTuple (args, "w*", &buf))
+       return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  file_readahead_check (self);
+  len = file_read (self, buf.buf, buf.len);
+  err = errno;
+  file_readahead_update (self);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&buf);
+  if (len < 0)
+    {
+      errno = err;
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  return PyLong_FromLong (len);
+}
+
+static PyObject *
+File_readline (File *self, PyObject *args)
+{
+  Py_ssize_t size = -1;
+  char *line = NULL;
+  ssize_t len;
+  PyObject *ret;
+  int err;
+
+  if (!PyArg_ParseTuple (args, "|n", &size))
+    return NULL;
+
+  if (size == 0)
+    return PyBytes_FromStringAndSize ("", 0);
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  file_readahead_check (self);
+  len = file_readline (self, &line, size < 0 ? 0 : size);
+  err = errno;
+  file_readahead_update (self);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (len < 0)
+    {
+      errno = err;
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  ret = PyBytes_FromStringAndSize (line, len);
+  free (line);
+  return ret;
+}
+
+static PyObject *
+File_write (File *self, PyObject *args)
+{
+  Py_buffer buf;
+  ssize_t len;
+
+  if (!PyArg_ParseTuple (args, "s*", &buf))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  len = file_write (self, buf.buf, buf.len);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&buf);
+  if (len < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  return PyLong_FromLong (len);
+}
+
+static PyObject *
+File_pread (File *self, PyObject *args)
+{
+  off_t_long py_offset;
+  off_t offset;
+  Py_ssize_t size;
+  PyObject *ret;
+  ssize_t len;
+
+  if (!PyArg_ParseTuple (args, (OFF_T_FORMAT "n"), &py_offset, &size))
+    return NULL;
+
+  offset = py_offset;
+  if ((off_t_long)offset != py_offset)
+    {
+      PyErr_SetString (PyExc_OverflowError, "Data loss in casting off_t");
+      return NULL;
+    }
+
+  if (size < 0 || offset < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "negative offset or size");
+      return NULL;
+    }
+
+  if (self->max_read_size && (size_t) size > self->max_read_size)
+    {
+      PyErr_Format (PyExc_MemoryError,
+		    "read of %zd bytes exceeds maxReadSize (%zu)",
+		    size, self->max_read_size);
+      return NULL;
+    }
+
+  ret = PyBytes_FromStringAndSize (NULL, size);
+  if (ret == NULL)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  len = file_positional_sync (self, false);
+  if (len == 0 && size > 0)
+    len = file_pread (self, PyBytes_AS_STRING (ret), size, offset);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (len < 0)
+    {
+      Py_DECREF (ret);
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  if (len < size)
+    _PyBytes_Resize (&ret, len);
+
+  return ret;
+}
+
+static PyObject *
+File_pwrite (File *self, PyObject *args)
+{
+  off_t_long py_offset;
+  off_t offset;
+  Py_buffer buf;
+  ssize_t len;
+
+  if (!PyArg_ParseTuple (args, (OFF_T_FORMAT "s*"), &py_offset, &buf))
+    return NULL;
+
+  offset = py_offset;
+  if ((off_t_long)offset != py_offset)
+    {
+      PyBuffer_Release (&buf);
+      PyErr_SetString (PyExc_OverflowError, "Data loss in casting off_t");
+      return NULL;
+    }
+
+  if (offset < 0)
+    {
+      PyBuffer_Release (&buf);
+      PyErr_SetString (PyExc_ValueError, "negative offset");
+      return NULL;
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  len = file_positional_sync (self, true);
+  if (len == 0 && buf.len > 0)
+    len = file_pwrite (self, buf.buf, buf.len, offset);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release (&buf);
+  if (len < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  return PyLong_FromSsize_t (len);
+}
+
+/* One (offset, buffer) pair of a readv() or writev() call. */
+struct file_iov
+{
+  off_t offset;
+  Py_buffer buf;
+  ssize_t len;
+};
+
+static void
+file_iov_free (struct file_iov *iov, Py_ssize_t n)
+{
+  Py_ssize_t i;
+
+  for (i = 0; i < n; i++)
+    PyBuffer_Release (&iov[i].buf);
+
+  PyMem_Free (iov);
+}
+
+/*
+  Convert a sequence of (offset, buffer) pairs, parsing each buffer
+  with the given format ("w*" or "s*").
+*/
+static struct file_iov *
+file_iov_parse (PyObject *pairs, const char *format, Py_ssize_t *np)
+{
+  struct file_iov *iov;
+  PyObject *seq;
+  Py_ssize_t i, n;
+  char fmt[8];
+
+  seq = PySequence_Fast (pairs, "expected a sequence of (offset, buffer)");
+  if (seq == NULL)
+    return NULL;
+
+  n = PySequence_Fast_GET_SIZE (seq);
+  iov = PyMem_New (struct file_iov, n ? n : 1);
+  if (iov == NULL)
+    {
+      Py_DECREF (seq);
+      PyErr_NoMemory ();
+      return NULL;
+    }
+
+  snprintf (fmt, sizeof (fmt), "%s%s", OFF_T_FORMAT, format);
+  for (i = 0; i < n; i++)
+    {
+      PyObject *item = PySequence_Fast_GET_ITEM (seq, i);
+      off_t_long py_offset;
+
+      if (!PyTuple_Check (item))
+	{
+	  PyErr_SetString (PyExc_TypeError,
+			   "expected a sequence of (offset, buffer)");
+	  break;
+	}
+
+      if (!PyArg_ParseTuple (item, fmt, &py_offset, &iov[i].buf))
+	break;
+
+      iov[i].offset = py_offset;
+      iov[i].len = 0;
+      if ((off_t_long) iov[i].offset != py_offset)
+	{
+	  PyBuffer_Release (&iov[i].buf);
+	  PyErr_SetString (PyExc_OverflowError, "Data loss in casting off_t");
+	  break;
+	}
+
+      if (py_offset < 0)
+	{
+	  PyBuffer_Release (&iov[i].buf);
+	  PyErr_SetString (PyExc_ValueError, "negative offset");
+	  break;
+	}
+    }
+
+  Py_DECREF (seq);
+  if (i < n)
+    {
+      file_iov_free (iov, i);
+      return NULL;
+    }
+
+  *np = n;
+  return iov;
+}
+
+/* Perform each transfer in turn, without the GIL. */
+static int
+file_iov_run (File *self, struct file_iov *iov, Py_ssize_t n, bool writing)
+{
+  Py_ssize_t i;
+  int ret;
+
+  FILE_LOCK (self);
+  ret = file_positional_sync (self, writing);
+  for (i = 0; ret == 0 && i < n; i++)
+    {
+      if (iov[i].buf.len == 0)
+	continue;
+
+      if (writing)
+	iov[i].len = file_pwrite (self, iov[i].buf.buf, iov[i].buf.len,
+				  iov[i].offset);
+      else
+	iov[i].len = file_pread (self, iov[i].buf.buf, iov[i].buf.len,
+				 iov[i].offset);
+
+      if (iov[i].len < 0)
+	ret = -1;
+    }
+
+  FILE_UNLOCK (self);
+  return ret;
+}
+
+static PyObject *
+file_iov_call (File *self, PyObject *args, const char *format, bool writing)
+{
+  struct file_iov *iov;
+  PyObject *pairs;
+  PyObject *ret;
+  Py_ssize_t i, n;
+  int err;
+
+  if (!PyArg_ParseTuple (args, "O", &pairs))
+    return NULL;
+
+  iov = file_iov_parse (pairs, format, &n);
+  if (iov == NULL)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  err = file_iov_run (self, iov, n, writing);
+  Py_END_ALLOW_THREADS
+  if (err < 0)
+    {
+      file_iov_free (iov, n);
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  ret = PyList_New (n);
+  for (i = 0; ret && i < n; i++)
+    {
+      PyObject *len = PyLong_FromSsize_t (iov[i].len);
+      if (len == NULL)
+	Py_CLEAR (ret);
+      else
+	PyList_SET_ITEM (ret, i, len);
+    }
+
+  file_iov_free (iov, n);
+  return ret;
+}
+
+static PyObject *
+File_readv (File *self, PyObject *args)
+{
+  return file_iov_call (self, args, "w*", false);
+}
+
+static PyObject *
+File_writev (File *self, PyObject *args)
+{
+  return file_iov_call (self, args, "s*", true);
+}
+
+/* copy_to and copy_from. */
+static PyObject *
+file_copy_call (File *self, PyObject *args, bool to_fd)
+{
+  PyObject *target;
+  off_t_long py_size = -1;
+  off_t total;
+  bool local;
+  int fd;
+
+  if (!PyArg_ParseTuple (args, ("O|" OFF_T_FORMAT), &target, &py_size))
+    return NULL;
+
+  fd = PyObject_AsFileDescriptor (target);
+  if (fd < 0)
+    return NULL;
+
+  /* Data a Python file object has buffered must go out first. */
+  if (to_fd && PyObject_HasAttrString (target, "flush"))
+    {
+      PyObject *ret = PyObject_CallMethod (target, "flush", NULL);
+      if (ret == NULL)
+	return NULL;
+
+      Py_DECREF (ret);
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  total = file_copy_fd (self, fd, py_size, to_fd, &local);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (total < 0)
+    {
+      if (local)
+	PyErr_SetFromErrno (PyExc_OSError);
+      else
+	pysmbc_SetFromErrno ();
+
+      return NULL;
+    }
+
+  return Py_BuildValue (OFF_T_FORMAT, (off_t_long) total);
+}
+
+static PyObject *
+File_copy_to (File *self, PyObject *args)
+{
+  return file_copy_call (self, args, true);
+}
+
+static PyObject *
+File_copy_from (File *self, PyObject *args)
+{
+  return file_copy_call (self, args, false);
+}
+
+static PyObject *
+File_digest (File *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *algo = NULL;
+  Py_ssize_t chunk = 0;
+  PyObject *hash;
+  readahead *ra;
+  off_t offset = 0;
+  PyObject *buf;
+  ssize_t len;
+  static char *kwlist[] =
+    {
+      "algo",
+      "chunk",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|On", kwlist,
+				    &algo, &chunk))
+    return NULL;
+
+  if (chunk < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "chunk must not be negative");
+      return NULL;
+    }
 
-  if (!PyArg_ParseTuple (args, "|s*", &buf))
-       return NULL;
+  if (chunk == 0)
+    chunk = self->read_chunk_size;
 
-  fn = smbc_getFunctionRead (ctx->context);
+  if (algo)
+    hash = digest_make (algo);
+  else
+    {
+      algo = PyUnicode_FromString (DIGEST_DEFAULT_ALGO);
+      if (algo == NULL)
+	return NULL;
 
-  len = (*fn) (ctx->context, self->file, buf.buf, buf.len);
-  PyBuffer_Release(&buf);
-  if (len < 0)
+      hash = digest_make (algo);
+      Py_DECREF (algo);
+    }
+
+  if (hash == NULL)
+    return NULL;
+
+  buf = digest_buffer (chunk);
+  if (buf == NULL)
     {
-      pysmbc_SetFromErrno ();
+      Py_DECREF (hash);
       return NULL;
     }
 
-  return PyLong_FromLong (len);
-}
+  /* A private readahead engine fetches the next chunk while this one
+     is hashed.  It reads by offset, so the file position is left
+     alone. */
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  len = file_positional_sync (self, false);
+  FILE_UNLOCK (self);
+  ra = len < 0 ? NULL : readahead_new (self, chunk, 2);
+  Py_END_ALLOW_THREADS
 
-static PyObject *
-File_write (File *self, PyObject *args)
-{
-  Context *ctx = self->context;
-  smbc_write_fn fn;
-  Py_buffer buf;
-  ssize_t len;
+  while (len >= 0)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      if (ra)
+	len = readahead_read (ra, offset, PyByteArray_AS_STRING (buf),
+			      chunk);
+      else
+	len = file_pread (self, PyByteArray_AS_STRING (buf), chunk, offset);
+      Py_END_ALLOW_THREADS
+      if (len <= 0)
+	break;
 
-  if (!PyArg_ParseTuple (args, "s*", &buf))
-    return NULL;
+      if (digest_update (hash, buf, len) < 0)
+	break;
 
-  fn = smbc_getFunctionWrite (ctx->context);
-  len = (*fn) (ctx->context, self->file, buf.buf, buf.len);
-  PyBuffer_Release(&buf);
-  if (len < 0)
+      offset += len;
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  readahead_free (ra);
+  Py_END_ALLOW_THREADS
+  Py_DECREF (buf);
+  if (len != 0 || PyErr_Occurred ())
     {
-      pysmbc_SetFromErrno ();
+      if (!PyErr_Occurred ())
+	pysmbc_SetFromErrno ();
+
+      Py_DECREF (hash);
       return NULL;
     }
 
-  return PyLong_FromLong (len);
+  return hash;
 }
 
 static PyObject *
@@ -231,25 +1697,25 @@ File_fstat (File *self, PyObject *args)
   int ret;
 
   fn = smbc_getFunctionFstat (ctx->context);
-  errno = 0;
-  ret = (*fn) (ctx->context, self->file, &st);
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_flush (self);
+  if (ret == 0)
+    {
+      PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+      errno = 0;
+      ret = (*fn) (ctx->context, self->file, &st);
+      PyThread_release_lock (ctx->lock);
+    }
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
-  return Py_BuildValue ("(IKKKIIKIII)",
-			st.st_mode,
-			(unsigned long long)st.st_ino,
-			(unsigned long long)st.st_dev,
-			(unsigned long long)st.st_nlink,
-			st.st_uid,
-			st.st_gid,
-			st.st_size,
-			st.st_atime,
-			st.st_mtime,
-			st.st_ctime);
+  return pysmbc_StatTuple (&st);
 }
 
 static PyObject *
@@ -257,15 +1723,37 @@ File_close (File *self, PyObject *args)
 {
   Context *ctx = self->context;
   smbc_close_fn fn;
+  int flushed = 0;
   int ret = 0;
+  int err = 0;
 
   fn = smbc_getFunctionClose (ctx->context);
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
   if (self->file)
     {
+      /* Everything written must reach the server before the handle
+	 goes away. */
+      file_readahead_free (self);
+      flushed = file_writebehind_free (self);
+      err = errno;
+      PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
       ret = (*fn) (ctx->context, self->file);
+      PyThread_release_lock (ctx->lock);
       self->file = NULL;
     }
 
+  self->buf_pos = self->buf_len = 0;
+  self->buf_dirty = false;
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (flushed < 0)
+    {
+      errno = err;
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
   return PyLong_FromLong (ret);
 }
 
@@ -280,18 +1768,39 @@ static PyObject *
 File_iternext (PyObject *self)
 {
   File *file = (File *) self;
-  Context *ctx = file->context;
-  smbc_read_fn fn;
-  char buf[2048];
+  size_t size = file->buf_size > 2048 ? file->buf_size : 2048;
+  PyObject *ret;
   ssize_t len;
-  fn = smbc_getFunctionRead (ctx->context);
-  len = (*fn) (ctx->context, file->file, buf, 2048);
+  int err;
+
+  ret = PyBytes_FromStringAndSize (NULL, size);
+  if (ret == NULL)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (file);
+  file_readahead_check (file);
+  len = file_read_some (file, PyBytes_AS_STRING (ret), size);
+  err = errno;
+  file_readahead_update (file);
+  FILE_UNLOCK (file);
+  Py_END_ALLOW_THREADS
   if (len > 0)
-    return PyBytes_FromStringAndSize (buf, len);
-  else if (len == 0)
+    {
+      if ((size_t) len != size && _PyBytes_Resize (&ret, len) < 0)
+	return NULL;
+
+      return ret;
+    }
+
+  Py_DECREF (ret);
+  if (len == 0)
     PyErr_SetNone (PyExc_StopIteration);
   else
-    pysmbc_SetFromErrno ();
+    {
+      errno = err;
+      pysmbc_SetFromErrno ();
+    }
 
   return NULL;
 }
@@ -299,8 +1808,6 @@ File_iternext (PyObject *self)
 static PyObject *
 File_lseek (File *self, PyObject *args)
 {
-  Context *ctx = self->context;
-  smbc_lseek_fn fn;
   off_t_long py_offset;
   off_t offset;
   int whence=0;
@@ -313,30 +1820,61 @@ File_lseek (File *self, PyObject *args)
 
   /* check for data loss from cast */
   if ((off_t_long)offset != py_offset)
-    PyErr_SetString (PyExc_OverflowError, "Data loss in casting off_t");
+    {
+      PyErr_SetString (PyExc_OverflowError, "Data loss in casting off_t");
+      return NULL;
+    }
 
-  fn = smbc_getFunctionLseek (ctx->context);
-  ret = (*fn) (ctx->context, self->file, offset, whence);
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_seek (self, offset, whence);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
   if (ret < 0)
     {
       pysmbc_SetFromErrno ();
       return NULL;
     }
 
-  return Py_BuildValue (OFF_T_FORMAT, ret);
+  return Py_BuildValue (OFF_T_FORMAT, (off_t_long) ret);
 }
 
 static PyObject *
-File_flush (PyObject *self)
+File_flush (File *self)
 {
-  return NULL;
+  int ret;
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_flush (self);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
 }
 
 static PyObject *
 File_tell (File *self)
 {
-  PyObject *args = Py_BuildValue (OFF_T_FORMAT "i",  0, 1);
-  return File_lseek (self, args);
+  off_t ret;
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_tell (self);
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  return Py_BuildValue (OFF_T_FORMAT, (off_t_long) ret);
 }
 
 static PyObject *
@@ -345,12 +1883,333 @@ File_seekable (File *self)
   return Py_BuildValue("b", 1);
 }
 
+static PyObject *
+File_getReadChunkSize (File *self, void *closure)
+{
+  return PyLong_FromSize_t (self->read_chunk_size);
+}
+
+static int
+File_setReadChunkSize (File *self, PyObject *value, void *closure)
+{
+  size_t size;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  size = PyLong_AsSize_t (value);
+  if (size == (size_t) -1 && PyErr_Occurred ())
+    return -1;
+
+  if (size == 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "must be positive");
+      return -1;
+    }
+
+  /* The readahead engine's blocks are this size. */
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  file_readahead_free (self);
+  self->read_chunk_size = size;
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  return 0;
+}
+
+static PyObject *
+File_getMaxReadSize (File *self, void *closure)
+{
+  return PyLong_FromSize_t (self->max_read_size);
+}
+
+static int
+File_setMaxReadSize (File *self, PyObject *value, void *closure)
+{
+  size_t size;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  size = PyLong_AsSize_t (value);
+  if (size == (size_t) -1 && PyErr_Occurred ())
+    return -1;
+
+  self->max_read_size = size;
+  return 0;
+}
+
+static PyObject *
+File_getBufferSize (File *self, void *closure)
+{
+  return PyLong_FromSize_t (self->buf_size);
+}
+
+static int
+File_setBufferSize (File *self, PyObject *value, void *closure)
+{
+  size_t size;
+  char *buf = NULL;
+  int ret;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  size = PyLong_AsSize_t (value);
+  if (size == (size_t) -1 && PyErr_Occurred ())
+    return -1;
+
+  if (size)
+    {
+      buf = malloc (size);
+      if (buf == NULL)
+	{
+	  PyErr_NoMemory ();
+	  return -1;
+	}
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_drop_buffer (self);
+  if (ret == 0)
+    {
+      free (self->buf);
+      self->buf = buf;
+      self->buf_size = size;
+      buf = NULL;
+    }
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  free (buf);
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return -1;
+    }
+
+  return 0;
+}
+
+static PyObject *
+File_getReadaheadBlocks (File *self, void *closure)
+{
+  return PyLong_FromUnsignedLong (self->ra_blocks);
+}
+
+static int
+File_setReadaheadBlocks (File *self, PyObject *value, void *closure)
+{
+  long blocks;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  blocks = PyLong_AsLong (value);
+  if (blocks == -1 && PyErr_Occurred ())
+    return -1;
+
+  if (blocks < 0 || blocks > 1024)
+    {
+      PyErr_SetString (PyExc_ValueError, "must be between 0 and 1024");
+      return -1;
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  file_readahead_free (self);
+  self->ra_blocks = blocks;
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  return 0;
+}
+
+static PyObject *
+File_getWriteChunkSize (File *self, void *closure)
+{
+  return PyLong_FromSize_t (self->write_chunk_size);
+}
+
+static int
+File_setWriteChunkSize (File *self, PyObject *value, void *closure)
+{
+  size_t size;
+  int ret;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  size = PyLong_AsSize_t (value);
+  if (size == (size_t) -1 && PyErr_Occurred ())
+    return -1;
+
+  if (size == 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "must be positive");
+      return -1;
+    }
+
+  /* The write-behind engine's blocks are this size. */
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_writebehind_free (self);
+  self->write_chunk_size = size;
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return -1;
+    }
+
+  return 0;
+}
+
+static PyObject *
+File_getWriteBehindBlocks (File *self, void *closure)
+{
+  return PyLong_FromUnsignedLong (self->wb_blocks);
+}
+
+static int
+File_setWriteBehindBlocks (File *self, PyObject *value, void *closure)
+{
+  long blocks;
+  int ret;
+
+#if PY_MAJOR_VERSION < 3
+  if (PyInt_Check (value))
+    value = PyLong_FromLong (PyInt_AsLong (value));
+#endif
+
+  if (!PyLong_Check (value))
+    {
+      PyErr_SetString (PyExc_TypeError, "must be long");
+      return -1;
+    }
+
+  blocks = PyLong_AsLong (value);
+  if (blocks == -1 && PyErr_Occurred ())
+    return -1;
+
+  if (blocks < 0 || blocks > 1024)
+    {
+      PyErr_SetString (PyExc_ValueError, "must be between 0 and 1024");
+      return -1;
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  FILE_LOCK (self);
+  ret = file_writebehind_free (self);
+  self->wb_blocks = blocks;
+  FILE_UNLOCK (self);
+  Py_END_ALLOW_THREADS
+  if (ret < 0)
+    {
+      pysmbc_SetFromErrno ();
+      return -1;
+    }
+
+  return 0;
+}
+
+PyGetSetDef File_getseters[] =
+  {
+    { "bufferSize",
+      (getter) File_getBufferSize,
+      (setter) File_setBufferSize,
+      "Size in bytes of the I/O buffer.  When non-zero, small reads,\n"
+      "readline() and small writes are served from the buffer and\n"
+      "flush() sends buffered writes.  0 (the default) means unbuffered.",
+      NULL },
+
+    { "readChunkSize",
+      (getter) File_getReadChunkSize,
+      (setter) File_setReadChunkSize,
+      "Largest single read request sent to the server, in bytes.",
+      NULL },
+
+    { "maxReadSize",
+      (getter) File_getMaxReadSize,
+      (setter) File_setMaxReadSize,
+      "Largest read() result that will be allocated; larger reads raise\n"
+      "MemoryError.  0 (the default) means no limit.",
+      NULL },
+
+    { "readaheadBlocks",
+      (getter) File_getReadaheadBlocks,
+      (setter) File_setReadaheadBlocks,
+      "Maximum number of readChunkSize blocks to prefetch in the\n"
+      "background once reads are seen to be sequential.  The window\n"
+      "starts small and grows while the reader is kept waiting.\n"
+      "0 (the default) disables readahead.",
+      NULL },
+
+    { "writeChunkSize",
+      (getter) File_getWriteChunkSize,
+      (setter) File_setWriteChunkSize,
+      "Largest single write request sent to the server, in bytes.",
+      NULL },
+
+    { "writeBehindBlocks",
+      (getter) File_getWriteBehindBlocks,
+      (setter) File_setWriteBehindBlocks,
+      "Maximum number of writeChunkSize blocks queued for a background\n"
+      "thread to send.  When non-zero, write() returns once the data is\n"
+      "queued, adjacent writes are merged into aligned blocks, and an\n"
+      "error is raised by the next write(), flush() or close().\n"
+      "0 (the default) disables write-behind.",
+      NULL },
+
+    { NULL }
+  };
+
 PyMethodDef File_methods[] =
   {
 	{"read", (PyCFunction)File_read, METH_VARARGS,
 	 "read(size) -> string\n\n"
 	 "@type size: int\n"
-	 "@param size: size of reading\n"
+	 "@param size: size of reading, or 0 to read to end of file\n"
 	 "@return: read data"
 	},
 	{"readinto", (PyCFunction)File_readinto, METH_VARARGS,
@@ -359,12 +2218,85 @@ PyMethodDef File_methods[] =
 	 "@param b: buffer to fill\n"
 	 "@return: number of bytes read"
 	},
+	{"readline", (PyCFunction)File_readline, METH_VARARGS,
+	 "readline(size=-1) -> string\n\n"
+	 "@type size: int\n"
+	 "@param size: maximum number of bytes to read, or -1 for no limit\n"
+	 "@return: data up to and including the next newline"
+	},
 	{"write", (PyCFunction)File_write, METH_VARARGS,
 	 "write(buf) -> int\n\n"
 	 "@type buf: string\n"
 	 "@param buf: write data\n"
 	 "@return: size of written"
 	 },
+	{"pread", (PyCFunction)File_pread, METH_VARARGS,
+	 "pread(offset, size) -> string\n\n"
+	 "Read without using or moving the file position.\n\n"
+	 "@type offset: int\n"
+	 "@param offset: where to read from\n"
+	 "@type size: int\n"
+	 "@param size: maximum number of bytes to read\n"
+	 "@return: read data"
+	},
+	{"pwrite", (PyCFunction)File_pwrite, METH_VARARGS,
+	 "pwrite(offset, buf) -> int\n\n"
+	 "Write without using or moving the file position.\n\n"
+	 "@type offset: int\n"
+	 "@param offset: where to write to\n"
+	 "@type buf: string\n"
+	 "@param buf: write data\n"
+	 "@return: size of written"
+	},
+	{"readv", (PyCFunction)File_readv, METH_VARARGS,
+	 "readv(pairs) -> list\n\n"
+	 "Fill several buffers with positional reads in a single call.\n\n"
+	 "@type pairs: sequence of (int, writable bytes-like object)\n"
+	 "@param pairs: (offset, buffer) for each read\n"
+	 "@return: number of bytes read into each buffer"
+	},
+	{"writev", (PyCFunction)File_writev, METH_VARARGS,
+	 "writev(pairs) -> list\n\n"
+	 "Send several buffers with positional writes in a single call.\n\n"
+	 "@type pairs: sequence of (int, bytes-like object)\n"
+	 "@param pairs: (offset, data) for each write\n"
+	 "@return: number of bytes written from each buffer"
+	},
+	{"copy_to", (PyCFunction)File_copy_to, METH_VARARGS,
+	 "copy_to(fd, size=-1) -> int\n\n"
+	 "Read from the file position and write the data to a local file\n"
+	 "descriptor, without the GIL and without creating Python objects\n"
+	 "for the data.\n\n"
+	 "@type fd: int or object with a fileno() method\n"
+	 "@param fd: where to write the data (file, pipe or socket)\n"
+	 "@type size: int\n"
+	 "@param size: maximum number of bytes to copy, or -1 for all\n"
+	 "@return: number of bytes copied"
+	},
+	{"copy_from", (PyCFunction)File_copy_from, METH_VARARGS,
+	 "copy_from(fd, size=-1) -> int\n\n"
+	 "Read from a local file descriptor until end of file and write\n"
+	 "the data at the file position, without the GIL and without\n"
+	 "creating Python objects for the data.  Reading starts at fd's\n"
+	 "own offset, ignoring anything a Python file object has\n"
+	 "buffered.\n\n"
+	 "@type fd: int or object with a fileno() method\n"
+	 "@param fd: where to read the data from (file, pipe or socket)\n"
+	 "@type size: int\n"
+	 "@param size: maximum number of bytes to copy, or -1 for all\n"
+	 "@return: number of bytes copied"
+	},
+	{"digest", (PyCFunction)File_digest, METH_VARARGS | METH_KEYWORDS,
+	 "digest(algo='sha256', chunk=0) -> hash object\n\n"
+	 "Hash the whole file, reading it without the GIL and without\n"
+	 "moving the file position.\n\n"
+	 "@type algo: string or callable\n"
+	 "@param algo: hashlib algorithm name, or a callable returning a\n"
+	 "new hash object\n"
+	 "@type chunk: int\n"
+	 "@param chunk: read size, or 0 for readChunkSize\n"
+	 "@return: the hashlib object, fed with the file's contents"
+	},
 	{"fstat", (PyCFunction)File_fstat, METH_NOARGS,
 	 "fstat() -> tuple\n\n"
 	 "@return: fstat information"
@@ -383,7 +2315,7 @@ PyMethodDef File_methods[] =
 	},
 	{"flush", (PyCFunction)File_flush, METH_NOARGS,
 	 "flush()\n\n"
-	 "@return: NOP function"
+	 "Send any buffered writes to the server."
 	},
 	{"tell", (PyCFunction)File_tell, METH_NOARGS,
 	 "tell() -> int\n\n"
@@ -432,7 +2364,7 @@ PyMethodDef File_methods[] =
       File_iternext,             /* tp_iternext */
       File_methods,              /* tp_methods */
       0,                         /* tp_members */
-      0,                         /* tp_getset */
+      File_getseters,            /* tp_getset */
       0,                         /* tp_base */
       0,                         /* tp_dict */
       0,                         /* tp_descr_get */
@@ -479,7 +2411,7 @@ PyMethodDef File_methods[] =
       File_iternext,             /* tp_iternext */
       File_methods,              /* tp_methods */
       0,                         /* tp_members */
-      0,                         /* tp_getset */
+      File_getseters,            /* tp_getset */
       0,                         /* tp_base */
       0,                         /* tp_dict */
       0,                         /* tp_descr_get */
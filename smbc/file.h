@@ -29,9 +29,42 @@ typedef struct
   PyObject_HEAD
   Context *context;
   SMBCFILE *file;
+  PyThread_type_lock lock;	/* guards the buffer and file offset */
+  size_t read_chunk_size;	/* largest single smbc read() request */
+  size_t max_read_size;		/* refuse reads larger than this (0: no cap) */
+  size_t write_chunk_size;	/* largest single smbc write() request */
+
+  /* Optional I/O buffer; see "Buffering" in file.c. */
+  char *buf;
+  size_t buf_size;
+  size_t buf_pos;
+  size_t buf_len;
+  bool buf_dirty;
+
+  /* Sequential readahead; see readahead.c. */
+  struct readahead *ra;
+  unsigned ra_blocks;		/* maximum window (0: disabled) */
+  bool ra_active;		/* reads are being served by 'ra' */
+  off_t ra_pos;			/* stream offset while ra_active */
+  off_t ra_expect;		/* where a sequential read would start */
+
+  /* Write-behind; see writebehind.c. */
+  struct writebehind *wb;
+  unsigned wb_blocks;		/* maximum blocks in flight (0: disabled) */
+  bool wb_active;		/* writes are being queued on 'wb' */
+  off_t wb_pos;			/* stream offset while wb_active */
+  int wb_err;			/* deferred error from a drain */
 } File;
 
+#define FILE_DEFAULT_READ_CHUNK_SIZE (1024 * 1024)
+#define FILE_DEFAULT_WRITE_CHUNK_SIZE (1024 * 1024)
+#define FILE_DEFAULT_BUFFER_SIZE (64 * 1024)
+
 extern PyMethodDef File_methods[];
 extern PyTypeObject smbc_FileType;
 
+extern ssize_t file_pread (File *self, void *buf, size_t size, off_t offset);
+extern ssize_t file_pwrite (File *self, const void *buf, size_t size,
+			    off_t offset);
+
 #endif /* HAVE_FILE_H */
@@ -0,0 +1,191 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <pthread.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "pool.h"
+
+//////////
+// Pool //
+//////////
+
+struct pool_job
+{
+  pool_fn fn;
+  void *arg;
+};
+
+static void *
+pool_thread (void *data)
+{
+  struct pool_job *job = data;
+
+  (*job->fn) (job->arg);
+  return NULL;
+}
+
+void
+pool_run (unsigned nthreads, pool_fn fn, void *arg)
+{
+  struct pool_job job = { fn, arg };
+  pthread_t *threads = NULL;
+  unsigned started = 0;
+  unsigned i;
+
+  if (nthreads > 1)
+    threads = malloc ((nthreads - 1) * sizeof (*threads));
+
+  if (threads)
+    for (started = 0; started < nthreads - 1; started++)
+      if (pthread_create (&threads[started], NULL, pool_thread, &job) != 0)
+	break;
+
+  debugprintf ("pool_run(%u) started %u extra threads\n", nthreads, started);
+  (*fn) (arg);
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  free (threads);
+}
+
+/*
+  Set job up for the strings in uris.  On failure, raises an exception
+  and returns -1, leaving nothing to free.  GIL held.
+*/
+int
+pool_uris_init (struct pool_uris *job, Context *ctx, PyObject *uris)
+{
+  Py_ssize_t i;
+
+  memset (job, 0, sizeof (*job));
+  job->ctx = ctx;
+  job->list = PySequence_List (uris);
+  if (job->list == NULL)
+    return -1;
+
+  pthread_mutex_init (&job->mutex, NULL);
+  job->n = PyList_GET_SIZE (job->list);
+  job->uris = calloc (job->n + 1, sizeof (char *));
+  if (job->uris == NULL)
+    {
+      PyErr_NoMemory ();
+      pool_uris_free (job);
+      return -1;
+    }
+
+  for (i = 0; i < job->n; i++)
+    {
+      PyObject *item = PyList_GET_ITEM (job->list, i);
+      const char *uri = NULL;
+
+#if PY_MAJOR_VERSION >= 3
+      if (PyUnicode_Check (item))
+	uri = PyUnicode_AsUTF8 (item);
+#else
+      if (PyString_Check (item))
+	uri = PyString_AsString (item);
+#endif
+      if (uri == NULL)
+	{
+	  if (!PyErr_Occurred ())
+	    PyErr_SetString (PyExc_TypeError, "uris must be strings");
+	  pool_uris_free (job);
+	  return -1;
+	}
+
+      job->uris[i] = uri;
+    }
+
+  job->results = PyList_New (job->n);
+  if (job->results == NULL)
+    {
+      pool_uris_free (job);
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+  Run fn (arg) on up to 'workers' threads, no more than there are
+  URIs.  GIL held; it is released meanwhile.
+*/
+void
+pool_uris_run (struct pool_uris *job, unsigned workers, pool_fn fn,
+	       void *arg)
+{
+  if ((Py_ssize_t) workers > job->n)
+    workers = job->n;
+
+  Py_BEGIN_ALLOW_THREADS
+  if (workers > 0)
+    pool_run (workers, fn, arg);
+  Py_END_ALLOW_THREADS
+}
+
+/* Free everything but the results.  GIL held. */
+void
+pool_uris_free (struct pool_uris *job)
+{
+  pthread_mutex_destroy (&job->mutex);
+  free (job->uris);
+  Py_DECREF (job->list);
+}
+
+/*
+  A worker's own connection, or NULL with *err set.  Failures here are
+  not raised: the worker reports *err against each URI it takes.
+*/
+SMBCCTX *
+pool_uris_connect (struct pool_uris *job, int *err)
+{
+  SMBCCTX *c = context_clone (job->ctx);
+
+  *err = c ? 0 : errno ? errno : ENOMEM;
+  return c;
+}
+
+/*
+  Take the next URIs, up to max of them, for a worker.  Returns how
+  many, their first index in *start, and 0 once there are no more or
+  the job has been stopped.
+*/
+Py_ssize_t
+pool_uris_next (struct pool_uris *job, Py_ssize_t max, Py_ssize_t *start)
+{
+  Py_ssize_t count;
+
+  pthread_mutex_lock (&job->mutex);
+  *start = job->next;
+  count = job->err ? 0 : job->n - job->next;
+  if (count > max)
+    count = max;
+  job->next += count;
+  pthread_mutex_unlock (&job->mutex);
+  return count;
+}
+
+/* Stop the job because of err, unless something else already has. */
+void
+pool_uris_fail (struct pool_uris *job, int err)
+{
+  pthread_mutex_lock (&job->mutex);
+  if (job->err == 0)
+    job->err = err;
+  pthread_mutex_unlock (&job->mutex);
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef HAVE_POOL_H
+#define HAVE_POOL_H
+
+/*
+  Run fn (arg) on nthreads native threads at once, the calling thread
+  being one of them, and wait for all of them to return.  Must be
+  called without the GIL.  If threads cannot be created, fewer run;
+  the work handed out through arg must not depend on how many.
+*/
+typedef void (*pool_fn) (void *arg);
+
+extern void pool_run (unsigned nthreads, pool_fn fn, void *arg);
+
+/*
+  The shared part of a job run over a sequence of URIs, such as
+  Context.digest_many: embed it in the job and pass the job to
+  pool_uris_run.  Each worker connects with pool_uris_connect, takes
+  URIs with pool_uris_next and, with the GIL, stores one result per
+  URI in 'results'.
+*/
+struct pool_uris
+{
+  Context *ctx;
+  PyObject *list;
+  const char **uris;		/* UTF-8, owned by 'list' */
+  Py_ssize_t n;
+  PyObject *results;		/* list, filled in by the workers */
+  pthread_mutex_t mutex;
+  Py_ssize_t next;
+  int err;			/* the error that stopped the job */
+};
+
+extern int pool_uris_init (struct pool_uris *job, Context *ctx,
+			   PyObject *uris);
+extern void pool_uris_run (struct pool_uris *job, unsigned workers,
+			   pool_fn fn, void *arg);
+extern void pool_uris_free (struct pool_uris *job);
+extern SMBCCTX *pool_uris_connect (struct pool_uris *job, int *err);
+extern Py_ssize_t pool_uris_next (struct pool_uris *job, Py_ssize_t max,
+				  Py_ssize_t *start);
+extern void pool_uris_fail (struct pool_uris *job, int err);
+
+#endif /* HAVE_POOL_H */
@@ -0,0 +1,337 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "file.h"
+#include "readahead.h"
+
+///////////////
+// Readahead //
+///////////////
+
+/*
+  The window is a ring of up to max_blocks blocks, the first of which
+  starts at 'start'.  Only the prefetch thread schedules blocks, one
+  at a time and always at the end of the window, so at most the last
+  block is ever PENDING.  The reader consumes blocks from the front.
+
+  The window starts at two blocks and doubles, up to max_blocks, each
+  time the reader has to wait for data: that means the thread is not
+  far enough ahead to hide the server's latency.
+
+  Repositioning (a seek, or reset after a write) bumps 'generation' so
+  that a fetch already in flight is thrown away when it completes.
+*/
+
+enum
+  {
+    RA_EMPTY,
+    RA_PENDING,
+    RA_READY,
+    RA_FAILED
+  };
+
+struct ra_block
+{
+  off_t offset;
+  size_t len;
+  int state;
+  int err;
+  char *data;
+};
+
+struct readahead
+{
+  File *file;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t block_size;
+  unsigned max_blocks;
+  unsigned window;
+  struct ra_block *blocks;
+  unsigned head;
+  unsigned count;
+  off_t start;
+  off_t eof;
+  unsigned generation;
+  bool idle;
+  bool stop;
+};
+
+static struct ra_block *
+ra_block (readahead *ra, unsigned k)
+{
+  return &ra->blocks[(ra->head + k) % ra->max_blocks];
+}
+
+/* Start an empty window at offset.  Called with the mutex held. */
+static void
+ra_reposition (readahead *ra, off_t offset)
+{
+  unsigned k;
+
+  for (k = 0; k < ra->max_blocks; k++)
+    ra->blocks[k].state = RA_EMPTY;
+
+  ra->generation++;
+  ra->head = 0;
+  ra->count = 0;
+  ra->start = offset;
+  ra->eof = -1;
+  ra->window = ra->max_blocks < 2 ? ra->max_blocks : 2;
+  ra->idle = false;
+  pthread_cond_broadcast (&ra->cond);
+}
+
+static void *
+ra_thread (void *arg)
+{
+  readahead *ra = arg;
+
+  pthread_mutex_lock (&ra->mutex);
+  while (!ra->stop)
+    {
+      struct ra_block *b;
+      unsigned generation;
+      off_t offset;
+      ssize_t len;
+      int err;
+
+      offset = ra->start + (off_t) ra->count * ra->block_size;
+      if (ra->idle || ra->count >= ra->window ||
+	  (ra->eof >= 0 && offset >= ra->eof))
+	{
+	  pthread_cond_wait (&ra->cond, &ra->mutex);
+	  continue;
+	}
+
+      b = ra_block (ra, ra->count);
+      if (b->data == NULL)
+	{
+	  b->data = malloc (ra->block_size);
+	  if (b->data == NULL)
+	    {
+	      /* Stop prefetching; the reader falls back to waiting. */
+	      ra->idle = true;
+	      pthread_cond_broadcast (&ra->cond);
+	      continue;
+	    }
+	}
+
+      b->offset = offset;
+      b->state = RA_PENDING;
+      ra->count++;
+      generation = ra->generation;
+      pthread_mutex_unlock (&ra->mutex);
+
+      len = file_pread (ra->file, b->data, ra->block_size, offset);
+      err = errno;
+
+      pthread_mutex_lock (&ra->mutex);
+      if (generation != ra->generation)
+	continue;
+
+      if (len < 0)
+	{
+	  b->state = RA_FAILED;
+	  b->err = err;
+	  ra->idle = true;
+	}
+      else
+	{
+	  b->state = RA_READY;
+	  b->len = len;
+	  if ((size_t) len < ra->block_size)
+	    ra->eof = offset + len;
+	}
+
+      pthread_cond_broadcast (&ra->cond);
+    }
+
+  pthread_mutex_unlock (&ra->mutex);
+  return NULL;
+}
+
+readahead *
+readahead_new (File *file, size_t block_size, unsigned max_blocks)
+{
+  readahead *ra;
+
+  ra = calloc (1, sizeof (*ra));
+  if (ra == NULL)
+    return NULL;
+
+  ra->blocks = calloc (max_blocks, sizeof (*ra->blocks));
+  if (ra->blocks == NULL)
+    {
+      free (ra);
+      return NULL;
+    }
+
+  ra->file = file;
+  ra->block_size = block_size;
+  ra->max_blocks = max_blocks;
+  ra->idle = true;
+  ra->eof = -1;
+  pthread_mutex_init (&ra->mutex, NULL);
+  pthread_cond_init (&ra->cond, NULL);
+  if (pthread_create (&ra->thread, NULL, ra_thread, ra) != 0)
+    {
+      pthread_cond_destroy (&ra->cond);
+      pthread_mutex_destroy (&ra->mutex);
+      free (ra->blocks);
+      free (ra);
+      return NULL;
+    }
+
+  debugprintf ("%p readahead_new(%zu x %u)\n", ra, block_size, max_blocks);
+  return ra;
+}
+
+void
+readahead_free (readahead *ra)
+{
+  unsigned k;
+
+  if (ra == NULL)
+    return;
+
+  pthread_mutex_lock (&ra->mutex);
+  ra->stop = true;
+  pthread_cond_broadcast (&ra->cond);
+  pthread_mutex_unlock (&ra->mutex);
+  pthread_join (ra->thread, NULL);
+
+  for (k = 0; k < ra->max_blocks; k++)
+    free (ra->blocks[k].data);
+
+  pthread_cond_destroy (&ra->cond);
+  pthread_mutex_destroy (&ra->mutex);
+  free (ra->blocks);
+  free (ra);
+}
+
+/* Discard the window and stop prefetching until the next read. */
+void
+readahead_reset (readahead *ra)
+{
+  pthread_mutex_lock (&ra->mutex);
+  ra_reposition (ra, 0);
+  ra->idle = true;
+  pthread_mutex_unlock (&ra->mutex);
+}
+
+/*
+  Copy up to size bytes at offset out of the window, waiting for the
+  block to arrive if need be.  Returns the number of bytes copied (at
+  most to the end of one block), 0 at end of file, or -1 with errno
+  set if the block could not be fetched.
+*/
+ssize_t
+readahead_read (readahead *ra, off_t offset, char *dst, size_t size)
+{
+  bool waited = false;
+  ssize_t ret;
+
+  pthread_mutex_lock (&ra->mutex);
+  if (ra->idle || offset < ra->start ||
+      (offset - ra->start) / ra->block_size >= ra->window)
+    ra_reposition (ra, offset);
+
+  for (;;)
+    {
+      unsigned k = (offset - ra->start) / ra->block_size;
+      struct ra_block *b;
+      size_t within;
+
+      if (ra->eof >= 0 && offset >= ra->eof)
+	{
+	  ret = 0;
+	  break;
+	}
+
+      if (k >= ra->count)
+	{
+	  if (ra->idle)
+	    {
+	      /* The thread gave up (out of memory). */
+	      errno = ENOMEM;
+	      ret = -1;
+	      break;
+	    }
+
+	  waited = true;
+	  pthread_cond_wait (&ra->cond, &ra->mutex);
+	  continue;
+	}
+
+      b = ra_block (ra, k);
+      if (b->state == RA_PENDING)
+	{
+	  waited = true;
+	  pthread_cond_wait (&ra->cond, &ra->mutex);
+	  continue;
+	}
+
+      if (b->state == RA_FAILED)
+	{
+	  errno = b->err;
+	  ra_reposition (ra, offset);
+	  ra->idle = true;
+	  ret = -1;
+	  break;
+	}
+
+      within = offset - b->offset;
+      if (within >= b->len)
+	{
+	  ret = 0;
+	  break;
+	}
+
+      ret = b->len - within;
+      if ((size_t) ret > size)
+	ret = size;
+
+      memcpy (dst, b->data + within, ret);
+
+      /* Release the blocks the reader has finished with. */
+      if (within + ret == b->len)
+	k++;
+
+      ra->head = (ra->head + k) % ra->max_blocks;
+      ra->count -= k;
+      ra->start += (off_t) k * ra->block_size;
+
+      if (waited && ra->window < ra->max_blocks)
+	{
+	  ra->window *= 2;
+	  if (ra->window > ra->max_blocks)
+	    ra->window = ra->max_blocks;
+	}
+
+      pthread_cond_broadcast (&ra->cond);
+      break;
+    }
+
+  pthread_mutex_unlock (&ra->mutex);
+  return ret;
+}
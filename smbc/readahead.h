@@ -0,0 +1,36 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_READAHEAD_H
+#define HAVE_READAHEAD_H
+
+/*
+  Sequential readahead for a File.  A native thread keeps a window of
+  blocks following the reader's position fetched in the background.
+  None of these functions may be called with the GIL held.
+*/
+typedef struct readahead readahead;
+
+extern readahead *readahead_new (File *file, size_t block_size,
+				 unsigned max_blocks);
+extern void readahead_free (readahead *ra);
+extern void readahead_reset (readahead *ra);
+extern ssize_t readahead_read (readahead *ra, off_t offset,
+			       char *dst, size_t size);
+
+#endif /* HAVE_READAHEAD_H */
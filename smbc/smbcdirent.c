@@ -25,10 +25,167 @@ typedef struct
 {
   PyObject_HEAD
   unsigned int smbc_type;
-  char *comment;
-  char *name;
+  PyObject *comment;		/* str */
+  PyObject *name;		/* str */
+
+  /* Filled in for entries listed by Context.scandir. */
+  bool has_stat;
+  struct stat st;
+  unsigned int attrs;		/* DOS attributes */
+  struct timespec btime;
 } Dirent;
 
+#define DIRENT_ATTR_READONLY 0x01
+#define DIRENT_ATTR_DIRECTORY 0x10
+
+/*
+  Most entries in a listing share a comment (usually an empty one), so
+  the last comment seen is kept and reused.  Only used with the GIL
+  held.
+*/
+static char *last_comment;
+static PyObject *last_comment_obj;
+
+static PyObject *
+dirent_decode (const char *s, size_t len)
+{
+  return PyUnicode_DecodeUTF8 (s, len, "replace");
+}
+
+static PyObject *
+dirent_comment (const char *comment, size_t len)
+{
+  char *copy;
+
+  if (last_comment_obj && strlen (last_comment) == len &&
+      memcmp (last_comment, comment, len) == 0)
+    {
+      Py_INCREF (last_comment_obj);
+      return last_comment_obj;
+    }
+
+  copy = strndup (comment, len);
+  if (copy == NULL)
+    return PyErr_NoMemory ();
+
+  free (last_comment);
+  Py_XDECREF (last_comment_obj);
+  last_comment = copy;
+  last_comment_obj = dirent_decode (comment, len);
+  if (last_comment_obj == NULL)
+    return NULL;
+
+  PyUnicode_InternInPlace (&last_comment_obj);
+  Py_INCREF (last_comment_obj);
+  return last_comment_obj;
+}
+
+/* Make a Dirent straight from an entry returned by smbc_getdents. */
+PyObject *
+Dirent_FromSmbcDirent (const struct smbc_dirent *dirp)
+{
+  Dirent *self;
+  size_t len;
+
+  self = (Dirent *) smbc_DirentType.tp_alloc (&smbc_DirentType, 0);
+  if (self == NULL)
+    return NULL;
+
+  /* namelen counts the terminating NUL on some versions. */
+  len = strnlen (dirp->name, dirp->namelen ? dirp->namelen : 1024);
+  self->smbc_type = dirp->smbc_type;
+  self->name = dirent_decode (dirp->name, len);
+  if (dirp->comment)
+    self->comment = dirent_comment (dirp->comment,
+				    strnlen (dirp->comment,
+					     dirp->commentlen ?
+					     dirp->commentlen : 1024));
+  else
+    self->comment = dirent_comment ("", 0);
+
+  if (self->name == NULL || self->comment == NULL)
+    {
+      Py_DECREF (self);
+      return NULL;
+    }
+
+  return (PyObject *) self;
+}
+
+/* Make a Dirent with just a name and a type. */
+PyObject *
+Dirent_FromName (const char *name, unsigned int smbc_type)
+{
+  Dirent *self;
+
+  self = (Dirent *) smbc_DirentType.tp_alloc (&smbc_DirentType, 0);
+  if (self == NULL)
+    return NULL;
+
+  self->smbc_type = smbc_type;
+  self->name = dirent_decode (name, strlen (name));
+  self->comment = dirent_comment ("", 0);
+  if (self->name == NULL || self->comment == NULL)
+    {
+      Py_DECREF (self);
+      return NULL;
+    }
+
+  return (PyObject *) self;
+}
+
+/*
+  Make a Dirent, with its attributes, from an entry returned by
+  smbc_readdirplus2, or by smbc_readdirplus if st is NULL.  The
+  comment is always empty.
+*/
+PyObject *
+Dirent_FromFileInfo (const struct libsmb_file_info *info,
+		     const struct stat *st)
+{
+  Dirent *self;
+  bool isdir = (info->attrs & DIRENT_ATTR_DIRECTORY) != 0;
+
+  self = (Dirent *) smbc_DirentType.tp_alloc (&smbc_DirentType, 0);
+  if (self == NULL)
+    return NULL;
+
+  self->name = dirent_decode (info->name, strlen (info->name));
+  self->comment = dirent_comment ("", 0);
+  if (self->name == NULL || self->comment == NULL)
+    {
+      Py_DECREF (self);
+      return NULL;
+    }
+
+  self->has_stat = true;
+  self->attrs = info->attrs;
+  self->btime = info->btime_ts;
+  if (st)
+    {
+      self->st = *st;
+      isdir = S_ISDIR (st->st_mode);
+    }
+  else
+    {
+      /* Much as libsmbclient's own stat would have it. */
+      self->st.st_mode = isdir ? S_IFDIR | 0555 : S_IFREG | 0444;
+      if (!(info->attrs & DIRENT_ATTR_READONLY))
+	self->st.st_mode |= 0200;
+
+      self->st.st_nlink = 1;
+      self->st.st_uid = info->uid;
+      self->st.st_gid = info->gid;
+      self->st.st_size = info->size;
+      self->st.st_atim = info->atime_ts;
+      self->st.st_mtim = info->mtime_ts;
+      self->st.st_ctim = info->ctime_ts;
+    }
+
+  self->smbc_type = isdir ? SMBC_DIR : SMBC_FILE;
+  return (PyObject *) self;
+}
+
 /////////
 // Dir //
 /////////
@@ -73,8 +230,13 @@ Dirent_init (Dirent *self, PyObject *args, PyObject *kwds)
     debugprintf ("<- Dirent_init() EXCEPTION\n");
     return -1;
   }
-  self->name = strndup (name, name_len);
-  self->comment = strndup (comment, comment_len);
+  Py_CLEAR (self->name);
+  Py_CLEAR (self->comment);
+  self->name = dirent_decode (name, name_len);
+  self->comment = dirent_comment (comment, comment_len);
+  if (self->name == NULL || self->comment == NULL)
+    return -1;
+
   self->smbc_type = smbc_type;
   debugprintf ("%p <- Dirent_init()\n", self);
   return 0;
@@ -83,8 +245,8 @@ Dirent_init (Dirent *self, PyObject *args, PyObject *kwds)
 static void
 Dirent_dealloc (Dirent *self)
 {
-  free (self->comment);
-  free (self->name);
+  Py_XDECREF (self->comment);
+  Py_XDECREF (self->name);
   Py_TYPE(self)->tp_free ((PyObject *) self);
 }
 
@@ -108,17 +270,23 @@ Dirent_repr (PyObject *self)
   Dirent *dent = (Dirent *) self;
 #if PY_MAJOR_VERSION >= 3
   return PyUnicode_FromFormat(
-    "<smbc.Dirent object \"%s\" (%s) at %p>", dent->name,
+    "<smbc.Dirent object \"%U\" (%s) at %p>", dent->name,
     dent->smbc_type < (sizeof (types) / sizeof *(types)) ?
     types[dent->smbc_type] : "?",
     dent);
 #else
   char s[1024];
+  PyObject *name = PyUnicode_AsUTF8String (dent->name);
+  if (name == NULL)
+    return NULL;
+
   snprintf (s, sizeof (s),
-	    "<smbc.Dirent object \"%s\" (%s) at %p>", dent->name,
+	    "<smbc.Dirent object \"%s\" (%s) at %p>",
+	    PyBytes_AsString (name),
 	    dent->smbc_type < (sizeof (types) / sizeof *(types)) ?
 	    types[dent->smbc_type] : "?",
 	    dent);
+  Py_DECREF (name);
   return PyBytes_FromStringAndSize (s, strlen (s));
 #endif
 }
@@ -126,13 +294,15 @@ Dirent_repr (PyObject *self)
 static PyObject *
 Dirent_getName (Dirent *self, void *closure)
 {
-  return PyUnicode_FromFormat("%s", self->name);
+  Py_INCREF (self->name);
+  return self->name;
 }
 
 static PyObject *
 Dirent_getComment (Dirent *self, void *closure)
 {
-  return PyUnicode_FromFormat("%s", self->comment);
+  Py_INCREF (self->comment);
+  return self->comment;
 }
 
 static PyObject *
@@ -141,6 +311,83 @@ Dirent_getSmbcType (Dirent *self, void *closure)
   return PyLong_FromLong (self->smbc_type);
 }
 
+static PyObject *
+dirent_time (const struct timespec *ts)
+{
+  return PyFloat_FromDouble (ts->tv_sec + ts->tv_nsec * 1e-9);
+}
+
+static PyObject *
+Dirent_getSize (Dirent *self, void *closure)
+{
+  if (!self->has_stat)
+    Py_RETURN_NONE;
+
+  return PyLong_FromLongLong (self->st.st_size);
+}
+
+static PyObject *
+Dirent_getAttrs (Dirent *self, void *closure)
+{
+  if (!self->has_stat)
+    Py_RETURN_NONE;
+
+  return PyLong_FromLong (self->attrs);
+}
+
+static PyObject *
+Dirent_getTime (Dirent *self, void *closure)
+{
+  const char *which = closure;
+
+  if (!self->has_stat)
+    Py_RETURN_NONE;
+
+  switch (which[0])
+    {
+    case 'a':
+      return dirent_time (&self->st.st_atim);
+    case 'm':
+      return dirent_time (&self->st.st_mtim);
+    case 'c':
+      return dirent_time (&self->st.st_ctim);
+    default:
+      return dirent_time (&self->btime);
+    }
+}
+
+static PyObject *
+Dirent_stat (Dirent *self)
+{
+  if (!self->has_stat)
+    Py_RETURN_NONE;
+
+  return pysmbc_StatTuple (&self->st);
+}
+
+static PyObject *
+Dirent_is_dir (Dirent *self)
+{
+  return PyBool_FromLong (self->smbc_type == SMBC_DIR ||
+			  self->smbc_type == SMBC_FILE_SHARE);
+}
+
+PyMethodDef Dirent_methods[] =
+  {
+    { "stat",
+      (PyCFunction) Dirent_stat, METH_NOARGS,
+      "stat() -> tuple\n\n"
+      "@return: the entry's attributes, as from L{smbc.Context.stat}, or\n"
+      "None if the entry was not listed by L{smbc.Context.scandir}" },
+
+    { "is_dir",
+      (PyCFunction) Dirent_is_dir, METH_NOARGS,
+      "is_dir() -> bool\n\n"
+      "@return: whether the entry is a directory or a share" },
+
+    { NULL } /* Sentinel */
+  };
+
 PyGetSetDef Dirent_getseters[] =
   {
     { "name",
@@ -155,6 +402,30 @@ PyGetSetDef Dirent_getseters[] =
       (getter) Dirent_getSmbcType, (setter) NULL,
       "smbc_type", NULL },
 
+    { "size",
+      (getter) Dirent_getSize, (setter) NULL,
+      "size in bytes, or None if not listed by Context.scandir", NULL },
+
+    { "attrs",
+      (getter) Dirent_getAttrs, (setter) NULL,
+      "DOS attributes, or None if not listed by Context.scandir", NULL },
+
+    { "atime",
+      (getter) Dirent_getTime, (setter) NULL,
+      "access time, or None if not listed by Context.scandir", "a" },
+
+    { "mtime",
+      (getter) Dirent_getTime, (setter) NULL,
+      "modification time, or None if not listed by Context.scandir", "m" },
+
+    { "ctime",
+      (getter) Dirent_getTime, (setter) NULL,
+      "change time, or None if not listed by Context.scandir", "c" },
+
+    { "btime",
+      (getter) Dirent_getTime, (setter) NULL,
+      "creation time, or None if not listed by Context.scandir", "b" },
+
     { NULL }
   };
 
@@ -192,7 +463,7 @@ PyGetSetDef Dirent_getseters[] =
       0,                         /* tp_weaklistoffset */
       0,                         /* tp_iter */
       0,                         /* tp_iternext */
-      0,                         /* tp_methods */
+      Dirent_methods,            /* tp_methods */
       0,                         /* tp_members */
       Dirent_getseters,          /* tp_getset */
       0,                         /* tp_base */
@@ -239,7 +510,7 @@ PyGetSetDef Dirent_getseters[] =
       0,                         /* tp_weaklistoffset */
       0,                         /* tp_iter */
       0,                         /* tp_iternext */
-      0,                         /* tp_methods */
+      Dirent_methods,            /* tp_methods */
       0,                         /* tp_members */
       Dirent_getseters,          /* tp_getset */
       0,                         /* tp_base */
@@ -22,5 +22,9 @@
 
 extern PyMethodDef Dirent_methods[];
 extern PyTypeObject smbc_DirentType;
+extern PyObject *Dirent_FromSmbcDirent (const struct smbc_dirent *dirp);
+extern PyObject *Dirent_FromName (const char *name, unsigned int smbc_type);
+extern PyObject *Dirent_FromFileInfo (const struct libsmb_file_info *info,
+				      const struct stat *st);
 
 #endif /* HAVE_SMBCDIRENT_H */
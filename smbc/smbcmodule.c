@@ -31,6 +31,8 @@
 #include "dir.h"
 #include "file.h"
 #include "smbcdirent.h"
+#include "tree.h"
+#include "watch.h"
 
 static PyMethodDef SmbcMethods[] = {
   { NULL, NULL, 0, NULL }
@@ -89,6 +91,16 @@ PYSMBC_PROTOTYPE_HEADER
     return PYSMBC_INIT_ERROR;
   PyModule_AddObject (m, "Dirent", (PyObject *) &smbc_DirentType);
 
+  // Walk type
+  if (PyType_Ready (&smbc_WalkType) < 0)
+    return PYSMBC_INIT_ERROR;
+  PyModule_AddObject (m, "Walk", (PyObject *) &smbc_WalkType);
+
+  // Watch type
+  if (PyType_Ready (&smbc_WatchType) < 0)
+    return PYSMBC_INIT_ERROR;
+  PyModule_AddObject (m, "Watch", (PyObject *) &smbc_WatchType);
+
   // ACL string constants
   PyModule_AddStringConstant(m, "XATTR_ALL", SMBC_XATTR_ALL);
   PyModule_AddStringConstant(m, "XATTR_ALL_SID", SMBC_XATTR_ALL_SID);
@@ -125,6 +137,31 @@ PYSMBC_PROTOTYPE_HEADER
   INT_CONSTANT (SMBC_, XATTR_FLAG_CREATE);
   INT_CONSTANT (SMBC_, XATTR_FLAG_REPLACE);
 
+  // define constants for Context.watch
+#if SMBCLIENT_VERSION >= 203 /* 0.2.3 or newer */
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_ADDED);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_REMOVED);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_MODIFIED);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_OLD_NAME);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_NEW_NAME);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_ADDED_STREAM);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_REMOVED_STREAM);
+  INT_CONSTANT (SMBC_, NOTIFY_ACTION_MODIFIED_STREAM);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_FILE_NAME);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_DIR_NAME);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_ATTRIBUTES);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_SIZE);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_LAST_WRITE);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_LAST_ACCESS);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_CREATION);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_EA);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_SECURITY);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_STREAM_NAME);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_STREAM_SIZE);
+  INT_CONSTANT (SMBC_, NOTIFY_CHANGE_STREAM_WRITE);
+#endif
+  INT_CONSTANT (WATCH_, NOTIFY_OVERFLOW);
+
   // define exception objects
   PyObject *SmbError = PyErr_NewException("smbc.SmbError", PyExc_IOError, NULL);
   Py_INCREF(SmbError);
@@ -209,6 +246,55 @@ void pysmbc_SetFromErrno()
   return;
 }
 
+/*
+  The exception being raised, as an object, clearing it (None if there
+  is none).  GIL held.  A worker thread's thread state goes away when
+  it releases the GIL, so it must take any exception before then.
+*/
+PyObject *
+pysmbc_TakeError (void)
+{
+  PyObject *type, *value, *tb;
+
+  PyErr_Fetch (&type, &value, &tb);
+  PyErr_NormalizeException (&type, &value, &tb);
+  Py_XDECREF (type);
+  Py_XDECREF (tb);
+  if (value == NULL)
+    {
+      value = Py_None;
+      Py_INCREF (value);
+    }
+
+  return value;
+}
+
+/* The exception pysmbc_SetFromErrno() raises for err, as an object. */
+PyObject *
+pysmbc_ErrorFromErrno (int err)
+{
+  errno = err;
+  pysmbc_SetFromErrno ();
+  return pysmbc_TakeError ();
+}
+
+/* The tuple Context.stat() and friends return for st. */
+PyObject *
+pysmbc_StatTuple (const struct stat *st)
+{
+  return Py_BuildValue ("(IKKKIIKIII)",
+			st->st_mode,
+			(unsigned long long)st->st_ino,
+			(unsigned long long)st->st_dev,
+			(unsigned long long)st->st_nlink,
+			st->st_uid,
+			st->st_gid,
+			st->st_size,
+			st->st_atime,
+			st->st_mtime,
+			st->st_ctime);
+}
+
 ///////////////
 // Debugging //
 ///////////////
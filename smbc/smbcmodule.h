@@ -38,6 +38,9 @@
 
 extern void debugprintf (const char *fmt, ...) FORMAT ((__printf__, 1, 2));
 extern void pysmbc_SetFromErrno(void);
+extern PyObject *pysmbc_TakeError (void);
+extern PyObject *pysmbc_ErrorFromErrno (int err);
+extern PyObject *pysmbc_StatTuple (const struct stat *st);
 
 extern PyObject *NoEntryError;
 extern PyObject *PermissionError;
@@ -0,0 +1,789 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "snapshot.h"
+#include "tree.h"
+
+//////////////
+// Snapshot //
+//////////////
+
+/*
+  An index file starts with a struct snapshot_header, followed by a
+  record per directory, in no particular order:
+
+    uint64  hash of the directory's path (FNV-1a)
+    uint32  length of the path, relative to the top; 0 for the top
+    char[]  the path, without a terminating NUL
+    uint32  number of entries
+    entries, sorted by name, each:
+      uint8   SNAPSHOT_FILE, SNAPSHOT_DIR or SNAPSHOT_LINK
+      uint64  size
+      int64   mtime, in nanoseconds, or SNAPSHOT_NO_TIME if unknown
+      uint32  length of the name
+      char[]  the name
+
+  Integers are in host byte order.  A new index is written to a
+  temporary file next to the old one, and renamed over it once it is
+  complete.
+
+  Diffing reads the old index into memory and finds the record of each
+  directory listed by its path hash.  The entries of both are sorted,
+  so comparing them is a merge.
+*/
+
+#define SNAPSHOT_MAGIC "PYSMBCIX"
+#define SNAPSHOT_VERSION 1
+
+/* The mtime of an entry that could not be statted; its size is 0. */
+#define SNAPSHOT_NO_TIME INT64_MIN
+
+enum
+  {
+    SNAPSHOT_FILE,
+    SNAPSHOT_DIR,
+    SNAPSHOT_LINK		/* a directory that is not entered */
+  };
+
+struct snapshot_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t ndirs;
+  uint64_t nentries;
+};
+
+/* An entry, either listed or read from the old index. */
+struct snapshot_entry
+{
+  const char *name;
+  uint32_t namelen;
+  uint8_t type;
+  uint64_t size;
+  int64_t mtime;
+  size_t item;			/* listed: index into the items */
+};
+
+/* A directory record of the old index. */
+struct snapshot_record
+{
+  const char *start;
+  size_t len;
+  const char *path;
+  uint32_t pathlen;
+  uint32_t n;
+  const char *entries;
+};
+
+struct snapshot_slot
+{
+  uint64_t hash;
+  size_t offset;		/* of the record, plus one; 0 if free */
+};
+
+struct snapshot
+{
+  const char *top;
+  size_t toplen;
+
+  /* The old index, and a hash table of its records. */
+  char *old;
+  size_t old_len;
+  struct snapshot_slot *slots;
+  size_t mask;
+
+  bool trust;
+
+  /* The new index. */
+  const char *path;
+  char *tmp;
+  FILE *out;
+  uint64_t ndirs;
+  uint64_t nentries;
+
+  /* Relative paths of the changes found, when diffing. */
+  PyObject *added;
+  PyObject *removed;
+  PyObject *modified;
+};
+
+static uint64_t
+snapshot_hash (const char *s, size_t len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (len--)
+    {
+      hash ^= (unsigned char) *s++;
+      hash *= 1099511628211ULL;
+    }
+
+  return hash;
+}
+
+static int
+snapshot_entry_cmp (const void *a, const void *b)
+{
+  const struct snapshot_entry *x = a;
+  const struct snapshot_entry *y = b;
+  int cmp = memcmp (x->name, y->name,
+		    x->namelen < y->namelen ? x->namelen : y->namelen);
+
+  if (cmp)
+    return cmp;
+
+  return (x->namelen > y->namelen) - (x->namelen < y->namelen);
+}
+
+static bool
+snapshot_get (const char **p, const char *end, void *v, size_t size)
+{
+  if ((size_t) (end - *p) < size)
+    return false;
+
+  memcpy (v, *p, size);
+  *p += size;
+  return true;
+}
+
+/* Read the entry at *p, which has been checked, and step past it. */
+static void
+snapshot_next_entry (const char **p, struct snapshot_entry *e)
+{
+  const char *q = *p;
+
+  memcpy (&e->type, q, sizeof (e->type));
+  q += sizeof (e->type);
+  memcpy (&e->size, q, sizeof (e->size));
+  q += sizeof (e->size);
+  memcpy (&e->mtime, q, sizeof (e->mtime));
+  q += sizeof (e->mtime);
+  memcpy (&e->namelen, q, sizeof (e->namelen));
+  q += sizeof (e->namelen);
+  e->name = q;
+  *p = q + e->namelen;
+}
+
+/* Check the record at p and describe it in *rec. */
+static bool
+snapshot_parse (const char *p, const char *end, struct snapshot_record *rec)
+{
+  uint64_t hash;
+  uint32_t i;
+
+  rec->start = p;
+  if (!snapshot_get (&p, end, &hash, sizeof (hash)) ||
+      !snapshot_get (&p, end, &rec->pathlen, sizeof (rec->pathlen)) ||
+      (size_t) (end - p) < rec->pathlen)
+    return false;
+
+  rec->path = p;
+  p += rec->pathlen;
+  if (!snapshot_get (&p, end, &rec->n, sizeof (rec->n)))
+    return false;
+
+  rec->entries = p;
+  for (i = 0; i < rec->n; i++)
+    {
+      uint32_t namelen;
+
+      if ((size_t) (end - p) < 1 + 8 + 8 + 4)
+	return false;
+
+      memcpy (&namelen, p + 1 + 8 + 8, sizeof (namelen));
+      p += 1 + 8 + 8 + 4;
+      if ((size_t) (end - p) < namelen)
+	return false;
+
+      p += namelen;
+    }
+
+  rec->len = p - rec->start;
+  return true;
+}
+
+/* Read the index at path into s.  Returns -1 with an exception set. */
+static int
+snapshot_load (struct snapshot *s, const char *path)
+{
+  struct snapshot_header header;
+  const char *p, *end;
+  size_t size;
+  uint64_t i;
+  FILE *f;
+  long len;
+
+  f = fopen (path, "rb");
+  if (f == NULL ||
+      fseek (f, 0, SEEK_END) < 0 || (len = ftell (f)) < 0 ||
+      fseek (f, 0, SEEK_SET) < 0)
+    goto fail_errno;
+
+  s->old_len = len;
+  s->old = malloc (s->old_len ? s->old_len : 1);
+  if (s->old == NULL)
+    {
+      fclose (f);
+      PyErr_NoMemory ();
+      return -1;
+    }
+
+  if (fread (s->old, 1, s->old_len, f) != s->old_len)
+    goto fail_errno;
+
+  fclose (f);
+  f = NULL;
+  if (s->old_len < sizeof (header))
+    goto fail_format;
+
+  memcpy (&header, s->old, sizeof (header));
+  if (memcmp (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic)) ||
+      header.version != SNAPSHOT_VERSION ||
+      header.ndirs > s->old_len)
+    goto fail_format;
+
+  for (size = 16; size < 2 * header.ndirs; size *= 2)
+    ;
+
+  s->slots = calloc (size, sizeof (*s->slots));
+  if (s->slots == NULL)
+    {
+      PyErr_NoMemory ();
+      return -1;
+    }
+
+  s->mask = size - 1;
+  p = s->old + sizeof (header);
+  end = s->old + s->old_len;
+  for (i = 0; i < header.ndirs; i++)
+    {
+      struct snapshot_record rec;
+      uint64_t hash;
+      size_t k;
+
+      if (!snapshot_parse (p, end, &rec))
+	goto fail_format;
+
+      memcpy (&hash, p, sizeof (hash));
+      for (k = hash & s->mask; s->slots[k].offset; k = (k + 1) & s->mask)
+	;
+
+      s->slots[k].hash = hash;
+      s->slots[k].offset = p - s->old + 1;
+      p += rec.len;
+    }
+
+  return 0;
+
+ fail_errno:
+  PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+  if (f)
+    fclose (f);
+  return -1;
+
+ fail_format:
+  PyErr_Format (PyExc_ValueError, "%s is not a snapshot index", path);
+  return -1;
+}
+
+/* Find the old record for path. */
+static bool
+snapshot_find (struct snapshot *s, const char *path, size_t len,
+	       struct snapshot_record *rec)
+{
+  uint64_t hash;
+  size_t k;
+
+  if (s->slots == NULL)
+    return false;
+
+  hash = snapshot_hash (path, len);
+  for (k = hash & s->mask; s->slots[k].offset; k = (k + 1) & s->mask)
+    {
+      if (s->slots[k].hash != hash)
+	continue;
+
+      snapshot_parse (s->old + s->slots[k].offset - 1,
+		      s->old + s->old_len, rec);
+      if (rec->pathlen == len && !memcmp (rec->path, path, len))
+	return true;
+    }
+
+  return false;
+}
+
+/* path/name, in a malloc()ed string, or NULL with an exception set. */
+static char *
+snapshot_join (const char *path, size_t len, const char *name,
+	       size_t namelen, size_t *joinedlen)
+{
+  char *joined = malloc (len + 1 + namelen + 1);
+  char *p = joined;
+
+  if (joined == NULL)
+    {
+      PyErr_NoMemory ();
+      return NULL;
+    }
+
+  memcpy (p, path, len);
+  p += len;
+  if (len)
+    *p++ = '/';
+
+  memcpy (p, name, namelen);
+  p += namelen;
+  *p = '\0';
+  *joinedlen = p - joined;
+  return joined;
+}
+
+static int
+snapshot_report (PyObject *list, const char *path, size_t len)
+{
+  PyObject *str = PyUnicode_DecodeUTF8 (path, len, "replace");
+  int ret;
+
+  if (str == NULL)
+    return -1;
+
+  ret = PyList_Append (list, str);
+  Py_DECREF (str);
+  return ret;
+}
+
+/* Report path as removed, and everything the old index has below it. */
+static int
+snapshot_report_removed (struct snapshot *s, const char *path, size_t len,
+			 uint8_t type)
+{
+  struct snapshot_record rec;
+  const char *p;
+  uint32_t i;
+
+  if (snapshot_report (s->removed, path, len) < 0)
+    return -1;
+
+  if (type != SNAPSHOT_DIR || !snapshot_find (s, path, len, &rec))
+    return 0;
+
+  p = rec.entries;
+  for (i = 0; i < rec.n; i++)
+    {
+      struct snapshot_entry e;
+      size_t sublen;
+      char *sub;
+      int ret;
+
+      snapshot_next_entry (&p, &e);
+      sub = snapshot_join (path, len, e.name, e.namelen, &sublen);
+      if (sub == NULL)
+	return -1;
+
+      ret = snapshot_report_removed (s, sub, sublen, e.type);
+      free (sub);
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static int
+snapshot_write (struct snapshot *s, const void *data, size_t len)
+{
+  if (fwrite (data, 1, len, s->out) != len)
+    {
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, s->tmp);
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+snapshot_write_record (struct snapshot *s, const char *path, size_t len,
+		       const struct snapshot_entry *entries, size_t n)
+{
+  uint64_t hash = snapshot_hash (path, len);
+  uint32_t pathlen = len;
+  uint32_t count = n;
+  size_t i;
+
+  if (snapshot_write (s, &hash, sizeof (hash)) < 0 ||
+      snapshot_write (s, &pathlen, sizeof (pathlen)) < 0 ||
+      snapshot_write (s, path, len) < 0 ||
+      snapshot_write (s, &count, sizeof (count)) < 0)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    {
+      const struct snapshot_entry *e = &entries[i];
+
+      if (snapshot_write (s, &e->type, sizeof (e->type)) < 0 ||
+	  snapshot_write (s, &e->size, sizeof (e->size)) < 0 ||
+	  snapshot_write (s, &e->mtime, sizeof (e->mtime)) < 0 ||
+	  snapshot_write (s, &e->namelen, sizeof (e->namelen)) < 0 ||
+	  snapshot_write (s, e->name, e->namelen) < 0)
+	return -1;
+    }
+
+  s->ndirs++;
+  s->nentries += n;
+  return 0;
+}
+
+/*
+  Copy the old records of path and of the directories below it into
+  the new index, for a directory that is not being listed.
+*/
+static int
+snapshot_carry (struct snapshot *s, const char *path, size_t len)
+{
+  struct snapshot_record rec;
+  const char *p;
+  uint32_t i;
+
+  if (s->out == NULL || !snapshot_find (s, path, len, &rec))
+    return 0;
+
+  if (snapshot_write (s, rec.start, rec.len) < 0)
+    return -1;
+
+  s->ndirs++;
+  s->nentries += rec.n;
+  p = rec.entries;
+  for (i = 0; i < rec.n; i++)
+    {
+      struct snapshot_entry e;
+      size_t sublen;
+      char *sub;
+      int ret;
+
+      snapshot_next_entry (&p, &e);
+      if (e.type != SNAPSHOT_DIR)
+	continue;
+
+      sub = snapshot_join (path, len, e.name, e.namelen, &sublen);
+      if (sub == NULL)
+	return -1;
+
+      ret = snapshot_carry (s, sub, sublen);
+      free (sub);
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+/*
+  Compare the listed entries of path with its old record: report the
+  changes, and for each subdirectory whose mtime is unchanged, if it
+  is to be trusted, carry its old records over instead of entering it.
+*/
+static int
+snapshot_compare (struct snapshot *s, const char *path, size_t len,
+		  const struct snapshot_entry *entries, size_t n,
+		  const struct snapshot_record *rec, bool *enter)
+{
+  struct snapshot_entry old = { 0 };
+  const char *p = rec ? rec->entries : NULL;
+  uint32_t left = rec ? rec->n : 0;
+  size_t i = 0;
+  bool have_old = false;
+
+  while (i < n || left > 0 || have_old)
+    {
+      const struct snapshot_entry *e = i < n ? &entries[i] : NULL;
+      const char *name;
+      size_t namelen;
+      size_t sublen;
+      char *sub;
+      int cmp;
+      int ret = 0;
+
+      if (!have_old && left > 0)
+	{
+	  snapshot_next_entry (&p, &old);
+	  have_old = true;
+	  left--;
+	}
+
+      if (e == NULL)
+	cmp = 1;
+      else if (!have_old)
+	cmp = -1;
+      else
+	cmp = snapshot_entry_cmp (e, &old);
+
+      name = cmp > 0 ? old.name : e->name;
+      namelen = cmp > 0 ? old.namelen : e->namelen;
+      sub = snapshot_join (path, len, name, namelen, &sublen);
+      if (sub == NULL)
+	return -1;
+
+      if (cmp < 0)
+	ret = snapshot_report (s->added, sub, sublen);
+      else if (cmp > 0)
+	ret = snapshot_report_removed (s, sub, sublen, old.type);
+      else if (e->type != old.type)
+	{
+	  ret = snapshot_report_removed (s, sub, sublen, old.type);
+	  if (ret == 0)
+	    ret = snapshot_report (s->added, sub, sublen);
+	}
+      else if (e->mtime == SNAPSHOT_NO_TIME || old.mtime == SNAPSHOT_NO_TIME)
+	;			/* nothing to compare, nothing to trust */
+      else if (e->type == SNAPSHOT_FILE &&
+	       (e->size != old.size || e->mtime != old.mtime))
+	ret = snapshot_report (s->modified, sub, sublen);
+      else if (e->type == SNAPSHOT_DIR && s->trust && e->mtime == old.mtime)
+	{
+	  struct snapshot_record subrec;
+
+	  if (snapshot_find (s, sub, sublen, &subrec))
+	    {
+	      enter[e->item] = false;
+	      ret = snapshot_carry (s, sub, sublen);
+	    }
+	}
+
+      free (sub);
+      if (ret < 0)
+	return -1;
+
+      if (cmp <= 0)
+	i++;
+      if (cmp >= 0)
+	have_old = false;
+    }
+
+  return 0;
+}
+
+static int
+snapshot_visit (void *priv, const char *uri, int err,
+		const struct tree_item *items, size_t n, bool *enter)
+{
+  struct snapshot *s = priv;
+  struct snapshot_record rec;
+  struct snapshot_entry *entries;
+  const char *path = uri + s->toplen;
+  bool have_rec;
+  size_t len;
+  size_t i;
+  int ret = 0;
+
+  while (*path == '/')
+    path++;
+
+  len = strlen (path);
+
+  /* Keep what the old index knew of a directory that cannot be listed. */
+  if (err)
+    return snapshot_carry (s, path, len);
+
+  entries = malloc ((n ? n : 1) * sizeof (*entries));
+  if (entries == NULL)
+    {
+      PyErr_NoMemory ();
+      return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      const struct tree_item *item = &items[i];
+      struct snapshot_entry *e = &entries[i];
+
+      e->name = item->name;
+      e->namelen = strlen (item->name);
+      e->type = !item->isdir ? SNAPSHOT_FILE :
+	item->islink ? SNAPSHOT_LINK : SNAPSHOT_DIR;
+      e->size = item->has_times ? item->size : 0;
+      e->mtime = item->has_times ?
+	item->mtime.tv_sec * 1000000000LL + item->mtime.tv_nsec :
+	SNAPSHOT_NO_TIME;
+      e->item = i;
+      enter[i] = e->type == SNAPSHOT_DIR;
+    }
+
+  qsort (entries, n, sizeof (*entries), snapshot_entry_cmp);
+  if (s->out)
+    ret = snapshot_write_record (s, path, len, entries, n);
+
+  if (ret == 0 && s->old)
+    {
+      have_rec = snapshot_find (s, path, len, &rec);
+      ret = snapshot_compare (s, path, len, entries, n,
+			      have_rec ? &rec : NULL, enter);
+    }
+
+  free (entries);
+  return ret;
+}
+
+/* Start writing the new index.  Returns -1 with an exception set. */
+static int
+snapshot_open (struct snapshot *s, const char *path)
+{
+  struct snapshot_header header;
+  int fd;
+
+  s->path = path;
+  s->tmp = malloc (strlen (path) + sizeof (".XXXXXX"));
+  if (s->tmp == NULL)
+    {
+      PyErr_NoMemory ();
+      return -1;
+    }
+
+  strcpy (s->tmp, path);
+  strcat (s->tmp, ".XXXXXX");
+  fd = mkstemp (s->tmp);
+  if (fd < 0 || (s->out = fdopen (fd, "wb")) == NULL)
+    {
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, s->tmp);
+      if (fd >= 0)
+	{
+	  close (fd);
+	  unlink (s->tmp);
+	}
+
+      free (s->tmp);
+      s->tmp = NULL;
+      return -1;
+    }
+
+  /* The counts are filled in at the end. */
+  memset (&header, 0, sizeof (header));
+  return snapshot_write (s, &header, sizeof (header));
+}
+
+/* Finish the new index and put it in place. */
+static int
+snapshot_commit (struct snapshot *s)
+{
+  struct snapshot_header header;
+  FILE *out = s->out;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.ndirs = s->ndirs;
+  header.nentries = s->nentries;
+  s->out = NULL;
+  if (fseek (out, 0, SEEK_SET) < 0 ||
+      fwrite (&header, sizeof (header), 1, out) != 1 ||
+      fflush (out) != 0 || fsync (fileno (out)) < 0)
+    {
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, s->tmp);
+      fclose (out);
+      return -1;
+    }
+
+  if (fclose (out) != 0)
+    {
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, s->tmp);
+      return -1;
+    }
+
+  if (rename (s->tmp, s->path) < 0)
+    {
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, s->path);
+      return -1;
+    }
+
+  free (s->tmp);
+  s->tmp = NULL;
+  return 0;
+}
+
+static void
+snapshot_free (struct snapshot *s)
+{
+  if (s->out)
+    fclose (s->out);
+
+  if (s->tmp)
+    {
+      unlink (s->tmp);
+      free (s->tmp);
+    }
+
+  free (s->old);
+  free (s->slots);
+  Py_XDECREF (s->added);
+  Py_XDECREF (s->removed);
+  Py_XDECREF (s->modified);
+}
+
+PyObject *
+snapshot_create (Context *ctx, const char *uri, const char *path,
+		 unsigned workers, PyObject *on_error)
+{
+  struct snapshot s;
+  PyObject *result = NULL;
+
+  memset (&s, 0, sizeof (s));
+  s.top = uri;
+  s.toplen = strlen (uri);
+  if (snapshot_open (&s, path) == 0 &&
+      tree_visit (ctx, uri, workers, on_error, snapshot_visit, &s) == 0 &&
+      snapshot_commit (&s) == 0)
+    result = PyLong_FromUnsignedLongLong (s.nentries);
+
+  snapshot_free (&s);
+  return result;
+}
+
+PyObject *
+snapshot_diff (Context *ctx, const char *uri, const char *path,
+	       unsigned workers, bool trust_dir_mtime, bool update,
+	       PyObject *on_error)
+{
+  struct snapshot s;
+  PyObject *result = NULL;
+
+  memset (&s, 0, sizeof (s));
+  s.top = uri;
+  s.toplen = strlen (uri);
+  s.trust = trust_dir_mtime;
+  s.added = PyList_New (0);
+  s.removed = PyList_New (0);
+  s.modified = PyList_New (0);
+  if (s.added && s.removed && s.modified &&
+      snapshot_load (&s, path) == 0 &&
+      (!update || snapshot_open (&s, path) == 0) &&
+      tree_visit (ctx, uri, workers, on_error, snapshot_visit, &s) == 0 &&
+      (!update || snapshot_commit (&s) == 0) &&
+      PyList_Sort (s.added) == 0 &&
+      PyList_Sort (s.removed) == 0 &&
+      PyList_Sort (s.modified) == 0)
+    result = PyTuple_Pack (3, s.added, s.removed, s.modified);
+
+  snapshot_free (&s);
+  return result;
+}
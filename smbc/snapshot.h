@@ -0,0 +1,43 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_SNAPSHOT_H
+#define HAVE_SNAPSHOT_H
+
+/*
+  Write an index of the tree below uri to path: for each directory,
+  the name, type, size and mtime of its entries.  The tree is listed
+  as by tree_visit.  Returns the number of entries indexed.
+*/
+extern PyObject *snapshot_create (Context *ctx, const char *uri,
+				  const char *path, unsigned workers,
+				  PyObject *on_error);
+
+/*
+  Compare the tree below uri with the index at path, and return the
+  relative paths of the entries added, removed and modified since, as
+  three sorted lists.  If 'trust_dir_mtime', a directory whose mtime
+  has not changed is taken to be unchanged, with everything below it,
+  and is not listed.  If 'update', the index is rewritten to match.
+*/
+extern PyObject *snapshot_diff (Context *ctx, const char *uri,
+				const char *path, unsigned workers,
+				bool trust_dir_mtime, bool update,
+				PyObject *on_error);
+
+#endif /* HAVE_SNAPSHOT_H */
@@ -0,0 +1,783 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <pthread.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "pool.h"
+#include "transfer.h"
+
+//////////////
+// Transfer //
+//////////////
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+enum
+  {
+    TRANSFER_DOWNLOAD,
+    TRANSFER_UPLOAD,
+    TRANSFER_SYNC
+  };
+
+struct transfer
+{
+  Context *ctx;
+  const char *uri;
+  int mode;
+  int fd;			/* local file */
+  off_t size;
+  size_t chunk;
+  size_t block;			/* TRANSFER_SYNC: unit of comparison */
+  off_t remote_size;		/* TRANSFER_SYNC: before truncation */
+  pthread_mutex_t mutex;
+  off_t next;			/* start of the next range to hand out */
+  off_t written;		/* TRANSFER_SYNC: bytes rewritten */
+  int err;			/* first error; stops the other workers */
+  bool err_local;
+};
+
+/* Hand out the next range, unless there is none or a worker failed. */
+static bool
+transfer_next (struct transfer *t, off_t *start, off_t *end)
+{
+  bool ret = false;
+
+  pthread_mutex_lock (&t->mutex);
+  if (t->err == 0 && t->next < t->size)
+    {
+      *start = t->next;
+      t->next += MIN ((off_t) t->chunk, t->size - t->next);
+      *end = t->next;
+      ret = true;
+    }
+
+  pthread_mutex_unlock (&t->mutex);
+  return ret;
+}
+
+static void
+transfer_fail (struct transfer *t, int err, bool local)
+{
+  pthread_mutex_lock (&t->mutex);
+  if (t->err == 0)
+    {
+      t->err = err ? err : EIO;
+      t->err_local = local;
+    }
+
+  pthread_mutex_unlock (&t->mutex);
+}
+
+/* Copy [start, end) from the server to the local file. */
+static int
+download_range (struct transfer *t, SMBCCTX *ctx, SMBCFILE *file,
+		char *buf, size_t bufsize, off_t start, off_t end)
+{
+  smbc_read_fn fn = smbc_getFunctionRead (ctx);
+
+  while (start < end)
+    {
+      ssize_t done = 0;
+      ssize_t len;
+
+      errno = 0;
+      len = (*fn) (ctx, file, buf, MIN ((off_t) bufsize, end - start));
+      if (len <= 0)
+	{
+	  /* End of file before the size we started with. */
+	  transfer_fail (t, len < 0 ? errno : EIO, false);
+	  return -1;
+	}
+
+      while (done < len)
+	{
+	  ssize_t n = pwrite (t->fd, buf + done, len - done, start + done);
+	  if (n < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+
+	      transfer_fail (t, errno, true);
+	      return -1;
+	    }
+
+	  done += n;
+	}
+
+      start += len;
+    }
+
+  return 0;
+}
+
+/* Copy [start, end) from the local file to the server. */
+static int
+upload_range (struct transfer *t, SMBCCTX *ctx, SMBCFILE *file,
+	      char *buf, size_t bufsize, off_t start, off_t end)
+{
+  smbc_write_fn fn = smbc_getFunctionWrite (ctx);
+
+  while (start < end)
+    {
+      ssize_t done = 0;
+      ssize_t len;
+
+      len = pread (t->fd, buf, MIN ((off_t) bufsize, end - start), start);
+      if (len <= 0)
+	{
+	  if (len < 0 && errno == EINTR)
+	    continue;
+
+	  transfer_fail (t, len < 0 ? errno : EIO, true);
+	  return -1;
+	}
+
+      while (done < len)
+	{
+	  ssize_t n;
+
+	  errno = 0;
+	  n = (*fn) (ctx, file, buf + done, len - done);
+	  if (n <= 0)
+	    {
+	      transfer_fail (t, n < 0 ? errno : EIO, false);
+	      return -1;
+	    }
+
+	  done += n;
+	}
+
+      start += len;
+    }
+
+  return 0;
+}
+
+/* Read exactly size bytes of the local file, or fail with EIO. */
+static int
+local_pread_fully (struct transfer *t, char *buf, size_t size, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < size)
+    {
+      ssize_t len = pread (t->fd, buf + done, size - done, offset + done);
+      if (len <= 0)
+	{
+	  if (len < 0 && errno == EINTR)
+	    continue;
+
+	  transfer_fail (t, len < 0 ? errno : EIO, true);
+	  return -1;
+	}
+
+      done += len;
+    }
+
+  return 0;
+}
+
+/*
+  Compare [start, end) block by block with the local file, rewriting
+  the blocks which differ.  buf holds two blocks.
+*/
+static int
+sync_range (struct transfer *t, SMBCCTX *ctx, SMBCFILE *file,
+	    char *buf, off_t start, off_t end)
+{
+  smbc_lseek_fn fn_lseek = smbc_getFunctionLseek (ctx);
+  smbc_read_fn fn_read = smbc_getFunctionRead (ctx);
+  smbc_write_fn fn_write = smbc_getFunctionWrite (ctx);
+  char *remote = buf + t->block;
+
+  for (; start < end; start += t->block)
+    {
+      size_t want = MIN ((off_t) t->block, end - start);
+      size_t have = 0;
+      size_t done = 0;
+
+      if (local_pread_fully (t, buf, want, start) < 0)
+	return -1;
+
+      errno = 0;
+      if ((*fn_lseek) (ctx, file, start, SEEK_SET) < 0)
+	{
+	  transfer_fail (t, errno, false);
+	  return -1;
+	}
+
+      while (start + (off_t) have < t->remote_size && have < want)
+	{
+	  ssize_t len = (*fn_read) (ctx, file, remote + have, want - have);
+	  if (len < 0)
+	    {
+	      transfer_fail (t, errno, false);
+	      return -1;
+	    }
+
+	  if (len == 0)
+	    break;
+
+	  have += len;
+	}
+
+      if (have == want && memcmp (buf, remote, want) == 0)
+	continue;
+
+      errno = 0;
+      if ((*fn_lseek) (ctx, file, start, SEEK_SET) < 0)
+	{
+	  transfer_fail (t, errno, false);
+	  return -1;
+	}
+
+      while (done < want)
+	{
+	  ssize_t n = (*fn_write) (ctx, file, buf + done, want - done);
+	  if (n <= 0)
+	    {
+	      transfer_fail (t, n < 0 ? errno : EIO, false);
+	      return -1;
+	    }
+
+	  done += n;
+	}
+
+      pthread_mutex_lock (&t->mutex);
+      t->written += want;
+      pthread_mutex_unlock (&t->mutex);
+    }
+
+  return 0;
+}
+
+static void
+transfer_worker (void *arg)
+{
+  struct transfer *t = arg;
+  size_t bufsize = MIN (t->chunk, TRANSFER_IO_SIZE);
+  SMBCCTX *ctx;
+  SMBCFILE *file = NULL;
+  char *buf = NULL;
+  off_t start, end;
+  int flags = O_RDONLY;
+
+  if (t->mode == TRANSFER_UPLOAD)
+    flags = O_WRONLY;
+  else if (t->mode == TRANSFER_SYNC)
+    {
+      flags = O_RDWR;
+      bufsize = 2 * t->block;
+    }
+
+  ctx = context_clone (t->ctx);
+  if (ctx == NULL)
+    {
+      transfer_fail (t, errno, false);
+      return;
+    }
+
+  buf = malloc (bufsize);
+  if (buf == NULL)
+    {
+      transfer_fail (t, ENOMEM, false);
+      goto out;
+    }
+
+  errno = 0;
+  file = (*smbc_getFunctionOpen (ctx)) (ctx, t->uri, flags, 0);
+  if (file == NULL)
+    {
+      transfer_fail (t, errno, false);
+      goto out;
+    }
+
+  while (transfer_next (t, &start, &end))
+    {
+      int ret;
+
+      errno = 0;
+      if ((*smbc_getFunctionLseek (ctx)) (ctx, file, start, SEEK_SET) < 0)
+	{
+	  transfer_fail (t, errno, false);
+	  break;
+	}
+
+      if (t->mode == TRANSFER_SYNC)
+	ret = sync_range (t, ctx, file, buf, start, end);
+      else if (t->mode == TRANSFER_UPLOAD)
+	ret = upload_range (t, ctx, file, buf, bufsize, start, end);
+      else
+	ret = download_range (t, ctx, file, buf, bufsize, start, end);
+
+      if (ret < 0)
+	break;
+    }
+
+ out:
+  if (file)
+    {
+      errno = 0;
+      if ((*smbc_getFunctionClose (ctx)) (ctx, file) < 0 &&
+	  t->mode != TRANSFER_DOWNLOAD)
+	transfer_fail (t, errno, false);
+    }
+
+  free (buf);
+  context_clone_free (ctx);
+}
+
+/* Share the ranges out among the workers. */
+static void
+transfer_run (struct transfer *t, unsigned streams)
+{
+  off_t ranges = (t->size + t->chunk - 1) / t->chunk;
+
+  if ((off_t) streams > ranges)
+    streams = ranges;
+
+  if (t->err == 0 && streams > 0)
+    {
+      debugprintf ("-> transfer_run(%s, %u x %zu)\n", t->uri, streams,
+		   t->chunk);
+      pool_run (streams, transfer_worker, t);
+    }
+}
+
+int
+transfer_download (Context *ctx, const char *uri, const char *path,
+		   unsigned streams, size_t chunk, off_t *total, bool *local)
+{
+  smbc_stat_fn fn = smbc_getFunctionStat (ctx->context);
+  struct transfer t;
+  struct stat st;
+  int ret;
+
+  *local = false;
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  ret = (*fn) (ctx->context, uri, &st);
+  PyThread_release_lock (ctx->lock);
+  if (ret < 0)
+    return -1;
+
+  if (S_ISDIR (st.st_mode))
+    {
+      errno = EISDIR;
+      return -1;
+    }
+
+  memset (&t, 0, sizeof (t));
+  t.ctx = ctx;
+  t.uri = uri;
+  t.size = st.st_size;
+  t.chunk = chunk;
+  t.fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (t.fd < 0)
+    {
+      *local = true;
+      return -1;
+    }
+
+  pthread_mutex_init (&t.mutex, NULL);
+
+  /* Reserve the space up front; failing that, at least set the size
+     so the ranges can be written in any order. */
+  if (t.size > 0 &&
+      posix_fallocate (t.fd, 0, t.size) != 0 &&
+      ftruncate (t.fd, t.size) < 0)
+    transfer_fail (&t, errno, true);
+
+  transfer_run (&t, streams);
+  if (close (t.fd) < 0 && t.err == 0)
+    transfer_fail (&t, errno, true);
+
+  pthread_mutex_destroy (&t.mutex);
+  if (t.err)
+    {
+      unlink (path);
+      *local = t.err_local;
+      errno = t.err;
+      return -1;
+    }
+
+  *total = t.size;
+  return 0;
+}
+
+int
+transfer_upload (Context *ctx, const char *path, const char *uri,
+		 unsigned streams, size_t chunk, off_t *total, bool *local)
+{
+  SMBCCTX *c = ctx->context;
+  struct transfer t;
+  struct stat st;
+  SMBCFILE *file;
+
+  *local = true;
+  memset (&t, 0, sizeof (t));
+  t.fd = open (path, O_RDONLY);
+  if (t.fd < 0)
+    return -1;
+
+  if (fstat (t.fd, &st) < 0)
+    {
+      int err = errno;
+      close (t.fd);
+      errno = err;
+      return -1;
+    }
+
+  if (S_ISDIR (st.st_mode))
+    {
+      close (t.fd);
+      errno = EISDIR;
+      return -1;
+    }
+
+  t.ctx = ctx;
+  t.uri = uri;
+  t.size = st.st_size;
+  t.chunk = chunk;
+  t.mode = TRANSFER_UPLOAD;
+
+  /* Create (or truncate) the file and extend it to its final size so
+     the ranges can be written in any order.  Not every server lets
+     a file be extended that way, so a failure there is not fatal:
+     writing past the end extends it anyway. */
+  *local = false;
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  file = (*smbc_getFunctionCreat (c)) (c, uri, 0666);
+  if (file)
+    {
+      if (t.size > 0)
+	(*smbc_getFunctionFtruncate (c)) (c, file, t.size);
+
+      (*smbc_getFunctionClose (c)) (c, file);
+    }
+
+  PyThread_release_lock (ctx->lock);
+  if (file == NULL)
+    {
+      close (t.fd);
+      return -1;
+    }
+
+  pthread_mutex_init (&t.mutex, NULL);
+  transfer_run (&t, streams);
+  close (t.fd);
+  pthread_mutex_destroy (&t.mutex);
+  if (t.err)
+    {
+      PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+      (*smbc_getFunctionUnlink (c)) (c, uri);
+      PyThread_release_lock (ctx->lock);
+      *local = t.err_local;
+      errno = t.err;
+      return -1;
+    }
+
+  *total = t.size;
+  return 0;
+}
+
+#if SMBCLIENT_VERSION >= 201 /* 0.2.1 or newer */
+/* Whether two smb:// URIs name the same server. */
+static bool
+transfer_same_server (const char *a, const char *b)
+{
+  const char *pa, *pb;
+  size_t la, lb;
+
+  if (strncasecmp (a, "smb://", 6) || strncasecmp (b, "smb://", 6))
+    return false;
+
+  /* Skip any credentials; compare the host part. */
+  a += 6;
+  b += 6;
+  la = strcspn (a, "/");
+  lb = strcspn (b, "/");
+  pa = memchr (a, '@', la);
+  pb = memchr (b, '@', lb);
+  if (pa)
+    {
+      la -= pa + 1 - a;
+      a = pa + 1;
+    }
+
+  if (pb)
+    {
+      lb -= pb + 1 - b;
+      b = pb + 1;
+    }
+
+  return la == lb && strncasecmp (a, b, la) == 0;
+}
+#endif
+
+/* Copy through the client: the fallback when splice cannot be used. */
+static off_t
+copy_loop (SMBCCTX *c, SMBCFILE *sf, SMBCFILE *df,
+	   transfer_progress_fn progress, void *priv)
+{
+  smbc_read_fn fn_read = smbc_getFunctionRead (c);
+  smbc_write_fn fn_write = smbc_getFunctionWrite (c);
+  off_t total = 0;
+  char *buf;
+
+  buf = malloc (TRANSFER_IO_SIZE);
+  if (buf == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  for (;;)
+    {
+      ssize_t done = 0;
+      ssize_t len;
+
+      errno = 0;
+      len = (*fn_read) (c, sf, buf, TRANSFER_IO_SIZE);
+      if (len <= 0)
+	{
+	  free (buf);
+	  return len < 0 ? -1 : total;
+	}
+
+      while (done < len)
+	{
+	  ssize_t n;
+
+	  errno = 0;
+	  n = (*fn_write) (c, df, buf + done, len - done);
+	  if (n <= 0)
+	    {
+	      if (n == 0)
+		errno = EIO;
+
+	      free (buf);
+	      return -1;
+	    }
+
+	  done += n;
+	}
+
+      total += len;
+      if (progress && !(*progress) (total, priv))
+	{
+	  free (buf);
+	  errno = ECANCELED;
+	  return -1;
+	}
+    }
+}
+
+int
+transfer_copy_on (SMBCCTX *c, const char *src, const char *dst,
+		  transfer_progress_fn progress, void *priv, off_t *total)
+{
+  SMBCFILE *sf = NULL;
+  SMBCFILE *df = NULL;
+  off_t copied = -1;
+  struct stat st;
+  int err = 0;
+
+  errno = 0;
+  sf = (*smbc_getFunctionOpen (c)) (c, src, O_RDONLY, 0);
+  if (sf == NULL || (*smbc_getFunctionFstat (c)) (c, sf, &st) < 0)
+    goto out;
+
+  if (S_ISDIR (st.st_mode))
+    {
+      errno = EISDIR;
+      goto out;
+    }
+
+  errno = 0;
+  df = (*smbc_getFunctionOpen (c)) (c, dst, O_WRONLY | O_CREAT | O_TRUNC,
+				    0666);
+  if (df == NULL)
+    goto out;
+
+#if SMBCLIENT_VERSION >= 201 /* 0.2.1 or newer */
+  if (transfer_same_server (src, dst))
+    {
+      smbc_splice_fn fn = smbc_getFunctionSplice (c);
+
+      debugprintf ("-> transfer_copy() splice\n");
+      errno = 0;
+      copied = fn ? (*fn) (c, sf, df, st.st_size, progress, priv) : -1;
+      if (copied < 0 && (fn == NULL || errno == ENOSYS ||
+			 errno == EOPNOTSUPP || errno == EXDEV ||
+			 errno == EINVAL))
+	{
+	  /* The server cannot do it; start again the slow way. */
+	  debugprintf ("-- transfer_copy() splice failed, errno %d\n", errno);
+	  (*smbc_getFunctionLseek (c)) (c, sf, 0, SEEK_SET);
+	  (*smbc_getFunctionLseek (c)) (c, df, 0, SEEK_SET);
+	}
+      else
+	goto out;
+    }
+#endif
+
+  copied = copy_loop (c, sf, df, progress, priv);
+
+ out:
+  err = errno;
+  if (df && (*smbc_getFunctionClose (c)) (c, df) < 0 && copied >= 0)
+    {
+      err = errno;
+      copied = -1;
+    }
+
+  if (sf)
+    (*smbc_getFunctionClose (c)) (c, sf);
+
+  if (copied < 0 && df)
+    (*smbc_getFunctionUnlink (c)) (c, dst);
+
+  if (copied < 0)
+    {
+      errno = err ? err : EIO;
+      return -1;
+    }
+
+  *total = copied;
+  return 0;
+}
+
+/*
+  The copy runs over a cloned connection, so a long copy does not tie
+  up the Context and the progress callback is free to use it.
+*/
+int
+transfer_copy (Context *ctx, const char *src, const char *dst,
+	       transfer_progress_fn progress, void *priv, off_t *total)
+{
+  SMBCCTX *c;
+  int ret;
+  int err;
+
+  c = context_clone (ctx);
+  if (c == NULL)
+    return -1;
+
+  ret = transfer_copy_on (c, src, dst, progress, priv, total);
+  err = errno;
+  context_clone_free (c);
+  errno = err;
+  return ret;
+}
+
+int
+transfer_sync (Context *ctx, const char *path, const char *uri,
+	       unsigned streams, size_t block, off_t *written, bool *local)
+{
+  SMBCCTX *c = ctx->context;
+  struct transfer t;
+  struct stat st;
+  SMBCFILE *file;
+  int ret = 0;
+
+  *local = true;
+  memset (&t, 0, sizeof (t));
+  t.fd = open (path, O_RDONLY);
+  if (t.fd < 0)
+    return -1;
+
+  if (fstat (t.fd, &st) < 0)
+    {
+      int err = errno;
+      close (t.fd);
+      errno = err;
+      return -1;
+    }
+
+  if (S_ISDIR (st.st_mode))
+    {
+      close (t.fd);
+      errno = EISDIR;
+      return -1;
+    }
+
+  t.ctx = ctx;
+  t.uri = uri;
+  t.mode = TRANSFER_SYNC;
+  t.size = st.st_size;
+  t.block = block;
+  t.chunk = block * (TRANSFER_DEFAULT_CHUNK / TRANSFER_IO_SIZE);
+
+  /* Find out how much there is to compare, creating the file if need
+     be, then give it its final size.  Growing it is not essential
+     (writes extend it) but shrinking it is. */
+  *local = false;
+  PyThread_acquire_lock (ctx->lock, WAIT_LOCK);
+  errno = 0;
+  file = (*smbc_getFunctionOpen (c)) (c, uri, O_RDWR | O_CREAT, 0666);
+  if (file)
+    {
+      int err;
+
+      ret = (*smbc_getFunctionFstat (c)) (c, file, &st);
+      if (ret == 0)
+	{
+	  t.remote_size = st.st_size;
+	  if (t.remote_size != t.size &&
+	      (*smbc_getFunctionFtruncate (c)) (c, file, t.size) < 0 &&
+	      t.remote_size > t.size)
+	    ret = -1;
+	}
+
+      err = errno;
+      (*smbc_getFunctionClose (c)) (c, file);
+      errno = err;
+    }
+
+  PyThread_release_lock (ctx->lock);
+  if (file == NULL || ret < 0)
+    {
+      close (t.fd);
+      return -1;
+    }
+
+  if (t.remote_size > t.size)
+    t.remote_size = t.size;
+
+  pthread_mutex_init (&t.mutex, NULL);
+  transfer_run (&t, streams);
+  close (t.fd);
+  pthread_mutex_destroy (&t.mutex);
+  if (t.err)
+    {
+      *local = t.err_local;
+      errno = t.err;
+      return -1;
+    }
+
+  *written = t.written;
+  return 0;
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef HAVE_TRANSFER_H
+#define HAVE_TRANSFER_H
+
+/*
+  Bulk transfers between a share and the local file system, split
+  into chunk-sized ranges which 'streams' worker threads take turns
+  to move, each over its own connection (see context_clone).  They
+  return 0 or -1 with errno set; *local is set if the error concerns
+  the local file.  Must be called without the GIL.
+*/
+#define TRANSFER_DEFAULT_STREAMS 4
+#define TRANSFER_DEFAULT_CHUNK (8 * 1024 * 1024)
+#define TRANSFER_DEFAULT_BLOCK (128 * 1024)
+#define TRANSFER_IO_SIZE (1024 * 1024)
+
+extern int transfer_download (Context *ctx, const char *uri,
+			      const char *path, unsigned streams,
+			      size_t chunk, off_t *total, bool *local);
+extern int transfer_upload (Context *ctx, const char *path, const char *uri,
+			    unsigned streams, size_t chunk, off_t *total,
+			    bool *local);
+
+/*
+  Bring a remote file up to date with a local one by comparing them
+  block by block and rewriting only the blocks that differ; *written
+  is the number of bytes rewritten.
+*/
+extern int transfer_sync (Context *ctx, const char *path, const char *uri,
+			  unsigned streams, size_t block, off_t *written,
+			  bool *local);
+
+/*
+  Progress callback for transfer_copy: given the number of bytes
+  copied so far, it returns zero to cancel the copy.
+*/
+typedef int (*transfer_progress_fn) (off_t done, void *priv);
+
+extern int transfer_copy (Context *ctx, const char *src, const char *dst,
+			  transfer_progress_fn progress, void *priv,
+			  off_t *total);
+
+/* The same, over a connection the caller already has. */
+extern int transfer_copy_on (SMBCCTX *c, const char *src, const char *dst,
+			     transfer_progress_fn progress, void *priv,
+			     off_t *total);
+
+#endif /* HAVE_TRANSFER_H */
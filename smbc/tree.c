@@ -0,0 +1,2060 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "smbcdirent.h"
+#include "transfer.h"
+#include "tree.h"
+
+//////////
+// Tree //
+//////////
+
+/*
+  Each worker keeps a stack of directories still to be listed.  It
+  pushes the subdirectories it finds onto its own stack and pops from
+  the top, so that it works depth first, close to what it has just
+  listed; when its own stack is empty it steals the oldest directory
+  from another worker's.
+
+  Finished listings are queued for the iterating thread, which turns
+  them into Python objects.  At most TREE_MAX_READY listings per worker
+  are held there, so the workers cannot run far ahead of it.
+
+  'outstanding' counts the directories queued, being listed, or listed
+  but not yet consumed.  The walk is over when it drops to zero.
+
+  Removing a tree (TREE_REMOVE) works bottom up instead.  Each listed
+  directory stays in memory, with a count of the work still pending
+  below it: its subdirectories, and the batches of up to TREE_BATCH
+  entries that the workers remove.  When the count drops to zero the
+  directory itself is removed, and its parent's count drops in turn.
+  Only errors are queued for the calling thread then.
+
+  Copying a tree (TREE_COPY) is scheduled the same way: a directory is
+  created before it is listed, files are copied in batches of up to
+  TREE_BATCH files or TRANSFER_DEFAULT_CHUNK bytes, and a directory's
+  times are set once everything in it has been copied.  Either side
+  may be local, in which case it is reached with plain system calls.
+*/
+
+#define TREE_MAX_READY 4
+#define TREE_BATCH 16
+
+/* Files this big are moved in ranges, in parallel (see transfer.h). */
+#define TREE_BIG_FILE (2 * TRANSFER_DEFAULT_CHUNK)
+
+#define TREE_ATTR_DIRECTORY 0x10
+#define TREE_ATTR_REPARSE_POINT 0x400
+
+enum
+  {
+    TREE_WALK,
+    TREE_REMOVE,
+    TREE_COPY
+  };
+
+enum
+  {
+    TREE_SKIP_LINKS,		/* enter directories, but not links to them */
+    TREE_FOLLOW_LINKS,		/* enter every directory */
+    TREE_FOLLOW_CALLER		/* the iterating thread decides */
+  };
+
+struct tree_entry
+{
+  size_t name;			/* offset into the listing's names */
+  unsigned int smbc_type;
+  bool isdir;
+  bool islink;
+  bool has_info;
+  bool has_st;
+  struct libsmb_file_info info;
+  struct stat st;
+};
+
+struct tree_listing
+{
+  struct tree_listing *next;
+  char *uri;
+  int err;
+  bool err_dst;			/* TREE_COPY: err concerns dst */
+
+  /* TREE_COPY: where the directory goes, and the times to give it. */
+  char *dst;
+  bool has_times;
+  struct timespec atime;
+  struct timespec mtime;
+
+  /* TREE_REMOVE: a batch is entries [first, last) of its parent. */
+  struct tree_listing *parent;
+  size_t pending;
+  bool batch;
+  size_t first;
+  size_t last;
+
+  struct tree_entry *entries;
+  size_t n;
+  size_t cap;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+};
+
+struct tree_stack
+{
+  struct tree_listing **items;	/* [bottom, top) are queued */
+  size_t bottom;
+  size_t top;
+  size_t cap;
+};
+
+struct tree_worker
+{
+  struct tree *t;
+  unsigned index;
+  pthread_t thread;
+  bool started;
+};
+
+struct tree
+{
+  unsigned nworkers;
+  SMBCCTX **contexts;
+  struct tree_worker *workers;
+  struct tree_stack *stacks;
+  unsigned next_stack;		/* where the iterating thread pushes */
+  int mode;
+  int follow;
+  bool need_times;		/* stat entries listed without times */
+  Context *ctx;
+  bool src_remote;		/* TREE_COPY: which sides are on a share */
+  bool dst_remote;
+  off_t copied;			/* TREE_COPY: bytes */
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;	/* more work, or the walk is over */
+  pthread_cond_t ready_cond;	/* listing queued, or room for one */
+  struct tree_listing *ready_head;
+  struct tree_listing *ready_tail;
+  unsigned nready;
+  size_t outstanding;
+  int err;			/* fatal: ends the walk */
+  bool stop;
+};
+
+static void
+tree_listing_free (struct tree_listing *l)
+{
+  if (l == NULL)
+    return;
+
+  free (l->uri);
+  free (l->dst);
+  free (l->entries);
+  free (l->names);
+  free (l);
+}
+
+/* A new listing for name within parent, or for parent itself. */
+static struct tree_listing *
+tree_listing_new (const char *parent, const char *name)
+{
+  struct tree_listing *l;
+  size_t plen = strlen (parent);
+
+  l = calloc (1, sizeof (*l));
+  if (l == NULL)
+    return NULL;
+
+  l->pending = 1;
+  if (name == NULL)
+    l->uri = strdup (parent);
+  else
+    {
+      size_t nlen = strlen (name);
+      bool slash = plen > 0 && parent[plen - 1] == '/';
+
+      l->uri = malloc (plen + !slash + nlen + 1);
+      if (l->uri)
+	{
+	  memcpy (l->uri, parent, plen);
+	  if (!slash)
+	    l->uri[plen++] = '/';
+
+	  memcpy (l->uri + plen, name, nlen + 1);
+	}
+    }
+
+  if (l->uri == NULL)
+    {
+      free (l);
+      return NULL;
+    }
+
+  return l;
+}
+
+/* Add an entry named name; returns it, or NULL if out of memory. */
+static struct tree_entry *
+tree_listing_add (struct tree_listing *l, const char *name)
+{
+  size_t len = strlen (name) + 1;
+  struct tree_entry *e;
+
+  if (l->n == l->cap)
+    {
+      size_t cap = l->cap ? 2 * l->cap : 64;
+      void *p = realloc (l->entries, cap * sizeof (*l->entries));
+      if (p == NULL)
+	return NULL;
+
+      l->entries = p;
+      l->cap = cap;
+    }
+
+  if (l->names_len + len > l->names_cap)
+    {
+      size_t cap = l->names_cap ? 2 * l->names_cap : 4096;
+      void *p;
+
+      while (cap < l->names_len + len)
+	cap *= 2;
+
+      p = realloc (l->names, cap);
+      if (p == NULL)
+	return NULL;
+
+      l->names = p;
+      l->names_cap = cap;
+    }
+
+  e = &l->entries[l->n++];
+  memset (e, 0, sizeof (*e));
+  e->name = l->names_len;
+  memcpy (l->names + l->names_len, name, len);
+  l->names_len += len;
+  return e;
+}
+
+static bool
+tree_is_dots (const char *name)
+{
+  return name[0] == '.' &&
+    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/* Read the directory l->uri into l; sets l->err on failure. */
+static void
+tree_list (SMBCCTX *c, struct tree_listing *l)
+{
+  SMBCFILE *dir;
+
+  errno = 0;
+  dir = (*smbc_getFunctionOpendir (c)) (c, l->uri);
+  if (dir == NULL)
+    {
+      l->err = errno ? errno : EIO;
+      return;
+    }
+
+  for (;;)
+    {
+      struct tree_entry *e;
+#if SMBCLIENT_VERSION >= 400 /* 0.4.0 or newer */
+      const struct libsmb_file_info *info;
+#if SMBCLIENT_VERSION >= 600 /* 0.6.0 or newer */
+      struct stat st;
+#endif
+
+      errno = 0;
+#if SMBCLIENT_VERSION >= 600 /* 0.6.0 or newer */
+      info = (*smbc_getFunctionReaddirPlus2 (c)) (c, dir, &st);
+#else
+      info = (*smbc_getFunctionReaddirPlus (c)) (c, dir);
+#endif
+      if (info == NULL)
+	{
+	  l->err = errno;
+	  break;
+	}
+
+      if (tree_is_dots (info->name))
+	continue;
+
+      e = tree_listing_add (l, info->name);
+      if (e == NULL)
+	{
+	  l->err = ENOMEM;
+	  break;
+	}
+
+      e->has_info = true;
+      e->info = *info;
+      e->info.name = e->info.short_name = NULL;
+      e->isdir = (info->attrs & TREE_ATTR_DIRECTORY) != 0;
+#if SMBCLIENT_VERSION >= 600 /* 0.6.0 or newer */
+      e->has_st = true;
+      e->st = st;
+      e->isdir = S_ISDIR (st.st_mode);
+#endif
+      e->islink = (info->attrs & TREE_ATTR_REPARSE_POINT) != 0;
+      e->smbc_type = e->isdir ? SMBC_DIR : SMBC_FILE;
+#else
+      struct smbc_dirent *dirp;
+
+      errno = 0;
+      dirp = (*smbc_getFunctionReaddir (c)) (c, dir);
+      if (dirp == NULL)
+	{
+	  l->err = errno;
+	  break;
+	}
+
+      if (tree_is_dots (dirp->name))
+	continue;
+
+      e = tree_listing_add (l, dirp->name);
+      if (e == NULL)
+	{
+	  l->err = ENOMEM;
+	  break;
+	}
+
+      e->smbc_type = dirp->smbc_type;
+      e->isdir = dirp->smbc_type == SMBC_DIR;
+#endif
+    }
+
+  (*smbc_getFunctionClosedir (c)) (c, dir);
+}
+
+/*
+  Stat the entries of l that were listed without their size and times,
+  as they are by readdir.  An entry that cannot be statted is left
+  without them.
+*/
+static void
+tree_list_times (SMBCCTX *c, struct tree_listing *l)
+{
+  size_t i;
+
+  for (i = 0; i < l->n; i++)
+    {
+      struct tree_entry *e = &l->entries[i];
+      struct tree_listing *sub;
+
+      if (e->has_info || e->has_st)
+	continue;
+
+      sub = tree_listing_new (l->uri, l->names + e->name);
+      if (sub == NULL)
+	{
+	  l->err = ENOMEM;
+	  break;
+	}
+
+      errno = 0;
+      if ((*smbc_getFunctionStat (c)) (c, sub->uri, &e->st) == 0)
+	e->has_st = true;
+
+      tree_listing_free (sub);
+    }
+}
+
+/* Read the local directory l->uri into l; sets l->err on failure. */
+static void
+tree_list_local (struct tree_listing *l)
+{
+  struct dirent *de;
+  DIR *dir;
+
+  dir = opendir (l->uri);
+  if (dir == NULL)
+    {
+      l->err = errno;
+      return;
+    }
+
+  for (;;)
+    {
+      struct tree_entry *e;
+      struct stat st;
+      bool islink = false;
+
+      errno = 0;
+      de = readdir (dir);
+      if (de == NULL)
+	{
+	  l->err = errno;
+	  break;
+	}
+
+      if (tree_is_dots (de->d_name))
+	continue;
+
+      /* Links are followed to files, but not to directories. */
+      if (fstatat (dirfd (dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	continue;
+
+      if (S_ISLNK (st.st_mode))
+	{
+	  islink = true;
+	  if (fstatat (dirfd (dir), de->d_name, &st, 0) < 0)
+	    continue;
+	}
+
+      if (!S_ISDIR (st.st_mode) && !S_ISREG (st.st_mode))
+	continue;
+
+      e = tree_listing_add (l, de->d_name);
+      if (e == NULL)
+	{
+	  l->err = ENOMEM;
+	  break;
+	}
+
+      e->has_st = true;
+      e->st = st;
+      e->isdir = S_ISDIR (st.st_mode);
+      e->islink = islink;
+      e->smbc_type = e->isdir ? SMBC_DIR : SMBC_FILE;
+    }
+
+  closedir (dir);
+}
+
+/* The size and times of e, if its listing gave them. */
+static bool
+tree_entry_times (const struct tree_entry *e, off_t *size,
+		  struct timespec *atime, struct timespec *mtime)
+{
+  if (e->has_st)
+    {
+      *size = e->st.st_size;
+      *atime = e->st.st_atim;
+      *mtime = e->st.st_mtim;
+      return true;
+    }
+
+  if (e->has_info)
+    {
+      *size = e->info.size;
+      *atime = e->info.atime_ts;
+      *mtime = e->info.mtime_ts;
+      return true;
+    }
+
+  return false;
+}
+
+/* Queue l on stack k.  Mutex held. */
+static int
+tree_push (struct tree *t, unsigned k, struct tree_listing *l)
+{
+  struct tree_stack *s = &t->stacks[k];
+
+  if (s->top == s->cap)
+    {
+      if (s->bottom > 0)
+	{
+	  memmove (s->items, s->items + s->bottom,
+		   (s->top - s->bottom) * sizeof (*s->items));
+	  s->top -= s->bottom;
+	  s->bottom = 0;
+	}
+      else
+	{
+	  size_t cap = s->cap ? 2 * s->cap : 64;
+	  void *p = realloc (s->items, cap * sizeof (*s->items));
+	  if (p == NULL)
+	    return -1;
+
+	  s->items = p;
+	  s->cap = cap;
+	}
+    }
+
+  s->items[s->top++] = l;
+  t->outstanding++;
+  pthread_cond_broadcast (&t->work_cond);
+  return 0;
+}
+
+/* Next directory for worker k: its own newest, or another's oldest. */
+static struct tree_listing *
+tree_take (struct tree *t, unsigned k)
+{
+  struct tree_stack *s = &t->stacks[k];
+  unsigned i;
+
+  if (s->top > s->bottom)
+    return s->items[--s->top];
+
+  for (i = 1; i < t->nworkers; i++)
+    {
+      s = &t->stacks[(k + i) % t->nworkers];
+      if (s->top > s->bottom)
+	return s->items[s->bottom++];
+    }
+
+  return NULL;
+}
+
+/* Queue the subdirectories of l on stack k.  Mutex held. */
+static void
+tree_descend (struct tree *t, unsigned k, struct tree_listing *l)
+{
+  size_t i;
+
+  for (i = 0; i < l->n; i++)
+    {
+      struct tree_entry *e = &l->entries[i];
+      struct tree_listing *sub;
+
+      if (!e->isdir || (e->islink && t->follow == TREE_SKIP_LINKS))
+	continue;
+
+      sub = tree_listing_new (l->uri, l->names + e->name);
+      if (sub == NULL || tree_push (t, k, sub) < 0)
+	{
+	  tree_listing_free (sub);
+	  t->err = ENOMEM;
+	  pthread_cond_broadcast (&t->ready_cond);
+	  return;
+	}
+    }
+}
+
+/*
+  Queue the error err for uri, for the calling thread to report.
+  Mutex held.
+*/
+static void
+tree_report (struct tree *t, const char *uri, int err)
+{
+  struct tree_listing *r;
+
+  if (t->stop)
+    return;
+
+  r = tree_listing_new (uri, NULL);
+  if (r == NULL)
+    {
+      t->err = ENOMEM;
+      pthread_cond_broadcast (&t->ready_cond);
+      return;
+    }
+
+  r->err = err ? err : EIO;
+  while (!t->stop && t->nready >= TREE_MAX_READY * t->nworkers)
+    pthread_cond_wait (&t->ready_cond, &t->mutex);
+
+  if (t->stop)
+    {
+      tree_listing_free (r);
+      return;
+    }
+
+  if (t->ready_tail)
+    t->ready_tail->next = r;
+  else
+    t->ready_head = r;
+
+  t->ready_tail = r;
+  t->nready++;
+  pthread_cond_broadcast (&t->ready_cond);
+}
+
+static int tree_set_times (SMBCCTX *c, const char *path,
+			   const struct timespec *atime,
+			   const struct timespec *mtime);
+
+/*
+  One part of the work for l is done.  Free whatever that completes,
+  finishing each completed directory that could be listed (removing it
+  for TREE_REMOVE, setting its times for TREE_COPY) unless the walk is
+  being abandoned.  Mutex held, but dropped while finishing.
+*/
+static void
+tree_finish (struct tree *t, SMBCCTX *c, struct tree_listing *l)
+{
+  while (l && --l->pending == 0)
+    {
+      struct tree_listing *parent = l->parent;
+
+      if (t->mode != TREE_WALK && !l->batch && l->err == 0 &&
+	  !t->stop && t->err == 0)
+	{
+	  const char *path = l->uri;
+	  int ret = 0;
+	  int err;
+
+	  pthread_mutex_unlock (&t->mutex);
+	  errno = 0;
+	  if (t->mode == TREE_REMOVE)
+	    ret = (*smbc_getFunctionRmdir (c)) (c, l->uri);
+	  else if (l->has_times)
+	    {
+	      path = l->dst;
+	      ret = tree_set_times (t->dst_remote ? c : NULL, l->dst,
+				    &l->atime, &l->mtime);
+	    }
+
+	  err = errno;
+	  pthread_mutex_lock (&t->mutex);
+	  if (ret < 0)
+	    tree_report (t, path, err);
+	}
+
+      tree_listing_free (l);
+      t->outstanding--;
+      l = parent;
+    }
+
+  if (t->outstanding == 0)
+    {
+      pthread_cond_broadcast (&t->work_cond);
+      pthread_cond_broadcast (&t->ready_cond);
+    }
+}
+
+/* Queue a batch of [first, last) of dir on stack k.  Mutex held. */
+static int
+tree_push_batch (struct tree *t, unsigned k, struct tree_listing *dir,
+		 size_t first, size_t last)
+{
+  struct tree_listing *b = calloc (1, sizeof (*b));
+
+  if (b == NULL || tree_push (t, k, b) < 0)
+    {
+      free (b);
+      return -1;
+    }
+
+  b->pending = 1;
+  b->batch = true;
+  b->parent = dir;
+  b->first = first;
+  b->last = last;
+  dir->pending++;
+  return 0;
+}
+
+/*
+  Queue the work on what l contains: its subdirectories, to be listed
+  in turn, and batches of everything else.  Links to directories are
+  not entered.  Mutex held.
+*/
+static int
+tree_schedule (struct tree *t, unsigned k, struct tree_listing *l)
+{
+  size_t first = 0;
+  size_t count = 0;
+  off_t bytes = 0;
+  size_t i;
+
+  for (i = 0; i < l->n; i++)
+    {
+      struct tree_entry *e = &l->entries[i];
+      struct timespec atime, mtime;
+      off_t size = 0;
+
+      if (e->isdir && !e->islink)
+	{
+	  const char *name = l->names + e->name;
+	  struct tree_listing *sub = tree_listing_new (l->uri, name);
+
+	  if (sub && t->mode == TREE_COPY)
+	    {
+	      struct tree_listing *dst = tree_listing_new (l->dst, name);
+
+	      if (dst)
+		{
+		  sub->dst = dst->uri;
+		  dst->uri = NULL;
+		}
+
+	      tree_listing_free (dst);
+	      sub->has_times = tree_entry_times (e, &size, &sub->atime,
+						 &sub->mtime);
+	      if (sub->dst == NULL)
+		{
+		  tree_listing_free (sub);
+		  sub = NULL;
+		}
+	    }
+
+	  if (sub == NULL || tree_push (t, k, sub) < 0)
+	    {
+	      tree_listing_free (sub);
+	      return -1;
+	    }
+
+	  sub->parent = l;
+	  l->pending++;
+	  continue;
+	}
+
+      if (t->mode == TREE_COPY && e->isdir)
+	continue;
+
+      if (count++ == 0)
+	first = i;
+
+      if (t->mode == TREE_COPY &&
+	  tree_entry_times (e, &size, &atime, &mtime))
+	bytes += size;
+
+      if (count == TREE_BATCH || bytes >= TRANSFER_DEFAULT_CHUNK)
+	{
+	  if (tree_push_batch (t, k, l, first, i + 1) < 0)
+	    return -1;
+
+	  count = 0;
+	  bytes = 0;
+	}
+    }
+
+  if (count > 0 && tree_push_batch (t, k, l, first, l->n) < 0)
+    return -1;
+
+  return 0;
+}
+
+/* Remove the entries of batch b.  Called without the mutex. */
+static void
+tree_remove_batch (struct tree *t, SMBCCTX *c, struct tree_listing *b)
+{
+  struct tree_listing *dir = b->parent;
+  size_t i;
+
+  for (i = b->first; i < b->last; i++)
+    {
+      struct tree_entry *e = &dir->entries[i];
+      struct tree_listing *target;
+      int ret = -1;
+      int err = ENOMEM;
+
+      if (e->isdir && !e->islink)
+	continue;
+
+      target = tree_listing_new (dir->uri, dir->names + e->name);
+      if (target)
+	{
+	  errno = 0;
+	  if (e->isdir)
+	    ret = (*smbc_getFunctionRmdir (c)) (c, target->uri);
+	  else
+	    ret = (*smbc_getFunctionUnlink (c)) (c, target->uri);
+
+	  err = errno;
+	}
+
+      if (ret < 0)
+	{
+	  pthread_mutex_lock (&t->mutex);
+	  if (target)
+	    tree_report (t, target->uri, err);
+	  else
+	    t->err = ENOMEM;
+
+	  pthread_mutex_unlock (&t->mutex);
+	}
+
+      tree_listing_free (target);
+    }
+}
+
+/*
+  One side of a copy: a share if c is set, otherwise the local file
+  system.  These set errno on failure.
+*/
+struct tree_file
+{
+  SMBCCTX *c;
+  SMBCFILE *f;
+  int fd;
+};
+
+static int
+tree_open (struct tree_file *tf, SMBCCTX *c, const char *path, int flags)
+{
+  tf->c = c;
+  tf->f = NULL;
+  tf->fd = -1;
+  errno = 0;
+  if (c)
+    tf->f = (*smbc_getFunctionOpen (c)) (c, path, flags, 0666);
+  else
+    tf->fd = open (path, flags | O_CLOEXEC, 0666);
+
+  return tf->f || tf->fd >= 0 ? 0 : -1;
+}
+
+static ssize_t
+tree_read (struct tree_file *tf, char *buf, size_t size)
+{
+  ssize_t len;
+
+  errno = 0;
+  if (tf->c)
+    return (*smbc_getFunctionRead (tf->c)) (tf->c, tf->f, buf, size);
+
+  do
+    len = read (tf->fd, buf, size);
+  while (len < 0 && errno == EINTR);
+  return len;
+}
+
+static int
+tree_write (struct tree_file *tf, const char *buf, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t len;
+
+      errno = 0;
+      if (tf->c)
+	len = (*smbc_getFunctionWrite (tf->c)) (tf->c, tf->f, buf, size);
+      else
+	len = write (tf->fd, buf, size);
+
+      if (len < 0 && errno == EINTR && !tf->c)
+	continue;
+
+      if (len <= 0)
+	{
+	  if (len == 0)
+	    errno = EIO;
+
+	  return -1;
+	}
+
+      buf += len;
+      size -= len;
+    }
+
+  return 0;
+}
+
+static int
+tree_close (struct tree_file *tf)
+{
+  errno = 0;
+  if (tf->c)
+    return tf->f ? (*smbc_getFunctionClose (tf->c)) (tf->c, tf->f) : 0;
+
+  return tf->fd >= 0 ? close (tf->fd) : 0;
+}
+
+static int
+tree_stat (SMBCCTX *c, const char *path, struct stat *st)
+{
+  errno = 0;
+  if (c)
+    return (*smbc_getFunctionStat (c)) (c, path, st);
+
+  return stat (path, st);
+}
+
+static int
+tree_mkdir (SMBCCTX *c, const char *path)
+{
+  errno = 0;
+  if (c)
+    return (*smbc_getFunctionMkdir (c)) (c, path, 0777);
+
+  return mkdir (path, 0777);
+}
+
+static int
+tree_unlink (SMBCCTX *c, const char *path)
+{
+  if (c)
+    return (*smbc_getFunctionUnlink (c)) (c, path);
+
+  return unlink (path);
+}
+
+static int
+tree_set_times (SMBCCTX *c, const char *path, const struct timespec *atime,
+		const struct timespec *mtime)
+{
+  errno = 0;
+  if (c)
+    {
+      struct timeval tv[2];
+
+      tv[0].tv_sec = atime->tv_sec;
+      tv[0].tv_usec = atime->tv_nsec / 1000;
+      tv[1].tv_sec = mtime->tv_sec;
+      tv[1].tv_usec = mtime->tv_nsec / 1000;
+      return (*smbc_getFunctionUtimes (c)) (c, path, tv);
+    }
+  else
+    {
+      struct timespec ts[2];
+
+      ts[0] = *atime;
+      ts[1] = *mtime;
+      return utimensat (AT_FDCWD, path, ts, 0);
+    }
+}
+
+/*
+  Copy src to dst through buf, whose size is TRANSFER_IO_SIZE.  Returns
+  the number of bytes copied, or -1 with errno set and *at_dst set if
+  the error concerns dst.
+*/
+static off_t
+tree_copy_file (struct tree *t, SMBCCTX *c, const char *src,
+		const char *dst, off_t size, char *buf, bool *at_dst)
+{
+  struct tree_file in, out;
+  off_t total = 0;
+  bool local = false;
+  int ret;
+  int err;
+
+  *at_dst = false;
+  if (t->src_remote && t->dst_remote)
+    {
+      /* Copied by the server itself where it can. */
+      ret = transfer_copy_on (c, src, dst, NULL, NULL, &total);
+      return ret < 0 ? -1 : total;
+    }
+
+  if (size >= TREE_BIG_FILE && t->src_remote)
+    {
+      ret = transfer_download (t->ctx, src, dst, TRANSFER_DEFAULT_STREAMS,
+			       TRANSFER_DEFAULT_CHUNK, &total, &local);
+      *at_dst = local;
+      return ret < 0 ? -1 : total;
+    }
+
+  if (size >= TREE_BIG_FILE && t->dst_remote)
+    {
+      ret = transfer_upload (t->ctx, src, dst, TRANSFER_DEFAULT_STREAMS,
+			     TRANSFER_DEFAULT_CHUNK, &total, &local);
+      *at_dst = !local;
+      return ret < 0 ? -1 : total;
+    }
+
+  if (tree_open (&in, t->src_remote ? c : NULL, src, O_RDONLY) < 0)
+    return -1;
+
+  if (tree_open (&out, t->dst_remote ? c : NULL, dst,
+		 O_WRONLY | O_CREAT | O_TRUNC) < 0)
+    {
+      err = errno;
+      tree_close (&in);
+      *at_dst = true;
+      errno = err;
+      return -1;
+    }
+
+  for (;;)
+    {
+      ssize_t len = tree_read (&in, buf, TRANSFER_IO_SIZE);
+
+      if (len <= 0)
+	{
+	  ret = len;
+	  break;
+	}
+
+      if (tree_write (&out, buf, len) < 0)
+	{
+	  *at_dst = true;
+	  ret = -1;
+	  break;
+	}
+
+      total += len;
+    }
+
+  err = errno;
+  if (tree_close (&out) < 0 && ret == 0)
+    {
+      err = errno;
+      *at_dst = true;
+      ret = -1;
+    }
+
+  tree_close (&in);
+  if (ret < 0)
+    {
+      tree_unlink (out.c, dst);
+      errno = err ? err : EIO;
+      return -1;
+    }
+
+  return total;
+}
+
+/* Copy the files of batch b.  Called without the mutex. */
+static void
+tree_copy_batch (struct tree *t, SMBCCTX *c, struct tree_listing *b)
+{
+  struct tree_listing *dir = b->parent;
+  off_t copied = 0;
+  char *buf;
+  size_t i;
+
+  buf = malloc (TRANSFER_IO_SIZE);
+  if (buf == NULL)
+    {
+      pthread_mutex_lock (&t->mutex);
+      t->err = ENOMEM;
+      pthread_cond_broadcast (&t->ready_cond);
+      pthread_mutex_unlock (&t->mutex);
+      return;
+    }
+
+  for (i = b->first; i < b->last; i++)
+    {
+      struct tree_entry *e = &dir->entries[i];
+      const char *name = dir->names + e->name;
+      struct tree_listing *src, *dst;
+      struct timespec atime = { 0 }, mtime = { 0 };
+      const char *failed = NULL;
+      off_t size = 0;
+      off_t len;
+      bool at_dst;
+      int err = ENOMEM;
+
+      if (e->isdir)
+	continue;
+
+      src = tree_listing_new (dir->uri, name);
+      dst = tree_listing_new (dir->dst, name);
+      if (src == NULL || dst == NULL)
+	failed = "";
+      else if (!tree_entry_times (e, &size, &atime, &mtime))
+	{
+	  struct stat st;
+
+	  if (tree_stat (t->src_remote ? c : NULL, src->uri, &st) < 0)
+	    {
+	      err = errno;
+	      failed = src->uri;
+	    }
+	  else
+	    {
+	      size = st.st_size;
+	      atime = st.st_atim;
+	      mtime = st.st_mtim;
+	    }
+	}
+
+      if (failed == NULL)
+	{
+	  len = tree_copy_file (t, c, src->uri, dst->uri, size, buf, &at_dst);
+	  if (len < 0)
+	    {
+	      err = errno;
+	      failed = at_dst ? dst->uri : src->uri;
+	    }
+	  else
+	    {
+	      copied += len;
+	      if (tree_set_times (t->dst_remote ? c : NULL, dst->uri,
+				  &atime, &mtime) < 0)
+		{
+		  err = errno;
+		  failed = dst->uri;
+		}
+	    }
+	}
+
+      if (failed)
+	{
+	  pthread_mutex_lock (&t->mutex);
+	  if (*failed)
+	    tree_report (t, failed, err);
+	  else
+	    {
+	      t->err = ENOMEM;
+	      pthread_cond_broadcast (&t->ready_cond);
+	    }
+
+	  pthread_mutex_unlock (&t->mutex);
+	}
+
+      tree_listing_free (src);
+      tree_listing_free (dst);
+    }
+
+  free (buf);
+  pthread_mutex_lock (&t->mutex);
+  t->copied += copied;
+  pthread_mutex_unlock (&t->mutex);
+}
+
+/*
+  Make the directory l->dst and list l->uri, setting l->err (and
+  l->err_dst) on failure.  Called without the mutex.
+*/
+static void
+tree_copy_dir (struct tree *t, SMBCCTX *c, struct tree_listing *l)
+{
+  SMBCCTX *sc = t->src_remote ? c : NULL;
+  SMBCCTX *dc = t->dst_remote ? c : NULL;
+
+  if (!l->has_times)
+    {
+      struct stat st;
+
+      if (tree_stat (sc, l->uri, &st) < 0)
+	{
+	  l->err = errno ? errno : EIO;
+	  return;
+	}
+
+      if (!S_ISDIR (st.st_mode))
+	{
+	  l->err = ENOTDIR;
+	  return;
+	}
+
+      l->has_times = true;
+      l->atime = st.st_atim;
+      l->mtime = st.st_mtim;
+    }
+
+  if (tree_mkdir (dc, l->dst) < 0 && errno != EEXIST)
+    {
+      l->err = errno ? errno : EIO;
+      l->err_dst = true;
+      return;
+    }
+
+  if (sc)
+    tree_list (c, l);
+  else
+    tree_list_local (l);
+}
+
+/*
+  Do l, a directory or a batch, for TREE_REMOVE or TREE_COPY.  Mutex
+  held.
+*/
+static void
+tree_process (struct tree *t, unsigned k, SMBCCTX *c, struct tree_listing *l)
+{
+  pthread_mutex_unlock (&t->mutex);
+  if (l->batch && t->mode == TREE_REMOVE)
+    tree_remove_batch (t, c, l);
+  else if (l->batch)
+    tree_copy_batch (t, c, l);
+  else if (t->mode == TREE_COPY)
+    tree_copy_dir (t, c, l);
+  else
+    tree_list (c, l);
+
+  pthread_mutex_lock (&t->mutex);
+  if (!l->batch)
+    {
+      if (l->err)
+	tree_report (t, l->err_dst ? l->dst : l->uri, l->err);
+      else if (tree_schedule (t, k, l) < 0)
+	{
+	  t->err = ENOMEM;
+	  pthread_cond_broadcast (&t->ready_cond);
+	}
+    }
+
+  tree_finish (t, c, l);
+}
+
+static void *
+tree_worker (void *arg)
+{
+  struct tree_worker *w = arg;
+  struct tree *t = w->t;
+  SMBCCTX *c = t->contexts[w->index];
+
+  pthread_mutex_lock (&t->mutex);
+  for (;;)
+    {
+      struct tree_listing *l = NULL;
+
+      while (!t->stop && t->err == 0 &&
+	     (l = tree_take (t, w->index)) == NULL && t->outstanding > 0)
+	pthread_cond_wait (&t->work_cond, &t->mutex);
+
+      if (l == NULL)
+	break;
+
+      if (t->mode != TREE_WALK)
+	{
+	  tree_process (t, w->index, c, l);
+	  continue;
+	}
+
+      pthread_mutex_unlock (&t->mutex);
+      tree_list (c, l);
+      if (t->need_times && l->err == 0)
+	tree_list_times (c, l);
+      pthread_mutex_lock (&t->mutex);
+
+      if (l->err == 0 && t->follow != TREE_FOLLOW_CALLER)
+	tree_descend (t, w->index, l);
+
+      while (!t->stop && t->nready >= TREE_MAX_READY * t->nworkers)
+	pthread_cond_wait (&t->ready_cond, &t->mutex);
+
+      if (t->stop)
+	{
+	  tree_listing_free (l);
+	  break;
+	}
+
+      if (t->ready_tail)
+	t->ready_tail->next = l;
+      else
+	t->ready_head = l;
+
+      t->ready_tail = l;
+      t->nready++;
+      pthread_cond_broadcast (&t->ready_cond);
+    }
+
+  pthread_mutex_unlock (&t->mutex);
+  return NULL;
+}
+
+static void
+tree_free (struct tree *t)
+{
+  unsigned i;
+
+  if (t == NULL)
+    return;
+
+  pthread_mutex_lock (&t->mutex);
+  t->stop = true;
+  pthread_cond_broadcast (&t->work_cond);
+  pthread_cond_broadcast (&t->ready_cond);
+  pthread_mutex_unlock (&t->mutex);
+
+  for (i = 0; i < t->nworkers; i++)
+    if (t->workers[i].started)
+      pthread_join (t->workers[i].thread, NULL);
+
+  /* Whatever is still queued is only released, not removed. */
+  for (i = 0; i < t->nworkers; i++)
+    {
+      struct tree_stack *s = &t->stacks[i];
+
+      while (s->top > s->bottom)
+	tree_finish (t, NULL, s->items[--s->top]);
+
+      free (s->items);
+      context_clone_free (t->contexts[i]);
+    }
+
+  while (t->ready_head)
+    {
+      struct tree_listing *l = t->ready_head;
+      t->ready_head = l->next;
+      tree_listing_free (l);
+    }
+
+  pthread_cond_destroy (&t->ready_cond);
+  pthread_cond_destroy (&t->work_cond);
+  pthread_mutex_destroy (&t->mutex);
+  free (t->stacks);
+  free (t->contexts);
+  free (t->workers);
+  free (t);
+}
+
+/*
+  Set up the workers' connections and start them on uri.  If
+  need_times, entries listed without their size and times are statted
+  for them.  Returns NULL with errno set on failure.  Called without
+  the GIL.
+*/
+static struct tree *
+tree_new (Context *ctx, const char *uri, const char *dst, unsigned nworkers,
+	  int mode, int follow, bool need_times)
+{
+  struct tree_listing *root;
+  struct tree *t;
+  unsigned i;
+  int err;
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL)
+    return NULL;
+
+  t->nworkers = nworkers;
+  t->mode = mode;
+  t->follow = follow;
+  t->need_times = need_times;
+  t->ctx = ctx;
+  t->src_remote = strncasecmp (uri, "smb://", 6) == 0;
+  t->dst_remote = dst && strncasecmp (dst, "smb://", 6) == 0;
+  t->contexts = calloc (nworkers, sizeof (*t->contexts));
+  t->workers = calloc (nworkers, sizeof (*t->workers));
+  t->stacks = calloc (nworkers, sizeof (*t->stacks));
+  pthread_mutex_init (&t->mutex, NULL);
+  pthread_cond_init (&t->work_cond, NULL);
+  pthread_cond_init (&t->ready_cond, NULL);
+  root = tree_listing_new (uri, NULL);
+  if (root && dst)
+    root->dst = strdup (dst);
+
+  if (t->contexts == NULL || t->workers == NULL || t->stacks == NULL ||
+      root == NULL || (dst && root->dst == NULL) || tree_push (t, 0, root) < 0)
+    {
+      tree_listing_free (root);
+      err = ENOMEM;
+      goto fail;
+    }
+
+  for (i = 0; i < nworkers; i++)
+    {
+      t->contexts[i] = context_clone (ctx);
+      if (t->contexts[i] == NULL)
+	{
+	  err = errno ? errno : ENOMEM;
+	  goto fail;
+	}
+    }
+
+  for (i = 0; i < nworkers; i++)
+    {
+      t->workers[i].t = t;
+      t->workers[i].index = i;
+      if (pthread_create (&t->workers[i].thread, NULL, tree_worker,
+			  &t->workers[i]) != 0)
+	{
+	  err = EAGAIN;
+	  goto fail;
+	}
+
+      t->workers[i].started = true;
+    }
+
+  debugprintf ("%p tree_new(\"%s\", %u)\n", t, uri, nworkers);
+  return t;
+
+ fail:
+  if (t->contexts && t->workers && t->stacks)
+    tree_free (t);
+  else
+    {
+      pthread_cond_destroy (&t->ready_cond);
+      pthread_cond_destroy (&t->work_cond);
+      pthread_mutex_destroy (&t->mutex);
+      free (t->contexts);
+      free (t->workers);
+      free (t->stacks);
+      free (t);
+    }
+
+  errno = err;
+  return NULL;
+}
+
+/*
+  Wait for the next listing.  Returns NULL at the end of the walk, or
+  with *err set if the walk failed.  Called without the GIL.
+*/
+static struct tree_listing *
+tree_next (struct tree *t, int *err)
+{
+  struct tree_listing *l;
+
+  pthread_mutex_lock (&t->mutex);
+  while (t->ready_head == NULL && t->outstanding > 0 && t->err == 0)
+    pthread_cond_wait (&t->ready_cond, &t->mutex);
+
+  l = t->ready_head;
+  *err = t->err;
+  if (*err)
+    l = NULL;
+  else if (l)
+    {
+      t->ready_head = l->next;
+      if (t->ready_head == NULL)
+	t->ready_tail = NULL;
+
+      l->next = NULL;
+      t->nready--;
+      pthread_cond_broadcast (&t->ready_cond);
+    }
+
+  pthread_mutex_unlock (&t->mutex);
+  return l;
+}
+
+/* The iterating thread is finished with l. */
+static void
+tree_done (struct tree *t, struct tree_listing *l)
+{
+  pthread_mutex_lock (&t->mutex);
+  if (--t->outstanding == 0)
+    pthread_cond_broadcast (&t->work_cond);
+  pthread_mutex_unlock (&t->mutex);
+  tree_listing_free (l);
+}
+
+/* The exception for err, with uri as its filename. */
+static PyObject *
+tree_exception (int err, const char *uri)
+{
+  PyObject *value = pysmbc_ErrorFromErrno (err);
+  PyObject *filename;
+
+  filename = PyUnicode_DecodeUTF8 (uri, strlen (uri), "replace");
+  if (filename == NULL ||
+      PyObject_SetAttrString (value, "filename", filename) < 0)
+    PyErr_Clear ();
+
+  Py_XDECREF (filename);
+  return value;
+}
+
+/* Raise the exception for err, with uri as its filename. */
+static void
+tree_raise (int err, const char *uri)
+{
+  PyObject *value = tree_exception (err, uri);
+
+  if (value)
+    {
+      PyErr_SetObject ((PyObject *) Py_TYPE (value), value);
+      Py_DECREF (value);
+    }
+}
+
+/*
+  Run a TREE_REMOVE or TREE_COPY to the end.  Only errors come back
+  from the workers: each is passed to on_error, or, if that is NULL,
+  raised, which stops the workers.  Returns -1 if an exception was
+  raised.
+*/
+static int
+tree_run (Context *ctx, const char *uri, const char *dst, unsigned workers,
+	  int mode, PyObject *on_error, off_t *copied)
+{
+  struct tree *t;
+  struct tree_listing *l;
+  int err = 0;
+
+  Py_BEGIN_ALLOW_THREADS
+  t = tree_new (ctx, uri, dst, workers, mode, TREE_SKIP_LINKS, false);
+  Py_END_ALLOW_THREADS
+  if (t == NULL)
+    {
+      pysmbc_SetFromErrno ();
+      return -1;
+    }
+
+  for (;;)
+    {
+      PyObject *exc;
+      PyObject *result;
+
+      Py_BEGIN_ALLOW_THREADS
+      l = tree_next (t, &err);
+      Py_END_ALLOW_THREADS
+      if (err)
+	{
+	  errno = err;
+	  pysmbc_SetFromErrno ();
+	  break;
+	}
+
+      if (l == NULL)
+	break;
+
+      if (on_error == NULL)
+	{
+	  tree_raise (l->err, l->uri);
+	  tree_listing_free (l);
+	  break;
+	}
+
+      exc = tree_exception (l->err, l->uri);
+      result = NULL;
+      if (exc)
+	{
+	  result = PyObject_CallFunction (on_error, "(sO)", l->uri, exc);
+	  Py_DECREF (exc);
+	}
+
+      tree_listing_free (l);
+      if (result == NULL)
+	break;
+
+      Py_DECREF (result);
+    }
+
+  *copied = t->copied;
+  Py_BEGIN_ALLOW_THREADS
+  tree_free (t);
+  Py_END_ALLOW_THREADS
+  return PyErr_Occurred () ? -1 : 0;
+}
+
+static int
+tree_check_on_error (PyObject **on_error)
+{
+  if (*on_error == Py_None)
+    *on_error = NULL;
+  else if (!PyCallable_Check (*on_error))
+    {
+      PyErr_SetString (PyExc_TypeError, "on_error must be callable");
+      return -1;
+    }
+
+  return 0;
+}
+
+PyObject *
+tree_rmtree (Context *ctx, const char *uri, unsigned workers,
+	     PyObject *on_error)
+{
+  off_t copied;
+
+  if (tree_check_on_error (&on_error) < 0 ||
+      tree_run (ctx, uri, NULL, workers, TREE_REMOVE, on_error, &copied) < 0)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+PyObject *
+tree_copytree (Context *ctx, const char *src, const char *dst,
+	       unsigned workers, PyObject *on_error)
+{
+  off_t copied;
+
+  if (tree_check_on_error (&on_error) < 0 ||
+      tree_run (ctx, src, dst, workers, TREE_COPY, on_error, &copied) < 0)
+    return NULL;
+
+  return PyLong_FromLongLong (copied);
+}
+
+/*
+  Pass l to visit, and queue the subdirectories it wants.  Returns -1
+  if it raised.
+*/
+static int
+tree_visit_listing (struct tree *t, struct tree_listing *l,
+		    tree_visit_fn visit, void *priv)
+{
+  struct tree_item *items = NULL;
+  bool *enter = NULL;
+  size_t i;
+  int ret = 0;
+
+  if (l->n > 0)
+    {
+      items = calloc (l->n, sizeof (*items));
+      enter = calloc (l->n, sizeof (*enter));
+      if (items == NULL || enter == NULL)
+	{
+	  free (items);
+	  free (enter);
+	  PyErr_NoMemory ();
+	  return -1;
+	}
+    }
+
+  for (i = 0; i < l->n; i++)
+    {
+      struct tree_entry *e = &l->entries[i];
+      struct timespec atime;
+
+      items[i].name = l->names + e->name;
+      items[i].isdir = e->isdir;
+      items[i].islink = e->islink;
+      items[i].has_times = tree_entry_times (e, &items[i].size, &atime,
+					     &items[i].mtime);
+    }
+
+  if ((*visit) (priv, l->uri, l->err, items, l->n, enter) < 0)
+    ret = -1;
+
+  for (i = 0; ret == 0 && i < l->n; i++)
+    {
+      struct tree_listing *sub;
+
+      if (!enter[i])
+	continue;
+
+      sub = tree_listing_new (l->uri, items[i].name);
+      pthread_mutex_lock (&t->mutex);
+      if (sub == NULL || tree_push (t, t->next_stack++ % t->nworkers, sub) < 0)
+	{
+	  tree_listing_free (sub);
+	  PyErr_NoMemory ();
+	  ret = -1;
+	}
+
+      pthread_mutex_unlock (&t->mutex);
+    }
+
+  free (items);
+  free (enter);
+  return ret;
+}
+
+int
+tree_visit (Context *ctx, const char *uri, unsigned workers,
+	    PyObject *on_error, tree_visit_fn visit, void *priv)
+{
+  struct tree *t;
+  struct tree_listing *l;
+  int err = 0;
+
+  if (tree_check_on_error (&on_error) < 0)
+    return -1;
+
+  Py_BEGIN_ALLOW_THREADS
+  t = tree_new (ctx, uri, NULL, workers, TREE_WALK, TREE_FOLLOW_CALLER,
+		true);
+  Py_END_ALLOW_THREADS
+  if (t == NULL)
+    {
+      pysmbc_SetFromErrno ();
+      return -1;
+    }
+
+  for (;;)
+    {
+      PyObject *exc;
+      PyObject *result;
+
+      Py_BEGIN_ALLOW_THREADS
+      l = tree_next (t, &err);
+      Py_END_ALLOW_THREADS
+      if (err)
+	{
+	  errno = err;
+	  pysmbc_SetFromErrno ();
+	  break;
+	}
+
+      if (l == NULL)
+	break;
+
+      if (tree_visit_listing (t, l, visit, priv) < 0)
+	{
+	  tree_done (t, l);
+	  break;
+	}
+
+      if (l->err == 0)
+	{
+	  tree_done (t, l);
+	  continue;
+	}
+
+      if (on_error == NULL)
+	{
+	  tree_raise (l->err, l->uri);
+	  tree_done (t, l);
+	  break;
+	}
+
+      exc = tree_exception (l->err, l->uri);
+      result = NULL;
+      if (exc)
+	{
+	  result = PyObject_CallFunction (on_error, "(sO)", l->uri, exc);
+	  Py_DECREF (exc);
+	}
+
+      tree_done (t, l);
+      if (result == NULL)
+	break;
+
+      Py_DECREF (result);
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  tree_free (t);
+  Py_END_ALLOW_THREADS
+  return PyErr_Occurred () ? -1 : 0;
+}
+
+//////////
+// Walk //
+//////////
+
+typedef struct
+{
+  PyObject_HEAD
+  Context *context;
+  PyObject *follow;		/* callable, or NULL */
+  PyObject *onerror;		/* callable, or NULL */
+  struct tree *tree;
+} Walk;
+
+static PyObject *
+walk_decode (const char *s)
+{
+  return PyUnicode_DecodeUTF8 (s, strlen (s), "replace");
+}
+
+static PyObject *
+walk_make_dirent (struct tree_listing *l, struct tree_entry *e)
+{
+  const char *name = l->names + e->name;
+
+  if (e->has_info)
+    {
+      e->info.name = (char *) name;
+      return Dirent_FromFileInfo (&e->info, e->has_st ? &e->st : NULL);
+    }
+
+  return Dirent_FromName (name, e->smbc_type);
+}
+
+/*
+  Ask the follow callable about each subdirectory of l, and queue
+  those it accepts.
+*/
+static int
+walk_follow (Walk *self, struct tree_listing *l, PyObject *dirs)
+{
+  struct tree *t = self->tree;
+  Py_ssize_t i;
+  size_t k = 0;
+
+  for (i = 0; i < PyList_GET_SIZE (dirs); i++)
+    {
+      struct tree_listing *sub;
+      PyObject *dent = PyList_GET_ITEM (dirs, i);
+      PyObject *uri;
+      PyObject *result;
+      int follow;
+
+      while (!l->entries[k].isdir)
+	k++;
+
+      sub = tree_listing_new (l->uri, l->names + l->entries[k++].name);
+      if (sub == NULL)
+	{
+	  PyErr_NoMemory ();
+	  return -1;
+	}
+
+      uri = walk_decode (sub->uri);
+      if (uri == NULL)
+	{
+	  tree_listing_free (sub);
+	  return -1;
+	}
+
+      result = PyObject_CallFunctionObjArgs (self->follow, uri, dent, NULL);
+      Py_DECREF (uri);
+      follow = result ? PyObject_IsTrue (result) : -1;
+      Py_XDECREF (result);
+      if (follow <= 0)
+	{
+	  tree_listing_free (sub);
+	  if (follow < 0)
+	    return -1;
+
+	  continue;
+	}
+
+      pthread_mutex_lock (&t->mutex);
+      if (tree_push (t, t->next_stack++ % t->nworkers, sub) < 0)
+	{
+	  pthread_mutex_unlock (&t->mutex);
+	  tree_listing_free (sub);
+	  PyErr_NoMemory ();
+	  return -1;
+	}
+
+      pthread_mutex_unlock (&t->mutex);
+    }
+
+  return 0;
+}
+
+/* Build (dirpath, dirs, files) for l. */
+static PyObject *
+walk_make_result (Walk *self, struct tree_listing *l)
+{
+  PyObject *dirpath = NULL;
+  PyObject *dirs = NULL;
+  PyObject *files = NULL;
+  size_t i;
+
+  dirpath = walk_decode (l->uri);
+  dirs = PyList_New (0);
+  files = PyList_New (0);
+  if (dirpath == NULL || dirs == NULL || files == NULL)
+    goto fail;
+
+  for (i = 0; i < l->n; i++)
+    {
+      struct tree_entry *e = &l->entries[i];
+      PyObject *dent = walk_make_dirent (l, e);
+      int ret;
+
+      if (dent == NULL)
+	goto fail;
+
+      ret = PyList_Append (e->isdir ? dirs : files, dent);
+      Py_DECREF (dent);
+      if (ret < 0)
+	goto fail;
+    }
+
+  if (self->follow && walk_follow (self, l, dirs) < 0)
+    goto fail;
+
+  return Py_BuildValue ("(NNN)", dirpath, dirs, files);
+
+ fail:
+  Py_XDECREF (dirpath);
+  Py_XDECREF (dirs);
+  Py_XDECREF (files);
+  return NULL;
+}
+
+/* Pass the error listing l to onerror.  Returns -1 if it raised. */
+static int
+walk_report (Walk *self, struct tree_listing *l)
+{
+  PyObject *value;
+  PyObject *result;
+
+  if (self->onerror == NULL)
+    return 0;
+
+  value = tree_exception (l->err, l->uri);
+  if (value == NULL)
+    return -1;
+
+  result = PyObject_CallFunctionObjArgs (self->onerror, value, NULL);
+  Py_DECREF (value);
+  if (result == NULL)
+    return -1;
+
+  Py_DECREF (result);
+  return 0;
+}
+
+static PyObject *
+Walk_iter (PyObject *self)
+{
+  Py_INCREF (self);
+  return self;
+}
+
+static PyObject *
+Walk_iternext (PyObject *obj)
+{
+  Walk *self = (Walk *) obj;
+  struct tree_listing *l;
+  PyObject *result;
+  int err;
+
+  for (;;)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      l = tree_next (self->tree, &err);
+      Py_END_ALLOW_THREADS
+      if (err)
+	{
+	  errno = err;
+	  pysmbc_SetFromErrno ();
+	  return NULL;
+	}
+
+      if (l == NULL)
+	return NULL;
+
+      if (l->err == 0)
+	break;
+
+      err = walk_report (self, l);
+      tree_done (self->tree, l);
+      if (err < 0)
+	return NULL;
+    }
+
+  result = walk_make_result (self, l);
+  tree_done (self->tree, l);
+  return result;
+}
+
+static void
+Walk_dealloc (Walk *self)
+{
+  if (self->tree)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      tree_free (self->tree);
+      Py_END_ALLOW_THREADS
+    }
+
+  Py_XDECREF (self->follow);
+  Py_XDECREF (self->onerror);
+  Py_XDECREF ((PyObject *) self->context);
+  Py_TYPE(self)->tp_free ((PyObject *) self);
+}
+
+PyObject *
+tree_walk (Context *ctx, const char *uri, unsigned workers,
+	   PyObject *follow, PyObject *onerror)
+{
+  Walk *self;
+  int mode = TREE_SKIP_LINKS;
+
+  if (PyCallable_Check (follow))
+    mode = TREE_FOLLOW_CALLER;
+  else
+    {
+      int ret = PyObject_IsTrue (follow);
+      if (ret < 0)
+	return NULL;
+
+      if (ret)
+	mode = TREE_FOLLOW_LINKS;
+    }
+
+  if (onerror == Py_None)
+    onerror = NULL;
+  else if (!PyCallable_Check (onerror))
+    {
+      PyErr_SetString (PyExc_TypeError, "onerror must be callable");
+      return NULL;
+    }
+
+  self = (Walk *) smbc_WalkType.tp_alloc (&smbc_WalkType, 0);
+  if (self == NULL)
+    return NULL;
+
+  Py_INCREF (ctx);
+  self->context = ctx;
+  if (mode == TREE_FOLLOW_CALLER)
+    {
+      Py_INCREF (follow);
+      self->follow = follow;
+    }
+
+  Py_XINCREF (onerror);
+  self->onerror = onerror;
+
+  Py_BEGIN_ALLOW_THREADS
+  self->tree = tree_new (ctx, uri, NULL, workers, TREE_WALK, mode, false);
+  Py_END_ALLOW_THREADS
+  if (self->tree == NULL)
+    {
+      pysmbc_SetFromErrno ();
+      Py_DECREF (self);
+      return NULL;
+    }
+
+  return (PyObject *) self;
+}
+
+#if PY_MAJOR_VERSION >= 3
+  PyTypeObject smbc_WalkType =
+    {
+      PyVarObject_HEAD_INIT(NULL, 0)
+      "smbc.Walk",               /*tp_name*/
+      sizeof(Walk),              /*tp_basicsize*/
+      0,                         /*tp_itemsize*/
+      (destructor)Walk_dealloc,  /*tp_dealloc*/
+      0,                         /*tp_print*/
+      0,                         /*tp_getattr*/
+      0,                         /*tp_setattr*/
+      0,                         /*tp_reserved*/
+      0,                         /*tp_repr*/
+      0,                         /*tp_as_number*/
+      0,                         /*tp_as_sequence*/
+      0,                         /*tp_as_mapping*/
+      0,                         /*tp_hash */
+      0,                         /*tp_call*/
+      0,                         /*tp_str*/
+      0,                         /*tp_getattro*/
+      0,                         /*tp_setattro*/
+      0,                         /*tp_as_buffer*/
+      Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+      "SMBC Walk\n"
+      "=========\n\n"
+
+      "  A tree walk started by L{smbc.Context.walk}.  Iterating over it\n"
+      "  yields a (dirpath, dirs, files) tuple per directory."
+      "",                        /* tp_doc */
+      0,                         /* tp_traverse */
+      0,                         /* tp_clear */
+      0,                         /* tp_richcompare */
+      0,                         /* tp_weaklistoffset */
+      Walk_iter,                 /* tp_iter */
+      Walk_iternext,             /* tp_iternext */
+    };
+#else
+  PyTypeObject smbc_WalkType =
+    {
+      PyObject_HEAD_INIT(NULL)
+      0,                         /*ob_size*/
+      "smbc.Walk",               /*tp_name*/
+      sizeof(Walk),              /*tp_basicsize*/
+      0,                         /*tp_itemsize*/
+      (destructor)Walk_dealloc,  /*tp_dealloc*/
+      0,                         /*tp_print*/
+      0,                         /*tp_getattr*/
+      0,                         /*tp_setattr*/
+      0,                         /*tp_compare*/
+      0,                         /*tp_repr*/
+      0,                         /*tp_as_number*/
+      0,                         /*tp_as_sequence*/
+      0,                         /*tp_as_mapping*/
+      0,                         /*tp_hash */
+      0,                         /*tp_call*/
+      0,                         /*tp_str*/
+      0,                         /*tp_getattro*/
+      0,                         /*tp_setattro*/
+      0,                         /*tp_as_buffer*/
+      Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+      "SMBC Walk\n"
+      "=========\n\n"
+
+      "  A tree walk started by L{smbc.Context.walk}.  Iterating over it\n"
+      "  yields a (dirpath, dirs, files) tuple per directory."
+      "",                        /* tp_doc */
+      0,                         /* tp_traverse */
+      0,                         /* tp_clear */
+      0,                         /* tp_richcompare */
+      0,                         /* tp_weaklistoffset */
+      Walk_iter,                 /* tp_iter */
+      Walk_iternext,             /* tp_iternext */
+    };
+#endif
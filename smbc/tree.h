@@ -0,0 +1,84 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_TREE_H
+#define HAVE_TREE_H
+
+#define TREE_DEFAULT_WORKERS 4
+
+extern PyTypeObject smbc_WalkType;
+
+/*
+  Start listing the tree below uri with 'workers' threads, each over
+  its own connection (see context_clone).  follow is a bool, or a
+  callable deciding which subdirectories to enter; onerror, if not
+  None, is called with the exception for each directory that could not
+  be listed.  Returns a new smbc.Walk iterator.
+*/
+extern PyObject *tree_walk (Context *ctx, const char *uri, unsigned workers,
+			    PyObject *follow, PyObject *onerror);
+
+/*
+  Remove uri and everything below it, with 'workers' threads.  Errors
+  are passed to on_error, if not None, as (uri, exception); otherwise
+  the first one stops the removal and is raised.  Returns None.
+*/
+extern PyObject *tree_rmtree (Context *ctx, const char *uri,
+			      unsigned workers, PyObject *on_error);
+
+/*
+  Copy the tree below src to dst, either of which may be an smb:// URI
+  or a local path, with 'workers' threads.  Errors are handled as for
+  tree_rmtree.  Returns the number of bytes copied.
+*/
+extern PyObject *tree_copytree (Context *ctx, const char *src,
+				const char *dst, unsigned workers,
+				PyObject *on_error);
+
+/* An entry of a directory, as passed to a tree_visit_fn. */
+struct tree_item
+{
+  const char *name;
+  bool isdir;
+  bool islink;			/* a reparse point */
+  bool has_times;		/* size and mtime are known */
+  off_t size;
+  struct timespec mtime;
+};
+
+/*
+  Called with the GIL for each directory listed, or with err set if it
+  could not be.  It sets enter[i] for each of the n items it wants
+  listed in turn; all are false to begin with.  Returns -1 with an
+  exception set to stop the walk.
+*/
+typedef int (*tree_visit_fn) (void *priv, const char *uri, int err,
+			      const struct tree_item *items, size_t n,
+			      bool *enter);
+
+/*
+  Walk the tree below uri with 'workers' threads, like tree_walk, but
+  for C callers: no Python objects are made for the entries, and those
+  listed without their size and times (by libsmbclient older than
+  0.4.0) are statted for them.  Errors are passed to visit, then
+  handled as for tree_rmtree.  Returns -1 if an exception was raised.
+*/
+extern int tree_visit (Context *ctx, const char *uri, unsigned workers,
+		       PyObject *on_error, tree_visit_fn visit, void *priv);
+
+#endif /* HAVE_TREE_H */
@@ -0,0 +1,742 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "watch.h"
+
+///////////
+// Watch //
+///////////
+
+/*
+  The thread sits in the notify call on a connection of its own, and
+  the callback appends what the server reports to a queue.  libsmbclient
+  also calls it every WATCH_POLL_MS with nothing to report, which is
+  when the thread notices it has been asked to stop.  Its first call,
+  of either kind, shows that the request is outstanding on the server,
+  which only then starts keeping track of changes; watch_new waits for
+  it.
+
+  A byte is written to the pipe when the queue stops being empty, and
+  when the thread ends; the reader drains it along with the queue.  So
+  the read end polls readable exactly when there is something to read.
+  Both happen with the mutex held.
+*/
+
+#define WATCH_POLL_MS 250
+#define WATCH_MAX_EVENTS 65536
+
+struct watch_event
+{
+  uint32_t action;
+  char *name;			/* relative to the watched directory */
+};
+
+struct watch
+{
+  SMBCCTX *c;
+  SMBCFILE *dir;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int fds[2];			/* the pipe; -1 once closed */
+  bool recursive;
+  uint32_t filter;
+  struct watch_event *events;
+  size_t n;
+  size_t cap;
+  bool overflowed;		/* events were dropped */
+  bool armed;			/* the server has the notify request */
+  bool stop;
+  bool closing;
+  bool done;			/* the thread has ended */
+  int err;			/* why, if not because it was stopped */
+};
+
+typedef struct
+{
+  PyObject_HEAD
+  Context *context;
+  struct watch *w;
+} Watch;
+
+static void
+watch_wake (struct watch *w)
+{
+  ssize_t ret;
+
+  if (w->fds[1] < 0)
+    return;
+
+  do
+    ret = write (w->fds[1], "", 1);
+  while (ret < 0 && errno == EINTR);
+}
+
+static void
+watch_drain (struct watch *w)
+{
+  char buf[64];
+
+  if (w->fds[0] < 0)
+    return;
+
+  while (read (w->fds[0], buf, sizeof (buf)) > 0 || errno == EINTR)
+    ;
+}
+
+static void
+watch_clear (struct watch *w)
+{
+  size_t i;
+
+  for (i = 0; i < w->n; i++)
+    free (w->events[i].name);
+
+  w->n = 0;
+}
+
+#if SMBCLIENT_VERSION >= 203 /* 0.2.3 or newer */
+/* Queue an event, unless it repeats the last one.  Mutex held. */
+static void
+watch_add (struct watch *w, uint32_t action, const char *filename)
+{
+  struct watch_event *e;
+  char *name;
+  char *p;
+
+  if (w->n > 0 && w->events[w->n - 1].action == action &&
+      strcmp (w->events[w->n - 1].name, filename) == 0)
+    return;
+
+  if (w->n == WATCH_MAX_EVENTS)
+    {
+      w->overflowed = true;
+      return;
+    }
+
+  if (w->n == w->cap)
+    {
+      size_t cap = w->cap ? 2 * w->cap : 64;
+
+      e = realloc (w->events, cap * sizeof (*e));
+      if (e == NULL)
+	{
+	  w->overflowed = true;
+	  return;
+	}
+
+      w->events = e;
+      w->cap = cap;
+    }
+
+  name = strdup (filename);
+  if (name == NULL)
+    {
+      w->overflowed = true;
+      return;
+    }
+
+  /* Servers separate the components of recursive changes with '\'. */
+  for (p = name; *p; p++)
+    if (*p == '\\')
+      *p = '/';
+
+  e = &w->events[w->n++];
+  e->action = action;
+  e->name = name;
+}
+
+static int
+watch_callback (const struct smbc_notify_callback_action *actions,
+		size_t num_actions, void *private_data)
+{
+  struct watch *w = private_data;
+  bool was_empty;
+  size_t i;
+  int stop;
+
+  pthread_mutex_lock (&w->mutex);
+  if (!w->armed)
+    {
+      w->armed = true;
+      pthread_cond_broadcast (&w->cond);
+    }
+
+  was_empty = w->n == 0 && !w->overflowed;
+  for (i = 0; i < num_actions; i++)
+    if (actions[i].filename)
+      watch_add (w, actions[i].action, actions[i].filename);
+
+  if (was_empty && (w->n > 0 || w->overflowed))
+    {
+      watch_wake (w);
+      pthread_cond_broadcast (&w->cond);
+    }
+
+  stop = w->stop;
+  pthread_mutex_unlock (&w->mutex);
+  return stop;
+}
+
+static void *
+watch_thread (void *arg)
+{
+  struct watch *w = arg;
+  int ret;
+
+  errno = 0;
+  ret = (*smbc_getFunctionNotify (w->c)) (w->c, w->dir, w->recursive,
+					   w->filter, WATCH_POLL_MS,
+					   watch_callback, w);
+
+  pthread_mutex_lock (&w->mutex);
+  w->done = true;
+  if (ret < 0 && !w->stop)
+    w->err = errno ? errno : EIO;
+
+  debugprintf ("%p watch_thread() ended, errno %d\n", w, w->err);
+  watch_wake (w);
+  pthread_cond_broadcast (&w->cond);
+  pthread_mutex_unlock (&w->mutex);
+  return NULL;
+}
+
+static int
+watch_pipe (int fds[2])
+{
+  int i;
+
+  if (pipe (fds) < 0)
+    return -1;
+
+  for (i = 0; i < 2; i++)
+    if (fcntl (fds[i], F_SETFD, FD_CLOEXEC) < 0 ||
+	fcntl (fds[i], F_SETFL, fcntl (fds[i], F_GETFL) | O_NONBLOCK) < 0)
+      {
+	int err = errno;
+	close (fds[0]);
+	close (fds[1]);
+	errno = err;
+	return -1;
+      }
+
+  return 0;
+}
+#endif /* SMBCLIENT_VERSION >= 203 */
+
+/* Stop the thread and drop the connection.  Called without the GIL. */
+static void
+watch_stop (struct watch *w, bool started)
+{
+  pthread_mutex_lock (&w->mutex);
+  if (w->closing)
+    {
+      pthread_mutex_unlock (&w->mutex);
+      return;
+    }
+
+  w->closing = true;
+  w->stop = true;
+  pthread_mutex_unlock (&w->mutex);
+
+  if (started)
+    pthread_join (w->thread, NULL);
+
+  if (w->dir)
+    (*smbc_getFunctionClosedir (w->c)) (w->c, w->dir);
+
+  context_clone_free (w->c);
+
+  pthread_mutex_lock (&w->mutex);
+  w->c = NULL;
+  w->dir = NULL;
+  w->done = true;
+  if (w->fds[0] >= 0)
+    {
+      close (w->fds[0]);
+      close (w->fds[1]);
+      w->fds[0] = w->fds[1] = -1;
+    }
+
+  pthread_cond_broadcast (&w->cond);
+  pthread_mutex_unlock (&w->mutex);
+}
+
+static void
+watch_free (struct watch *w)
+{
+  watch_clear (w);
+  free (w->events);
+  pthread_cond_destroy (&w->cond);
+  pthread_mutex_destroy (&w->mutex);
+  free (w);
+}
+
+/*
+  Wait up to ms milliseconds for events, or for the thread to end.
+  Called without the GIL.  Returns whether there is anything to take.
+*/
+static bool
+watch_wait (struct watch *w, unsigned ms)
+{
+  struct timespec deadline;
+  bool ready;
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (long) (ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  pthread_mutex_lock (&w->mutex);
+  while (w->n == 0 && !w->overflowed && !w->done)
+    if (pthread_cond_timedwait (&w->cond, &w->mutex, &deadline) != 0)
+      break;
+
+  ready = w->n > 0 || w->overflowed || w->done;
+  pthread_mutex_unlock (&w->mutex);
+  return ready;
+}
+
+static double
+watch_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  Take what is queued as a list of (action, name) tuples, waiting up
+  to timeout seconds (for ever if negative) for something to arrive.
+  Sets *ended if the watch has stopped and nothing was queued; raises
+  the error that stopped it, if any.
+*/
+static PyObject *
+watch_read (Watch *self, double timeout, bool *ended)
+{
+  struct watch *w = self->w;
+  double deadline = timeout < 0 ? 0 : watch_now () + timeout;
+  PyObject *listobj;
+  size_t i;
+  int err = 0;
+
+  *ended = false;
+  for (;;)
+    {
+      unsigned ms = 100;
+      bool ready;
+
+      if (timeout >= 0)
+	{
+	  double left = deadline - watch_now ();
+	  if (left <= 0)
+	    ms = 0;
+	  else if (left < 0.1)
+	    ms = (unsigned) (left * 1000) + 1;
+	}
+
+      Py_BEGIN_ALLOW_THREADS
+      ready = watch_wait (w, ms);
+      Py_END_ALLOW_THREADS
+      if (ready || ms == 0)
+	break;
+
+      /* Wake up now and then so that Ctrl-C is noticed. */
+      if (PyErr_CheckSignals () < 0)
+	return NULL;
+    }
+
+  listobj = PyList_New (0);
+  if (listobj == NULL)
+    return NULL;
+
+  pthread_mutex_lock (&w->mutex);
+  for (i = 0; i < w->n; i++)
+    {
+      const char *name = w->events[i].name;
+      PyObject *event;
+
+      event = Py_BuildValue ("(kN)", (unsigned long) w->events[i].action,
+			     PyUnicode_DecodeUTF8 (name, strlen (name),
+						   "replace"));
+      if (event == NULL || PyList_Append (listobj, event) < 0)
+	{
+	  Py_XDECREF (event);
+	  pthread_mutex_unlock (&w->mutex);
+	  Py_DECREF (listobj);
+	  return NULL;
+	}
+
+      Py_DECREF (event);
+    }
+
+  if (w->overflowed)
+    {
+      PyObject *event;
+
+      event = Py_BuildValue ("(iO)", WATCH_NOTIFY_OVERFLOW, Py_None);
+      if (event == NULL || PyList_Append (listobj, event) < 0)
+	{
+	  Py_XDECREF (event);
+	  pthread_mutex_unlock (&w->mutex);
+	  Py_DECREF (listobj);
+	  return NULL;
+	}
+
+      Py_DECREF (event);
+    }
+
+  if (w->n == 0 && !w->overflowed && w->done)
+    {
+      *ended = true;
+      err = w->err;
+    }
+  else
+    {
+      watch_clear (w);
+      w->overflowed = false;
+      if (!w->done)
+	watch_drain (w);
+    }
+
+  pthread_mutex_unlock (&w->mutex);
+  if (err)
+    {
+      Py_DECREF (listobj);
+      errno = err;
+      pysmbc_SetFromErrno ();
+      return NULL;
+    }
+
+  return listobj;
+}
+
+static int
+watch_check_open (Watch *self)
+{
+  bool closing;
+
+  pthread_mutex_lock (&self->w->mutex);
+  closing = self->w->closing;
+  pthread_mutex_unlock (&self->w->mutex);
+  if (closing)
+    {
+      PyErr_SetString (PyExc_ValueError, "watch is closed");
+      return -1;
+    }
+
+  return 0;
+}
+
+static PyObject *
+Watch_read (Watch *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *timeoutobj = Py_None;
+  double timeout = -1;
+  bool ended;
+  static char *kwlist[] =
+    {
+      "timeout",
+      NULL
+    };
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|O", kwlist, &timeoutobj))
+    return NULL;
+
+  if (timeoutobj != Py_None)
+    {
+      timeout = PyFloat_AsDouble (timeoutobj);
+      if (timeout == -1 && PyErr_Occurred ())
+	return NULL;
+
+      if (timeout < 0)
+	{
+	  PyErr_SetString (PyExc_ValueError, "timeout must be non-negative");
+	  return NULL;
+	}
+    }
+
+  if (watch_check_open (self) < 0)
+    return NULL;
+
+  return watch_read (self, timeout, &ended);
+}
+
+static PyObject *
+Watch_fileno (Watch *self)
+{
+  int fd;
+
+  pthread_mutex_lock (&self->w->mutex);
+  fd = self->w->fds[0];
+  pthread_mutex_unlock (&self->w->mutex);
+  if (fd < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "watch is closed");
+      return NULL;
+    }
+
+  return PyLong_FromLong (fd);
+}
+
+static PyObject *
+Watch_close (Watch *self)
+{
+  Py_BEGIN_ALLOW_THREADS
+  watch_stop (self->w, true);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Watch_iter (PyObject *self)
+{
+  Py_INCREF (self);
+  return self;
+}
+
+static PyObject *
+Watch_iternext (PyObject *obj)
+{
+  Watch *self = (Watch *) obj;
+  PyObject *result;
+  bool ended;
+
+  result = watch_read (self, -1, &ended);
+  if (result && ended)
+    {
+      Py_DECREF (result);
+      return NULL;
+    }
+
+  return result;
+}
+
+static void
+Watch_dealloc (Watch *self)
+{
+  if (self->w)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      watch_stop (self->w, true);
+      watch_free (self->w);
+      Py_END_ALLOW_THREADS
+    }
+
+  Py_XDECREF ((PyObject *) self->context);
+  Py_TYPE(self)->tp_free ((PyObject *) self);
+}
+
+PyObject *
+watch_new (Context *ctx, const char *uri, bool recursive, long filter)
+{
+#if SMBCLIENT_VERSION >= 203 /* 0.2.3 or newer */
+  Watch *self;
+  struct watch *w;
+  bool started = false;
+  int err = 0;
+
+  if (filter < 0)
+    filter = (SMBC_NOTIFY_CHANGE_FILE_NAME | SMBC_NOTIFY_CHANGE_DIR_NAME |
+	      SMBC_NOTIFY_CHANGE_SIZE | SMBC_NOTIFY_CHANGE_LAST_WRITE);
+
+  w = calloc (1, sizeof (*w));
+  if (w == NULL)
+    return PyErr_NoMemory ();
+
+  w->recursive = recursive;
+  w->filter = filter;
+  w->fds[0] = w->fds[1] = -1;
+  pthread_mutex_init (&w->mutex, NULL);
+  pthread_cond_init (&w->cond, NULL);
+
+  self = (Watch *) smbc_WatchType.tp_alloc (&smbc_WatchType, 0);
+  if (self == NULL)
+    {
+      watch_free (w);
+      return NULL;
+    }
+
+  Py_INCREF (ctx);
+  self->context = ctx;
+  self->w = w;
+
+  Py_BEGIN_ALLOW_THREADS
+  errno = 0;
+  w->c = context_clone (ctx);
+  if (w->c)
+    w->dir = (*smbc_getFunctionOpendir (w->c)) (w->c, uri);
+
+  if (w->dir == NULL || watch_pipe (w->fds) < 0)
+    err = errno ? errno : EIO;
+  else if ((err = pthread_create (&w->thread, NULL, watch_thread, w)) == 0)
+    {
+      /* Changes made before the request reaches the server are lost. */
+      started = true;
+      pthread_mutex_lock (&w->mutex);
+      while (!w->armed && !w->done)
+	pthread_cond_wait (&w->cond, &w->mutex);
+
+      if (!w->armed)
+	err = w->err ? w->err : EIO;
+      pthread_mutex_unlock (&w->mutex);
+    }
+
+  if (err)
+    watch_stop (w, started);
+  Py_END_ALLOW_THREADS
+  if (err)
+    {
+      errno = err;
+      pysmbc_SetFromErrno ();
+      Py_DECREF (self);
+      return NULL;
+    }
+
+  debugprintf ("%p watch_new(%s) = %p\n", ctx, uri, w);
+  return (PyObject *) self;
+#else
+  PyErr_SetString (PyExc_NotImplementedError,
+		   "change notification needs libsmbclient 0.2.3 or newer");
+  return NULL;
+#endif /* SMBCLIENT_VERSION >= 203 */
+}
+
+PyMethodDef Watch_methods[] =
+  {
+    { "read",
+      (PyCFunction) Watch_read, METH_VARARGS | METH_KEYWORDS,
+      "read(timeout=None) -> list\n\n"
+      "Take the changes reported since the last read, waiting for some\n"
+      "if there are none yet.  A change repeating the one before it is\n"
+      "only reported once.\n\n"
+      "@type timeout: float\n"
+      "@param timeout: most seconds to wait, or None to wait for ever\n"
+      "@return: a list of (action, name) tuples, where action is one of\n"
+      "the smbc.NOTIFY_ACTION_* constants and name is relative to the\n"
+      "watched directory, with '/' between components; empty if nothing\n"
+      "changed in time.  If more changes were reported than could be\n"
+      "queued, the list ends with (smbc.NOTIFY_OVERFLOW, None): some\n"
+      "were lost, and the directory should be listed again\n"
+      "@raise SmbError: the server stopped reporting changes" },
+
+    { "fileno",
+      (PyCFunction) Watch_fileno, METH_NOARGS,
+      "fileno() -> int\n\n"
+      "@return: a file descriptor, for select or poll, which is readable\n"
+      "whenever L{read} would return without waiting.  Only L{read}\n"
+      "should read from it." },
+
+    { "close",
+      (PyCFunction) Watch_close, METH_NOARGS,
+      "close() -> None\n\n"
+      "Stop watching and drop the connection.  An iteration over the\n"
+      "watch in another thread ends." },
+
+    { NULL } /* Sentinel */
+  };
+
+#if PY_MAJOR_VERSION >= 3
+  PyTypeObject smbc_WatchType =
+    {
+      PyVarObject_HEAD_INIT(NULL, 0)
+      "smbc.Watch",              /*tp_name*/
+      sizeof(Watch),             /*tp_basicsize*/
+      0,                         /*tp_itemsize*/
+      (destructor)Watch_dealloc, /*tp_dealloc*/
+      0,                         /*tp_print*/
+      0,                         /*tp_getattr*/
+      0,                         /*tp_setattr*/
+      0,                         /*tp_reserved*/
+      0,                         /*tp_repr*/
+      0,                         /*tp_as_number*/
+      0,                         /*tp_as_sequence*/
+      0,                         /*tp_as_mapping*/
+      0,                         /*tp_hash */
+      0,                         /*tp_call*/
+      0,                         /*tp_str*/
+      0,                         /*tp_getattro*/
+      0,                         /*tp_setattro*/
+      0,                         /*tp_as_buffer*/
+      Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+      "SMBC Watch\n"
+      "==========\n\n"
+
+      "  Changes to a directory, watched by L{smbc.Context.watch}.\n"
+      "  Iterating over it yields each batch that L{read} would return,\n"
+      "  until the watch is closed."
+      "",                        /* tp_doc */
+      0,                         /* tp_traverse */
+      0,                         /* tp_clear */
+      0,                         /* tp_richcompare */
+      0,                         /* tp_weaklistoffset */
+      Watch_iter,                /* tp_iter */
+      Watch_iternext,            /* tp_iternext */
+      Watch_methods,             /* tp_methods */
+    };
+#else
+  PyTypeObject smbc_WatchType =
+    {
+      PyObject_HEAD_INIT(NULL)
+      0,                         /*ob_size*/
+      "smbc.Watch",              /*tp_name*/
+      sizeof(Watch),             /*tp_basicsize*/
+      0,                         /*tp_itemsize*/
+      (destructor)Watch_dealloc, /*tp_dealloc*/
+      0,                         /*tp_print*/
+      0,                         /*tp_getattr*/
+      0,                         /*tp_setattr*/
+      0,                         /*tp_compare*/
+      0,                         /*tp_repr*/
+      0,                         /*tp_as_number*/
+      0,                         /*tp_as_sequence*/
+      0,                         /*tp_as_mapping*/
+      0,                         /*tp_hash */
+      0,                         /*tp_call*/
+      0,                         /*tp_str*/
+      0,                         /*tp_getattro*/
+      0,                         /*tp_setattro*/
+      0,                         /*tp_as_buffer*/
+      Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+      "SMBC Watch\n"
+      "==========\n\n"
+
+      "  Changes to a directory, watched by L{smbc.Context.watch}.\n"
+      "  Iterating over it yields each batch that L{read} would return,\n"
+      "  until the watch is closed."
+      "",                        /* tp_doc */
+      0,                         /* tp_traverse */
+      0,                         /* tp_clear */
+      0,                         /* tp_richcompare */
+      0,                         /* tp_weaklistoffset */
+      Watch_iter,                /* tp_iter */
+      Watch_iternext,            /* tp_iternext */
+      Watch_methods,             /* tp_methods */
+    };
+#endif
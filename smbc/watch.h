@@ -0,0 +1,38 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_WATCH_H
+#define HAVE_WATCH_H
+
+/* The action of the event standing for those dropped from a full queue. */
+#define WATCH_NOTIFY_OVERFLOW 0
+
+extern PyMethodDef Watch_methods[];
+extern PyTypeObject smbc_WatchType;
+
+/*
+  Start watching the directory uri for changes, over a connection of
+  its own (see context_clone) on a native thread.  filter is a mask
+  of SMBC_NOTIFY_CHANGE_* flags, or -1 for names, sizes and write
+  times.  Returns a new smbc.Watch, from which the changes are read in
+  batches.
+*/
+extern PyObject *watch_new (Context *ctx, const char *uri, bool recursive,
+			    long filter);
+
+#endif /* HAVE_WATCH_H */
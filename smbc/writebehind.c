@@ -0,0 +1,316 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <pthread.h>
+#include "smbcmodule.h"
+#include "context.h"
+#include "file.h"
+#include "writebehind.h"
+
+//////////////////
+// Write-behind //
+//////////////////
+
+/*
+  Writes are appended to the 'filling' block for as long as they are
+  contiguous with it and it has room; a block's capacity is chosen so
+  that it ends on a multiple of block_size.  Full blocks (or any
+  block, when a write is not contiguous or on drain) are queued for
+  the thread.  The writer blocks while max_blocks blocks are queued or
+  being sent, which bounds the memory in use.
+
+  Once a write fails, the queued blocks behind it are dropped and the
+  error is handed to the next caller of writebehind_write or
+  writebehind_drain.
+*/
+
+struct wb_block
+{
+  struct wb_block *next;
+  off_t offset;
+  size_t len;
+  size_t cap;
+  char *data;
+};
+
+struct writebehind
+{
+  File *file;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t block_size;
+  unsigned max_blocks;
+  struct wb_block *filling;
+  struct wb_block *head;
+  struct wb_block *tail;
+  struct wb_block *spare;
+  unsigned queued;		/* blocks queued or being sent */
+  int err;
+  bool stop;
+};
+
+static void *
+wb_thread (void *arg)
+{
+  writebehind *wb = arg;
+
+  pthread_mutex_lock (&wb->mutex);
+  for (;;)
+    {
+      struct wb_block *b;
+      ssize_t len = 0;
+      size_t done = 0;
+      int err = 0;
+
+      while (wb->head == NULL && !wb->stop)
+	pthread_cond_wait (&wb->cond, &wb->mutex);
+
+      if (wb->head == NULL)
+	break;
+
+      b = wb->head;
+      wb->head = b->next;
+      if (wb->head == NULL)
+	wb->tail = NULL;
+
+      if (wb->err == 0)
+	{
+	  pthread_mutex_unlock (&wb->mutex);
+	  while (done < b->len)
+	    {
+	      len = file_pwrite (wb->file, b->data + done, b->len - done,
+				 b->offset + done);
+	      if (len <= 0)
+		{
+		  err = len < 0 ? errno : EIO;
+		  break;
+		}
+
+	      done += len;
+	    }
+
+	  pthread_mutex_lock (&wb->mutex);
+	  if (err && wb->err == 0)
+	    wb->err = err;
+	}
+
+      b->next = wb->spare;
+      wb->spare = b;
+      wb->queued--;
+      pthread_cond_broadcast (&wb->cond);
+    }
+
+  pthread_mutex_unlock (&wb->mutex);
+  return NULL;
+}
+
+writebehind *
+writebehind_new (File *file, size_t block_size, unsigned max_blocks)
+{
+  writebehind *wb;
+
+  wb = calloc (1, sizeof (*wb));
+  if (wb == NULL)
+    return NULL;
+
+  wb->file = file;
+  wb->block_size = block_size;
+  wb->max_blocks = max_blocks;
+  pthread_mutex_init (&wb->mutex, NULL);
+  pthread_cond_init (&wb->cond, NULL);
+  if (pthread_create (&wb->thread, NULL, wb_thread, wb) != 0)
+    {
+      pthread_cond_destroy (&wb->cond);
+      pthread_mutex_destroy (&wb->mutex);
+      free (wb);
+      return NULL;
+    }
+
+  debugprintf ("%p writebehind_new(%zu x %u)\n", wb, block_size, max_blocks);
+  return wb;
+}
+
+static void
+wb_free_blocks (struct wb_block *b)
+{
+  while (b)
+    {
+      struct wb_block *next = b->next;
+      free (b->data);
+      free (b);
+      b = next;
+    }
+}
+
+/* Stop the thread.  Anything not yet drained is discarded. */
+void
+writebehind_free (writebehind *wb)
+{
+  if (wb == NULL)
+    return;
+
+  pthread_mutex_lock (&wb->mutex);
+  wb->stop = true;
+  wb->err = ECANCELED;		/* drop whatever is still queued */
+  pthread_cond_broadcast (&wb->cond);
+  pthread_mutex_unlock (&wb->mutex);
+  pthread_join (wb->thread, NULL);
+
+  if (wb->filling)
+    wb->filling->next = NULL;
+
+  wb_free_blocks (wb->filling);
+  wb_free_blocks (wb->spare);
+  pthread_cond_destroy (&wb->cond);
+  pthread_mutex_destroy (&wb->mutex);
+  free (wb);
+}
+
+/* Queue the filling block, waiting for room.  Mutex held. */
+static void
+wb_submit (writebehind *wb)
+{
+  struct wb_block *b = wb->filling;
+
+  if (b == NULL)
+    return;
+
+  wb->filling = NULL;
+  if (b->len == 0)
+    {
+      b->next = wb->spare;
+      wb->spare = b;
+      return;
+    }
+
+  while (wb->queued >= wb->max_blocks)
+    pthread_cond_wait (&wb->cond, &wb->mutex);
+
+  b->next = NULL;
+  if (wb->tail)
+    wb->tail->next = b;
+  else
+    wb->head = b;
+
+  wb->tail = b;
+  wb->queued++;
+  pthread_cond_broadcast (&wb->cond);
+}
+
+/* Take the pending error, if any.  Mutex held. */
+static int
+wb_take_error (writebehind *wb)
+{
+  int err = wb->err;
+
+  if (err == 0)
+    return 0;
+
+  wb->err = 0;
+  errno = err;
+  return -1;
+}
+
+/*
+  Queue size bytes to be written at offset.  Returns the number of
+  bytes queued (size, unless memory ran out part way), or -1 with
+  errno set if an earlier write failed or nothing could be queued.
+*/
+ssize_t
+writebehind_write (writebehind *wb, off_t offset, const char *src,
+		   size_t size)
+{
+  size_t done = 0;
+  ssize_t ret = size;
+
+  pthread_mutex_lock (&wb->mutex);
+  if (wb_take_error (wb) < 0)
+    {
+      pthread_mutex_unlock (&wb->mutex);
+      return -1;
+    }
+
+  while (done < size)
+    {
+      struct wb_block *b = wb->filling;
+      off_t at = offset + done;
+      size_t take;
+
+      if (b && (b->offset + (off_t) b->len != at || b->len == b->cap))
+	{
+	  wb_submit (wb);
+	  b = NULL;
+	}
+
+      if (b == NULL)
+	{
+	  b = wb->spare;
+	  if (b)
+	    wb->spare = b->next;
+	  else
+	    {
+	      b = calloc (1, sizeof (*b));
+	      if (b)
+		b->data = malloc (wb->block_size);
+
+	      if (b == NULL || b->data == NULL)
+		{
+		  free (b);
+		  errno = ENOMEM;
+		  ret = done ? (ssize_t) done : -1;
+		  break;
+		}
+	    }
+
+	  b->offset = at;
+	  b->len = 0;
+	  b->cap = wb->block_size - (at % wb->block_size);
+	  wb->filling = b;
+	}
+
+      take = size - done;
+      if (take > b->cap - b->len)
+	take = b->cap - b->len;
+
+      memcpy (b->data + b->len, src + done, take);
+      b->len += take;
+      done += take;
+      if (b->len == b->cap)
+	wb_submit (wb);
+    }
+
+  pthread_mutex_unlock (&wb->mutex);
+  return ret;
+}
+
+/* Send everything written so far and wait for it to complete. */
+int
+writebehind_drain (writebehind *wb)
+{
+  int ret;
+
+  pthread_mutex_lock (&wb->mutex);
+  wb_submit (wb);
+  while (wb->queued > 0)
+    pthread_cond_wait (&wb->cond, &wb->mutex);
+
+  ret = wb_take_error (wb);
+  pthread_mutex_unlock (&wb->mutex);
+  return ret;
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; c-file-style: "gnu" -*-
+ * pysmbc - Python bindings for libsmbclient
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_WRITEBEHIND_H
+#define HAVE_WRITEBEHIND_H
+
+/*
+  Write-behind for a File.  Writes are coalesced into blocks aligned
+  to the block size and sent by a native thread, with at most
+  max_blocks blocks queued.  An error from the thread is reported by
+  the next call.  None of these functions may be called with the GIL
+  held.
+*/
+typedef struct writebehind writebehind;
+
+extern writebehind *writebehind_new (File *file, size_t block_size,
+				     unsigned max_blocks);
+extern void writebehind_free (writebehind *wb);
+extern ssize_t writebehind_write (writebehind *wb, off_t offset,
+				  const char *src, size_t size);
+extern int writebehind_drain (writebehind *wb);
+
+#endif /* HAVE_WRITEBEHIND_H */
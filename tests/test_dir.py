@@ -57,6 +57,125 @@ def test_rename(config, fixture):
     ret = ctx.rename(src, dst)
     assert ret == 0
 
+def test_iter_dir(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    d = ctx.opendir(testdir)
+    d.bufferSize = 1024
+    names = [entry.name for entry in d]
+    assert sorted(names) == ['.', '..', 'dir2']
+    assert d.getdents() == []
+
+def test_scandir(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    entries = list(ctx.scandir(testdir))
+    assert [entry.name for entry in entries] == ['dir2']
+    entry = entries[0]
+    assert entry.is_dir()
+    assert entry.attrs & 0x10
+    st = entry.stat()
+    assert stat.S_ISDIR(st[stat.ST_MODE])
+    assert entry.mtime >= st[stat.ST_MTIME]
+
+def test_opendir_filter(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    names = lambda d: sorted(e.name for e in d)
+    assert names(ctx.opendir(testdir, pattern='DIR*')) == ['dir2']
+    assert names(ctx.opendir(testdir, types={smbc.FILE})) == []
+    assert names(ctx.opendir(testdir, '*', [smbc.DIR])) == ['.', '..', 'dir2']
+    assert names(ctx.scandir(testdir, pattern='*1')) == []
+
+def test_dir_cache(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    ctx.dirCacheTTL = 60
+    names = lambda: sorted(e.name for e in ctx.opendir(testdir))
+    assert names() == ['.', '..', 'dir2']
+    # Changes made through another context are not seen...
+    other = smbc.Context()
+    other.optionNoAutoAnonymousLogin = True
+    other.functionAuthData = lambda se, sh, w, u, p: (w, config['username'], config['password'])
+    other.mkdir(testdir + 'dir3/')
+    assert names() == ['.', '..', 'dir2']
+    # ...but those made through this one drop the cached listing.
+    ctx.rmdir(testdir + 'dir3/')
+    assert names() == ['.', '..', 'dir2']
+    ctx.mkdir(testdir + 'dir3/')
+    assert names() == ['.', '..', 'dir2', 'dir3']
+    ctx.rmdir(testdir + 'dir3/')
+    # A failed change keeps its error and the cached listing.
+    with pytest.raises(smbc.ExistsError):
+        ctx.mkdir(testdir + 'dir2/')
+    assert names() == ['.', '..', 'dir2']
+    ctx.dirCacheTTL = 0
+    assert names() == ['.', '..', 'dir2']
+
+def test_dir_page(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    d = ctx.opendir(testdir)
+    first = next(d)
+    cookie = d.tell()
+    rest = [e.name for e in d]
+    d.seek(cookie)
+    assert [e.name for e in d] == rest
+    entries, token = ctx.opendir(testdir).page(2)
+    assert [e.name for e in entries] == [first.name] + rest[:1]
+    entries, token = ctx.opendir(testdir).page(2, token)
+    assert [e.name for e in entries] == rest[1:]
+    assert token is None
+
+def test_read_columns(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    cols = ctx.opendir(testdir).read_columns()
+    offsets = cols['offsets']
+    names = [cols['names'][offsets[i]:offsets[i + 1]]
+             for i in range(len(offsets) - 1)]
+    assert sorted(names) == [b'.', b'..', b'dir2']
+    assert cols['sizes'] is None
+    cols = ctx.scandir(testdir).read_columns()
+    assert cols['names'] == b'dir2'
+    assert list(cols['types']) == [smbc.DIR]
+    assert len(cols['sizes']) == len(cols['mtimes']) == 1
+
+def test_watch(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    w = ctx.watch(testdir)
+    assert w.read(timeout=0) == []
+    ctx.mkdir(testdir + 'dir3/')
+    events = w.read(timeout=5)
+    assert events[0] == (smbc.NOTIFY_ACTION_ADDED, 'dir3')
+    w.close()
+    ctx.rmdir(testdir + 'dir3/')
+
+def test_watch_armed(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    # watch() returns only once the server is watching, so a change
+    # made straight away is seen.
+    for i in range(3):
+        w = ctx.watch(testdir)
+        ctx.mkdir(testdir + 'dir3/')
+        try:
+            assert (smbc.NOTIFY_ACTION_ADDED, 'dir3') in w.read(timeout=5)
+        finally:
+            w.close()
+            ctx.rmdir(testdir + 'dir3/')
+
+def test_stat_many(config, fixture):
+    ctx = fixture['ctx']
+    testdir = config['uri'] + 'test/'
+    uris = [testdir, testdir + 'dir2/', testdir + 'dir1/']
+    results = ctx.stat_many(uris, workers=2)
+    assert results[:2] == [ctx.stat(uri) for uri in uris[:2]]
+    assert isinstance(results[2], smbc.NoEntryError)
+    with pytest.raises(smbc.NoEntryError):
+        ctx.stat_many(uris, return_exceptions=False)
+
 def test_stat_error_notfound(config, fixture):
     ctx = fixture['ctx']
     testdir = config['uri'] + 'test/'
@@ -0,0 +1,235 @@
+#!/usr/bin/env python
+
+import smbc
+import os
+import pytest
+
+@pytest.fixture()
+def fixture(config):
+    ctx = smbc.Context()
+    ctx.optionNoAutoAnonymousLogin = True
+    cb = lambda se, sh, w, u, p: (w, config['username'], config['password'])
+    ctx.functionAuthData = cb
+    uri = config['uri'] + 'test_file.dat'
+    data = os.urandom(300000)
+    f = ctx.open(uri, os.O_CREAT | os.O_TRUNC | os.O_WRONLY)
+    f.write(data)
+    f.close()
+    yield {
+        'ctx': ctx,
+        'uri': uri,
+        'data': data,
+    }
+    ctx.unlink(uri)
+
+def test_read_all(fixture):
+    f = fixture['ctx'].open(fixture['uri'])
+    assert f.read() == fixture['data']
+    assert f.read() == b''
+
+def test_read_rest_chunked(fixture):
+    f = fixture['ctx'].open(fixture['uri'])
+    f.readChunkSize = 4096
+    assert f.read(100) == fixture['data'][:100]
+    assert f.read() == fixture['data'][100:]
+
+def test_read_max_size(fixture):
+    f = fixture['ctx'].open(fixture['uri'])
+    f.maxReadSize = 1000
+    with pytest.raises(MemoryError):
+        f.read()
+    assert f.read(1000) == fixture['data'][:1000]
+
+def test_read_error(fixture):
+    for size in (0, 4096):
+        f = fixture['ctx'].open(fixture['uri'], os.O_WRONLY)
+        f.bufferSize = size
+        f.readChunkSize = 1000
+        f.readaheadBlocks = 2
+        f.seek(10)
+        with pytest.raises(Exception) as e:
+            f.read(5000)
+        assert e.value.args[0] != 0
+        with pytest.raises(Exception) as e:
+            f.readinto(bytearray(5000))
+        assert e.value.args[0] != 0
+        f.close()
+
+def test_buffered_readline(fixture):
+    ctx = fixture['ctx']
+    uri = fixture['uri']
+    lines = [('line %d\n' % i).encode() for i in range(1000)]
+    f = ctx.open(uri, os.O_CREAT | os.O_TRUNC | os.O_WRONLY)
+    f.bufferSize = 4096
+    for line in lines:
+        f.write(line)
+    f.flush()
+    f.close()
+    f = ctx.open(uri)
+    f.bufferSize = 4096
+    assert f.readline() == lines[0]
+    assert f.tell() == len(lines[0])
+    assert f.read(len(lines[1])) == lines[1]
+    assert [f.readline() for line in lines[2:]] == lines[2:]
+    assert f.readline() == b''
+
+def test_unbuffered_readline(fixture):
+    ctx = fixture['ctx']
+    uri = fixture['uri']
+    f = ctx.open(uri, os.O_CREAT | os.O_TRUNC | os.O_WRONLY)
+    f.write(b'first\nsecond\n')
+    f.close()
+    f = ctx.open(uri)
+    assert f.readline() == b'first\n'
+    assert f.tell() == 6
+    assert f.read() == b'second\n'
+
+def test_unbuffered_readline_long(fixture):
+    ctx = fixture['ctx']
+    uri = fixture['uri']
+    # Around and well past the first probe, and past the default
+    # buffer size.
+    lines = [b'short\n', b'a' * 2047 + b'\n', b'b' * 2048 + b'\n',
+             b'c' * 100000 + b'\n', b'tail']
+    f = ctx.open(uri, os.O_CREAT | os.O_TRUNC | os.O_WRONLY)
+    f.write(b''.join(lines))
+    f.close()
+    f = ctx.open(uri)
+    pos = 0
+    for line in lines:
+        assert f.readline() == line
+        pos += len(line)
+        assert f.tell() == pos
+    assert f.readline() == b''
+    f.seek(len(lines[0]))
+    assert f.readline(5000) == lines[1]
+    assert f.readline(100) == b'b' * 100
+    assert f.read(1948) == b'b' * 1948
+    assert f.read(1) == b'\n'
+
+def test_readahead_read_error(fixture):
+    f = fixture['ctx'].open(fixture['uri'], os.O_WRONLY)
+    f.readaheadBlocks = 2
+    f.seek(10)
+    with pytest.raises(Exception) as e:
+        f.readline()
+    assert e.value.args[0] != 0
+    f.seek(20)
+    with pytest.raises(Exception) as e:
+        next(f)
+    assert e.value.args[0] != 0
+    f.close()
+
+def test_readahead(fixture):
+    f = fixture['ctx'].open(fixture['uri'])
+    f.readChunkSize = 8192
+    f.readaheadBlocks = 4
+    data = fixture['data']
+    chunks = []
+    while True:
+        buf = f.read(1000)
+        if not buf:
+            break
+        chunks.append(buf)
+    assert b''.join(chunks) == data
+    f.seek(5000)
+    assert f.read(100) == data[5000:5100]
+    assert f.tell() == 5100
+    f.seek(200000)
+    assert f.read(100) == data[200000:200100]
+    assert f.read(100) == data[200100:200200]
+    f.close()
+
+def test_write_behind(fixture):
+    ctx = fixture['ctx']
+    uri = fixture['uri']
+    data = os.urandom(300000)
+    f = ctx.open(uri, os.O_CREAT | os.O_TRUNC | os.O_RDWR)
+    f.writeChunkSize = 8192
+    f.writeBehindBlocks = 4
+    for i in range(0, len(data), 1000):
+        f.write(data[i:i + 1000])
+    assert f.tell() == len(data)
+    f.seek(100)
+    f.write(b'x' * 10)
+    f.seek(0)
+    expected = data[:100] + b'x' * 10 + data[110:]
+    assert f.read() == expected
+    f.close()
+    f = ctx.open(uri)
+    assert f.read() == expected
+
+def test_positional(fixture):
+    f = fixture['ctx'].open(fixture['uri'], os.O_RDWR)
+    data = bytearray(fixture['data'])
+    f.bufferSize = 4096
+    assert f.read(10) == data[:10]
+    assert f.pread(1000, 20) == data[1000:1020]
+    assert f.pwrite(5, b'hello') == 5
+    data[5:10] = b'hello'
+    assert f.tell() == 10
+    assert f.read(10) == data[10:20]
+    bufs = [bytearray(100), bytearray(50)]
+    assert f.readv([(200000, bufs[0]), (len(data) - 20, bufs[1])]) == [100, 20]
+    assert bufs[0] == data[200000:200100]
+    assert bufs[1][:20] == data[-20:]
+    assert f.writev([(0, b'ab'), (100, b'cd')]) == [2, 2]
+    data[0:2] = b'ab'
+    data[100:102] = b'cd'
+    assert f.tell() == 20
+    f.seek(0)
+    assert f.read() == data
+
+def test_copy_fd(fixture, tmp_path):
+    ctx = fixture['ctx']
+    uri = fixture['uri']
+    data = fixture['data']
+    path = str(tmp_path / 'copy.dat')
+    with open(path, 'wb') as out:
+        f = ctx.open(uri)
+        assert f.read(10) == data[:10]
+        assert f.copy_to(out) == len(data) - 10
+    with open(path, 'rb') as src:
+        assert src.read() == data[10:]
+    f = ctx.open(uri, os.O_WRONLY | os.O_TRUNC)
+    with open(path, 'rb') as src:
+        assert f.copy_from(src, 1000) == 1000
+    f.close()
+    assert ctx.open(uri).read() == data[10:1010]
+
+def test_copy_fd_read_error(fixture, tmp_path):
+    f = fixture['ctx'].open(fixture['uri'], os.O_WRONLY)
+    f.readaheadBlocks = 2
+    f.seek(10)
+    with open(str(tmp_path / 'copy.dat'), 'wb') as out:
+        with pytest.raises(Exception) as e:
+            f.copy_to(out)
+    assert e.value.args[0] != 0
+    f.close()
+
+def test_digest(fixture):
+    import hashlib
+    f = fixture['ctx'].open(fixture['uri'])
+    assert f.read(10) == fixture['data'][:10]
+    expected = hashlib.sha256(fixture['data']).hexdigest()
+    assert f.digest(chunk=65536).hexdigest() == expected
+    assert f.tell() == 10
+    assert f.digest('md5').digest() == hashlib.md5(fixture['data']).digest()
+
+def test_digest_views_released(fixture):
+    class Keep(object):
+        def __init__(self):
+            self.views = []
+        def update(self, view):
+            self.views.append(view)
+    class Export(Keep):
+        def update(self, view):
+            self.views.append(memoryview(view))
+    f = fixture['ctx'].open(fixture['uri'])
+    hash = f.digest(Keep)
+    assert hash.views
+    for view in hash.views:
+        with pytest.raises(ValueError):
+            bytes(view)
+    with pytest.raises(BufferError):
+        f.digest(Export)
@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+
+import smbc
+import os
+import pytest
+
+@pytest.fixture()
+def fixture(config):
+    ctx = smbc.Context()
+    ctx.optionNoAutoAnonymousLogin = True
+    cb = lambda se, sh, w, u, p: (w, config['username'], config['password'])
+    ctx.functionAuthData = cb
+    uri = config['uri'] + 'test_transfer.dat'
+    data = os.urandom(3000000)
+    f = ctx.open(uri, os.O_CREAT | os.O_TRUNC | os.O_WRONLY)
+    f.write(data)
+    f.close()
+    yield {
+        'ctx': ctx,
+        'uri': uri,
+        'data': data,
+    }
+    ctx.unlink(uri)
+
+def test_download(fixture, tmp_path):
+    path = str(tmp_path / 'download.dat')
+    n = fixture['ctx'].download(fixture['uri'], path, streams=3, chunk=100000)
+    assert n == len(fixture['data'])
+    with open(path, 'rb') as f:
+        assert f.read() == fixture['data']
+
+def test_download_missing(config, fixture, tmp_path):
+    path = str(tmp_path / 'missing.dat')
+    with pytest.raises(smbc.NoEntryError):
+        fixture['ctx'].download(config['uri'] + 'no_such_file', path)
+    assert not os.path.exists(path)
+
+def test_upload(config, fixture, tmp_path):
+    ctx = fixture['ctx']
+    path = str(tmp_path / 'upload.dat')
+    data = os.urandom(1000000)
+    with open(path, 'wb') as f:
+        f.write(data)
+    uri = config['uri'] + 'test_upload.dat'
+    assert ctx.upload(path, uri, streams=4, chunk=65536) == len(data)
+    try:
+        assert ctx.open(uri).read() == data
+    finally:
+        ctx.unlink(uri)
+
+def test_copy(config, fixture):
+    ctx = fixture['ctx']
+    uri = config['uri'] + 'test_copy.dat'
+    progress = []
+    n = ctx.copy(fixture['uri'], uri, progress=progress.append)
+    try:
+        assert n == len(fixture['data'])
+        assert progress and progress[-1] == n
+        assert ctx.open(uri).read() == fixture['data']
+    finally:
+        ctx.unlink(uri)
+
+def test_copy_cancel(config, fixture):
+    ctx = fixture['ctx']
+    uri = config['uri'] + 'test_copy.dat'
+    with pytest.raises(RuntimeError):
+        ctx.copy(fixture['uri'], uri, progress=lambda n: False)
+    with pytest.raises(smbc.NoEntryError):
+        ctx.stat(uri)
+
+def test_digest_many(config, fixture):
+    import hashlib
+    uris = [fixture['uri'], config['uri'] + 'no_such_file', fixture['uri']]
+    results = fixture['ctx'].digest_many(uris, workers=2)
+    expected = hashlib.sha256(fixture['data']).hexdigest()
+    assert results[0].hexdigest() == expected
+    assert isinstance(results[1], smbc.NoEntryError)
+    assert results[2].hexdigest() == expected
+
+def test_sync_file(fixture, tmp_path):
+    ctx = fixture['ctx']
+    data = bytearray(fixture['data'])
+    data[1000] ^= 0xff
+    data += b'tail'
+    path = str(tmp_path / 'sync.dat')
+    with open(path, 'wb') as f:
+        f.write(data)
+    written = ctx.sync_file(path, fixture['uri'], block=65536)
+    assert 0 < written < len(data) // 4
+    assert ctx.open(fixture['uri']).read() == data
+    assert ctx.sync_file(path, fixture['uri']) == 0
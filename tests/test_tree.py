@@ -0,0 +1,144 @@
+#!/usr/bin/env python
+
+import smbc
+import os
+import time
+import pytest
+
+@pytest.fixture()
+def fixture(config):
+    ctx = smbc.Context()
+    ctx.optionNoAutoAnonymousLogin = True
+    cb = lambda se, sh, w, u, p: (w, config['username'], config['password'])
+    ctx.functionAuthData = cb
+    top = config['uri'] + 'test_tree'
+    tree = {
+        '': (['a', 'b'], ['f1']),
+        '/a': (['c'], ['f2', 'f3']),
+        '/a/c': ([], ['f4']),
+        '/b': ([], []),
+    }
+    for path in sorted(tree):
+        ctx.mkdir(top + path)
+        for name in tree[path][1]:
+            f = ctx.open(top + path + '/' + name, os.O_CREAT | os.O_WRONLY)
+            f.write(name.encode() * 10)
+            f.close()
+    yield {
+        'ctx': ctx,
+        'top': top,
+        'tree': tree,
+    }
+    for path in sorted(tree, reverse=True):
+        for name in tree[path][1]:
+            ctx.unlink(top + path + '/' + name)
+        ctx.rmdir(top + path)
+
+def test_walk(fixture):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    result = {}
+    for dirpath, dirs, files in ctx.walk(top, workers=3):
+        path = dirpath[len(top):]
+        result[path] = (sorted(d.name for d in dirs),
+                        sorted(f.name for f in files))
+        for f in files:
+            assert f.size == 20
+    assert result == fixture['tree']
+
+def test_walk_follow(fixture):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    follow = lambda uri, dirent: dirent.name != 'a'
+    assert sorted(dirpath for dirpath, _, _ in ctx.walk(top, follow=follow)) \
+        == [top, top + '/b']
+
+def test_walk_onerror(fixture):
+    errors = []
+    walk = fixture['ctx'].walk(fixture['top'] + '/missing',
+                               onerror=errors.append)
+    assert list(walk) == []
+    assert isinstance(errors[0], smbc.NoEntryError)
+
+def test_copytree(fixture, tmp_path):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    local = str(tmp_path / 'copy')
+    assert ctx.copytree(top, local, workers=3) == 80
+    assert os.path.getmtime(local + '/a/c/f4') == \
+        pytest.approx(ctx.stat(top + '/a/c/f4')[8], abs=1)
+    with open(local + '/a/f2', 'rb') as f:
+        assert f.read() == b'f2' * 10
+    copy = top + '_copy'
+    assert ctx.copytree(local, copy) == 80
+    result = {}
+    for dirpath, dirs, files in ctx.walk(copy):
+        result[dirpath[len(copy):]] = (sorted(d.name for d in dirs),
+                                       sorted(f.name for f in files))
+    assert result == fixture['tree']
+    ctx.rmtree(copy)
+
+def test_copytree_times(fixture, tmp_path):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    files = [path + '/' + name
+             for path, (dirs, names) in fixture['tree'].items()
+             for name in names]
+    local = str(tmp_path / 'copy')
+    ctx.copytree(top, local)
+    for path in files:
+        assert os.path.getmtime(local + path) == \
+            pytest.approx(ctx.stat(top + path)[8], abs=1)
+    stamp = 1000000000
+    for path in files:
+        os.utime(local + path, (stamp, stamp))
+    copy = top + '_copy'
+    ctx.copytree(local, copy)
+    for path in files:
+        assert ctx.stat(copy + path)[8] == stamp
+    ctx.rmtree(copy)
+
+def test_rmtree(fixture):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    ctx.rmtree(top, workers=3)
+    with pytest.raises(smbc.NoEntryError):
+        ctx.stat(top)
+    errors = []
+    ctx.rmtree(top, on_error=lambda uri, exc: errors.append(uri))
+    assert errors == [top]
+    fixture['tree'].clear()
+
+def test_snapshot_diff(fixture, tmpdir):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    tree = fixture['tree']
+    index = str(tmpdir.join('tree.idx'))
+    assert ctx.snapshot(top, index) == 7
+    assert ctx.diff(top, index) == ([], [], [])
+    ctx.unlink(top + '/a/c/f4')
+    ctx.rmdir(top + '/a/c')
+    del tree['/a/c']
+    tree['/a'] = ([], ['f2', 'f3'])
+    f = ctx.open(top + '/b/f5', os.O_CREAT | os.O_WRONLY)
+    f.write(b'f5')
+    f.close()
+    tree['/b'] = ([], ['f5'])
+    added, removed, modified = ctx.diff(top, index, update=True)
+    assert added == ['b/f5']
+    assert removed == ['a/c', 'a/c/f4']
+    assert modified == []
+    assert ctx.diff(top, index) == ([], [], [])
+
+def test_snapshot_diff_modified(fixture, tmpdir):
+    ctx = fixture['ctx']
+    top = fixture['top']
+    index = str(tmpdir.join('tree.idx'))
+    ctx.snapshot(top, index)
+    # Same size, so only the mtime tells: it must be known however the
+    # entries were listed.
+    time.sleep(1.1)
+    f = ctx.open(top + '/a/f2', os.O_WRONLY)
+    f.write(b'F2' * 10)
+    f.close()
+    assert ctx.diff(top, index) == ([], [], ['a/f2'])